@@ -33,10 +33,9 @@ if [[ ! -f "$input_file" ]]; then
     exit 1
 else
     echo "...running: cysift chain on ${base}"
-    cysift pheno ${V} $input_file -t $pheno_file - |\
-	cysift tumor ${V} - - -o 131072 -f 0.50 -k 25 -t ${T} |\
-	cysift radialdens ${V} - - -t ${T} -f ${RAD} |\
-        cysift delaunay - ${base}.ptrd.cys -l 20
+    cysift run ${V} -t ${T} \
+	"pheno -t $pheno_file | tumor -o 131072 -f 0.50 -k 25 | radialdens -f ${RAD} | delaunay -l 20" \
+	$input_file ${base}.ptrd.cys
 
     # check_file_exists ${base}.ptrd.cys
     
@@ -0,0 +1,412 @@
+#include "cell_arrow.h"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef HAVE_ARROW
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/io/stdio.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/compression.h>
+#endif
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+  return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool IsArrowFile(const std::string& file) {
+  return ends_with(file, ".arrow") || ends_with(file, ".arrows") || ends_with(file, ".feather");
+}
+
+#ifndef HAVE_ARROW
+
+struct ArrowWriter::Impl {};
+struct ArrowReader::Impl {};
+
+static void no_arrow() {
+  throw std::runtime_error("cysift was built without Arrow support (HAVE_ARROW)");
+}
+
+ArrowWriter::ArrowWriter(const std::string& file) : m_file(file) { no_arrow(); }
+ArrowWriter::~ArrowWriter() = default;
+void ArrowWriter::WriteHeader(const CellHeader& header) { no_arrow(); }
+void ArrowWriter::WriteBlock(const CellBlock& block) { no_arrow(); }
+void ArrowWriter::Close() {}
+
+ArrowReader::ArrowReader() { no_arrow(); }
+ArrowReader::~ArrowReader() = default;
+void ArrowReader::OpenFile(const std::string& file) { no_arrow(); }
+void ArrowReader::OpenStream(std::istream& in) { no_arrow(); }
+void ArrowReader::ReadHeader(CellHeader& header) { no_arrow(); }
+bool ArrowReader::ReadBlock(CellBlock& block) { no_arrow(); return false; }
+
+#else
+
+// throw on an Arrow error, as the rest of cysift does
+static void check(const arrow::Status& status) {
+  if (!status.ok())
+    throw std::runtime_error("Arrow: " + status.ToString());
+}
+
+template <typename T>
+static T check(arrow::Result<T> result) {
+  check(result.status());
+  return std::move(result).ValueOrDie();
+}
+
+static std::shared_ptr<arrow::DataType> flag_type() {
+  return sizeof(cy_uint) == 8 ? arrow::uint64() : arrow::uint32();
+}
+
+// a column of the block as an array, sharing its memory
+template <typename T>
+static std::shared_ptr<arrow::ArrayData> wrap(const std::shared_ptr<arrow::DataType>& type,
+					      const T* data, size_t n) {
+  return arrow::ArrayData::Make(type, n, {nullptr, arrow::Buffer::Wrap(data, n)}, 0);
+}
+
+struct ArrowWriter::Impl {
+  std::shared_ptr<arrow::Schema> schema;
+  std::shared_ptr<arrow::io::OutputStream> sink;
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> writer;
+  size_t num_cols = 0;
+};
+
+ArrowWriter::ArrowWriter(const std::string& file) : m_file(file), m_impl(std::make_unique<Impl>()) {
+
+  if (file == "-")
+    m_impl->sink = std::make_shared<arrow::io::StdoutStream>();
+  else
+    m_impl->sink = check(arrow::io::FileOutputStream::Open(file));
+}
+
+ArrowWriter::~ArrowWriter() {
+
+  // finish the file if the caller didn't. Don't throw from a destructor
+  try {
+    Close();
+  } catch (const std::exception& e) {
+    std::cerr << "Error closing Arrow output: " << e.what() << std::endl;
+  }
+}
+
+void ArrowWriter::WriteHeader(const CellHeader& header) {
+
+  std::vector<std::shared_ptr<arrow::Field>> fields = {
+    arrow::field("id", arrow::uint32(), false),
+    arrow::field("cflag", flag_type(), false),
+    arrow::field("pflag", flag_type(), false),
+    arrow::field("x", arrow::float32(), false),
+    arrow::field("y", arrow::float32(), false)
+  };
+
+  for (const auto& t : header.GetDataTags()) {
+    auto meta = arrow::key_value_metadata({"cysift.tag"}, {t.type == Tag::MA_TAG ? "MA" : "CA"});
+    fields.push_back(arrow::field(t.id, arrow::float32(), false, meta));
+  }
+  m_impl->num_cols = header.GetDataTags().size();
+
+  fields.push_back(arrow::field("spat_ids", arrow::large_list(arrow::uint32()), false));
+  fields.push_back(arrow::field("spat_dist", arrow::large_list(arrow::uint32()), false));
+  fields.push_back(arrow::field("spat_flags", arrow::large_list(flag_type()), false));
+
+  std::ostringstream lines;
+  for (const auto& t : header)
+    lines << t << "\n";
+  m_impl->schema = arrow::schema(fields, arrow::key_value_metadata({"cysift.header"}, {lines.str()}));
+
+  auto options = arrow::ipc::IpcWriteOptions::Defaults();
+  const int level = m_codec.level ? m_codec.level : arrow::util::kUseDefaultCompressionLevel;
+  if (m_codec.id == CYS_CODEC_LZ4)
+    options.codec = check(arrow::util::Codec::Create(arrow::Compression::LZ4_FRAME, level));
+  else if (m_codec.id == CYS_CODEC_ZSTD)
+    options.codec = check(arrow::util::Codec::Create(arrow::Compression::ZSTD, level));
+
+  // the stream format for stdout and .arrows, else the file format
+  if (m_file == "-" || ends_with(m_file, ".arrows"))
+    m_impl->writer = check(arrow::ipc::MakeStreamWriter(m_impl->sink, m_impl->schema, options));
+  else
+    m_impl->writer = check(arrow::ipc::MakeFileWriter(m_impl->sink, m_impl->schema, options));
+}
+
+void ArrowWriter::WriteBlock(const CellBlock& block) {
+
+  if (!m_impl->writer)
+    throw std::runtime_error("ArrowWriter: header not written");
+  if (block.NumCols() != m_impl->num_cols)
+    throw std::runtime_error("ArrowWriter: block has " + std::to_string(block.NumCols()) +
+			     " data columns, header has " + std::to_string(m_impl->num_cols));
+
+  const size_t n = block.size();
+  if (!n)
+    return;
+
+  std::vector<std::shared_ptr<arrow::ArrayData>> cols = {
+    wrap(arrow::uint32(), block.m_ids.data(), n),
+    wrap(flag_type(), block.m_cell_flags.data(), n),
+    wrap(flag_type(), block.m_pheno_flags.data(), n),
+    wrap(arrow::float32(), block.m_x.data(), n),
+    wrap(arrow::float32(), block.m_y.data(), n)
+  };
+  for (const auto& c : block.m_cols)
+    cols.push_back(wrap(arrow::float32(), c.data(), n));
+
+  // the CSR offsets are the list offsets
+  const size_t edges = block.NumEdges();
+  auto offsets = arrow::Buffer::Wrap(reinterpret_cast<const int64_t*>(block.m_graph_offsets.data()), n + 1);
+  auto list = [&](const std::shared_ptr<arrow::ArrayData>& values) {
+    return arrow::ArrayData::Make(arrow::large_list(values->type), n, {nullptr, offsets}, {values}, 0);
+  };
+  cols.push_back(list(wrap(arrow::uint32(), block.m_graph_ids.data(), edges)));
+  cols.push_back(list(wrap(arrow::uint32(), block.m_graph_dist.data(), edges)));
+  cols.push_back(list(wrap(flag_type(), block.m_graph_flags.data(), edges)));
+
+  auto batch = arrow::RecordBatch::Make(m_impl->schema, n, cols);
+  check(m_impl->writer->WriteRecordBatch(*batch));
+}
+
+void ArrowWriter::Close() {
+
+  if (m_closed || !m_impl)
+    return;
+  m_closed = true;
+
+  if (m_impl->writer)
+    check(m_impl->writer->Close());
+  check(m_impl->sink->Close());
+}
+
+// an Arrow input stream over an istream, so stdin can be read
+// after the first byte was peeked at
+class IStreamInput : public arrow::io::InputStream {
+
+ public:
+
+  explicit IStreamInput(std::istream& in) : m_in(in) {}
+
+  arrow::Status Close() override { m_closed = true; return arrow::Status::OK(); }
+
+  bool closed() const override { return m_closed; }
+
+  arrow::Result<int64_t> Tell() const override { return m_pos; }
+
+  arrow::Result<int64_t> Read(int64_t nbytes, void* out) override {
+    m_in.read(static_cast<char*>(out), nbytes);
+    const int64_t n = m_in.gcount();
+    m_pos += n;
+    return n;
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> Read(int64_t nbytes) override {
+    ARROW_ASSIGN_OR_RAISE(auto buf, arrow::AllocateResizableBuffer(nbytes));
+    ARROW_ASSIGN_OR_RAISE(int64_t n, Read(nbytes, buf->mutable_data()));
+    ARROW_RETURN_NOT_OK(buf->Resize(n));
+    return std::shared_ptr<arrow::Buffer>(std::move(buf));
+  }
+
+ private:
+
+  std::istream& m_in;
+  int64_t m_pos = 0;
+  bool m_closed = false;
+};
+
+struct ArrowReader::Impl {
+
+  std::shared_ptr<arrow::Schema> schema;
+
+  // file format, read a batch at a time by index
+  std::shared_ptr<arrow::ipc::RecordBatchFileReader> file;
+  int next = 0;
+
+  // stream format
+  std::shared_ptr<arrow::ipc::RecordBatchStreamReader> stream;
+
+  // column of each cell field in the batches, -1 if none
+  int id = -1, cflag = -1, pflag = -1, x = -1, y = -1;
+  int g_ids = -1, g_dist = -1, g_flags = -1;
+  std::vector<int> data;
+
+};
+
+ArrowReader::ArrowReader() : m_impl(std::make_unique<Impl>()) {}
+
+ArrowReader::~ArrowReader() = default;
+
+void ArrowReader::OpenFile(const std::string& file) {
+  auto mapped = check(arrow::io::MemoryMappedFile::Open(file, arrow::io::FileMode::READ));
+  m_impl->file = check(arrow::ipc::RecordBatchFileReader::Open(mapped));
+  m_impl->schema = m_impl->file->schema();
+}
+
+void ArrowReader::OpenStream(std::istream& in) {
+  m_impl->stream = check(arrow::ipc::RecordBatchStreamReader::Open(std::make_shared<IStreamInput>(in)));
+  m_impl->schema = m_impl->stream->schema();
+}
+
+void ArrowReader::ReadHeader(CellHeader& header) {
+
+  const auto& schema = *m_impl->schema;
+  auto index = [&schema](const char* name) { return schema.GetFieldIndex(name); };
+  m_impl->id = index("id");
+  m_impl->x = index("x");
+  m_impl->y = index("y");
+  if (m_impl->id < 0 || m_impl->x < 0 || m_impl->y < 0)
+    throw std::runtime_error("Arrow input needs id, x and y columns");
+  m_impl->cflag = index("cflag");
+  m_impl->pflag = index("pflag");
+  m_impl->g_ids = index("spat_ids");
+  m_impl->g_dist = index("spat_dist");
+  m_impl->g_flags = index("spat_flags");
+
+  // program and graph tags come from the header lines, if any
+  if (schema.metadata()) {
+    const int k = schema.metadata()->FindKey("cysift.header");
+    if (k >= 0) {
+      std::istringstream lines(schema.metadata()->value(k));
+      std::string line;
+      while (std::getline(lines, line)) {
+	if (line.empty())
+	  continue;
+	Tag tag(line);
+	if (tag.type == Tag::PG_TAG || tag.type == Tag::GA_TAG)
+	  header.addTag(tag);
+      }
+    }
+  }
+
+  // the rest of the numeric columns are data
+  for (int i = 0; i < schema.num_fields(); i++) {
+    const auto& f = schema.field(i);
+    if (i == m_impl->id || i == m_impl->x || i == m_impl->y || i == m_impl->cflag ||
+	i == m_impl->pflag || i == m_impl->g_ids || i == m_impl->g_dist || i == m_impl->g_flags)
+      continue;
+    if (!arrow::is_integer(f->type()->id()) && !arrow::is_floating(f->type()->id())) {
+      std::cerr << "warning: skipping non-numeric Arrow column " << f->name() << std::endl;
+      continue;
+    }
+    bool meta = false;
+    if (f->metadata()) {
+      const int k = f->metadata()->FindKey("cysift.tag");
+      meta = k >= 0 && f->metadata()->value(k) == "CA";
+    }
+    header.addTag(Tag(meta ? Tag::CA_TAG : Tag::MA_TAG, f->name(), ""));
+    m_impl->data.push_back(i);
+  }
+}
+
+// copy a numeric array of any type into out
+template <typename Out>
+static void copy_numeric(const arrow::Array& array, Out* out) {
+
+  const int64_t n = array.length();
+  switch (array.type_id()) {
+#define CYS_ARROW_COPY(TYPE_ID, ARRAY_TYPE)				\
+    case arrow::Type::TYPE_ID: {					\
+      const auto* v = static_cast<const arrow::ARRAY_TYPE&>(array).raw_values(); \
+      for (int64_t i = 0; i < n; i++)					\
+	out[i] = static_cast<Out>(v[i]);				\
+      return;								\
+    }
+    CYS_ARROW_COPY(INT8, Int8Array)
+    CYS_ARROW_COPY(INT16, Int16Array)
+    CYS_ARROW_COPY(INT32, Int32Array)
+    CYS_ARROW_COPY(INT64, Int64Array)
+    CYS_ARROW_COPY(UINT8, UInt8Array)
+    CYS_ARROW_COPY(UINT16, UInt16Array)
+    CYS_ARROW_COPY(UINT32, UInt32Array)
+    CYS_ARROW_COPY(UINT64, UInt64Array)
+    CYS_ARROW_COPY(FLOAT, FloatArray)
+    CYS_ARROW_COPY(DOUBLE, DoubleArray)
+#undef CYS_ARROW_COPY
+  default:
+    throw std::runtime_error("Arrow: unsupported column type " + array.type()->ToString());
+  }
+}
+
+bool ArrowReader::ReadBlock(CellBlock& block) {
+
+  std::shared_ptr<arrow::RecordBatch> batch;
+  if (m_impl->file) {
+    if (m_impl->next >= m_impl->file->num_record_batches())
+      return false;
+    batch = check(m_impl->file->ReadRecordBatch(m_impl->next++));
+  } else {
+    check(m_impl->stream->ReadNext(&batch));
+    if (!batch)
+      return false;
+  }
+
+  const size_t n = batch->num_rows();
+  block.Init(m_impl->data.size());
+  block.m_ids.resize(n);
+  block.m_cell_flags.resize(n, 0);
+  block.m_pheno_flags.resize(n, 0);
+  block.m_x.resize(n);
+  block.m_y.resize(n);
+
+  copy_numeric(*batch->column(m_impl->id), block.m_ids.data());
+  copy_numeric(*batch->column(m_impl->x), block.m_x.data());
+  copy_numeric(*batch->column(m_impl->y), block.m_y.data());
+  if (m_impl->cflag >= 0)
+    copy_numeric(*batch->column(m_impl->cflag), block.m_cell_flags.data());
+  if (m_impl->pflag >= 0)
+    copy_numeric(*batch->column(m_impl->pflag), block.m_pheno_flags.data());
+  for (size_t j = 0; j < m_impl->data.size(); j++) {
+    block.m_cols[j].resize(n);
+    copy_numeric(*batch->column(m_impl->data[j]), block.m_cols[j].data());
+  }
+
+  // the graph, from lists of either offset width
+  block.m_graph_offsets.assign(n + 1, 0);
+  if (m_impl->g_ids >= 0) {
+
+    auto values = [&](int col, int64_t& start, int64_t& end) -> std::shared_ptr<arrow::Array> {
+      const auto& array = batch->column(col);
+      if (array->type_id() == arrow::Type::LARGE_LIST) {
+	const auto& list = static_cast<const arrow::LargeListArray&>(*array);
+	for (size_t i = 0; i <= n; i++)
+	  block.m_graph_offsets[i] = list.raw_value_offsets()[i] - list.raw_value_offsets()[0];
+	start = list.raw_value_offsets()[0];
+	end = list.raw_value_offsets()[n];
+	return list.values();
+      } else if (array->type_id() == arrow::Type::LIST) {
+	const auto& list = static_cast<const arrow::ListArray&>(*array);
+	for (size_t i = 0; i <= n; i++)
+	  block.m_graph_offsets[i] = list.raw_value_offsets()[i] - list.raw_value_offsets()[0];
+	start = list.raw_value_offsets()[0];
+	end = list.raw_value_offsets()[n];
+	return list.values();
+      }
+      throw std::runtime_error("Arrow: graph column " + batch->column_name(col) + " is not a list");
+    };
+
+    int64_t start = 0, end = 0;
+    auto ids = values(m_impl->g_ids, start, end)->Slice(start, end - start);
+    block.m_graph_ids.resize(end - start);
+    copy_numeric(*ids, block.m_graph_ids.data());
+
+    block.m_graph_dist.assign(end - start, 0);
+    block.m_graph_flags.assign(end - start, 0);
+    if (m_impl->g_dist >= 0) {
+      int64_t s = 0, e = 0;
+      auto dist = values(m_impl->g_dist, s, e)->Slice(s, e - s);
+      if (e - s != end - start)
+	throw std::runtime_error("Arrow: spat_dist does not line up with spat_ids");
+      copy_numeric(*dist, block.m_graph_dist.data());
+    }
+    if (m_impl->g_flags >= 0) {
+      int64_t s = 0, e = 0;
+      auto flags = values(m_impl->g_flags, s, e)->Slice(s, e - s);
+      if (e - s != end - start)
+	throw std::runtime_error("Arrow: spat_flags does not line up with spat_ids");
+      copy_numeric(*flags, block.m_graph_flags.data());
+    }
+  }
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "cell_block.h"
+#include "cell_codec.h"
+#include "cell_header.h"
+
+#include <istream>
+#include <memory>
+#include <string>
+
+// true if the file is named as Arrow IPC output: .arrow or .feather
+// for the (memory-mappable) file format, .arrows for the stream format
+bool IsArrowFile(const std::string& file);
+
+/**
+ * @class ArrowWriter
+ * @brief Writes cells as Arrow IPC record batches, one per CellBlock
+ *
+ * The columns are id, cflag, pflag, x, y, then one float column per data
+ * tag, named by its id. The graph is three large_list columns (spat_ids,
+ * spat_dist, spat_flags), whose offsets are the CSR offsets of the block.
+ * Every column is handed to Arrow straight from the block, without a copy.
+ *
+ * Each data field has "cysift.tag" metadata of MA or CA, and the schema
+ * has the header lines as "cysift.header", so that ArrowReader can give
+ * back the same header. Needs cysift built with HAVE_ARROW.
+ */
+class ArrowWriter {
+
+ public:
+
+  // file is a path, or "-" for the stream format on stdout
+  explicit ArrowWriter(const std::string& file);
+
+  ~ArrowWriter();
+
+  ArrowWriter(const ArrowWriter&) = delete;
+  ArrowWriter& operator=(const ArrowWriter&) = delete;
+
+  // compress the record batch buffers (lz4 or zstd). Compressed files
+  // can't be memory-mapped without a copy
+  void SetCodec(const CysCodec& codec) { m_codec = codec; }
+
+  void WriteHeader(const CellHeader& header);
+
+  void WriteBlock(const CellBlock& block);
+
+  // write the file footer
+  void Close();
+
+ private:
+
+  std::string m_file;
+  CysCodec m_codec;
+  bool m_closed = false;
+
+  // the Arrow objects, kept out of this header
+  struct Impl;
+  std::unique_ptr<Impl> m_impl;
+
+};
+
+/**
+ * @class ArrowReader
+ * @brief Reads Arrow IPC record batches into CellBlocks
+ *
+ * Files in the file format are memory-mapped; the stream format is read
+ * from any istream (e.g. stdin). Besides the files of ArrowWriter, any
+ * table with id, x and y columns can be read. Other numeric columns are
+ * data columns, taken as markers unless their "cysift.tag" is CA.
+ * Flags and the graph are optional.
+ */
+class ArrowReader {
+
+ public:
+
+  ArrowReader();
+
+  ~ArrowReader();
+
+  ArrowReader(const ArrowReader&) = delete;
+  ArrowReader& operator=(const ArrowReader&) = delete;
+
+  // memory-map a file in the Arrow file format
+  void OpenFile(const std::string& file);
+
+  // read the Arrow stream format from in
+  void OpenStream(std::istream& in);
+
+  void ReadHeader(CellHeader& header);
+
+  // read the next record batch. Returns false at the end
+  bool ReadBlock(CellBlock& block);
+
+ private:
+
+  struct Impl;
+  std::unique_ptr<Impl> m_impl;
+
+};
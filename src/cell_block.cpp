@@ -0,0 +1,597 @@
+#include "cell_block.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+// append a raw array to the buffer at pos, padded to CYS_ALIGN
+template <typename T>
+static void put_array(std::string& buffer, size_t& pos, const std::vector<T>& vec) {
+  size_t nbytes = vec.size() * sizeof(T);
+  if (nbytes)
+    std::memcpy(&buffer[pos], vec.data(), nbytes);
+  pos += cys_pad(nbytes);
+}
+
+// point a span at n elements of the payload at pos
+template <typename T>
+static void map_array(const char* data, size_t len, size_t& pos, size_t n, ConstSpan<T>& span) {
+  size_t nbytes = n * sizeof(T);
+  if (pos + nbytes > len)
+    throw std::runtime_error("CellBlock: truncated block payload");
+  span = ConstSpan<T>(reinterpret_cast<const T*>(data + pos), n);
+  pos += cys_pad(nbytes);
+}
+
+// LEB128 style variable length integers
+static void put_varint(std::string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+static uint64_t get_varint(const uint8_t*& p, const uint8_t* end) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (p >= end)
+      throw std::runtime_error("CellBlock: truncated graph stream");
+    uint8_t b = *p++;
+    v |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+  throw std::runtime_error("CellBlock: corrupt graph stream");
+}
+
+// map signed deltas onto small unsigned values
+static uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+template <typename T>
+static void copy_span(const ConstSpan<T>& span, std::vector<T>& vec) {
+  vec.assign(span.begin(), span.end());
+}
+
+void CellBlock::Init(size_t num_cols) {
+  m_cols.resize(num_cols);
+  clear();
+}
+
+void CellBlock::clear() {
+
+  m_ids.clear();
+  m_pheno_flags.clear();
+  m_cell_flags.clear();
+  m_x.clear();
+  m_y.clear();
+
+  for (auto& c : m_cols)
+    c.clear();
+
+  m_graph_offsets.assign(1, 0);
+  m_graph_ids.clear();
+  m_graph_dist.clear();
+  m_graph_flags.clear();
+}
+
+void CellBlock::reserve(size_t n) {
+
+  m_ids.reserve(n);
+  m_pheno_flags.reserve(n);
+  m_cell_flags.reserve(n);
+  m_x.reserve(n);
+  m_y.reserve(n);
+
+  for (auto& c : m_cols)
+    c.reserve(n);
+
+  m_graph_offsets.reserve(n + 1);
+}
+
+void CellBlock::AddCell(const Cell& cell) {
+
+  if (cell.m_cols.size() != m_cols.size())
+    throw std::runtime_error("CellBlock: cell has " + std::to_string(cell.m_cols.size()) +
+			     " data columns, block expects " + std::to_string(m_cols.size()));
+
+  m_ids.push_back(cell.m_id);
+  m_pheno_flags.push_back(cell.m_pheno_flag);
+  m_cell_flags.push_back(cell.m_cell_flag);
+  m_x.push_back(cell.m_x);
+  m_y.push_back(cell.m_y);
+
+  for (size_t i = 0; i < m_cols.size(); i++)
+    m_cols[i].push_back(cell.m_cols[i]);
+
+  // graph. Flags are optional on the Cell, so fill with 0 if not present
+  assert(cell.m_spatial_ids.size() == cell.m_spatial_dist.size());
+  m_graph_ids.insert(m_graph_ids.end(), cell.m_spatial_ids.begin(), cell.m_spatial_ids.end());
+  m_graph_dist.insert(m_graph_dist.end(), cell.m_spatial_dist.begin(), cell.m_spatial_dist.end());
+  if (cell.m_spatial_flags.size() == cell.m_spatial_ids.size())
+    m_graph_flags.insert(m_graph_flags.end(), cell.m_spatial_flags.begin(), cell.m_spatial_flags.end());
+  else
+    m_graph_flags.resize(m_graph_ids.size(), 0);
+
+  m_graph_offsets.push_back(m_graph_ids.size());
+
+}
+
+void CellBlock::GetCell(size_t i, Cell& cell) const {
+
+  assert(i < size());
+
+  cell.m_id = m_ids[i];
+  cell.m_pheno_flag = m_pheno_flags[i];
+  cell.m_cell_flag = m_cell_flags[i];
+  cell.m_x = m_x[i];
+  cell.m_y = m_y[i];
+
+  cell.m_cols.resize(m_cols.size());
+  for (size_t j = 0; j < m_cols.size(); j++)
+    cell.m_cols[j] = m_cols[j][i];
+
+  const uint64_t start = m_graph_offsets[i];
+  const uint64_t end   = m_graph_offsets[i + 1];
+  cell.m_spatial_ids.assign(m_graph_ids.begin() + start, m_graph_ids.begin() + end);
+  cell.m_spatial_dist.assign(m_graph_dist.begin() + start, m_graph_dist.begin() + end);
+  cell.m_spatial_flags.assign(m_graph_flags.begin() + start, m_graph_flags.begin() + end);
+
+}
+
+void CellBlock::KeepRows(const std::vector<char>& keep) {
+
+  assert(keep.size() == size());
+
+  size_t k = 0;
+  uint64_t e = 0;
+  for (size_t i = 0; i < keep.size(); i++) {
+
+    const uint64_t start = m_graph_offsets[i];
+    const uint64_t end   = m_graph_offsets[i + 1];
+    if (!keep[i])
+      continue;
+
+    m_ids[k] = m_ids[i];
+    m_pheno_flags[k] = m_pheno_flags[i];
+    m_cell_flags[k] = m_cell_flags[i];
+    m_x[k] = m_x[i];
+    m_y[k] = m_y[i];
+    for (auto& c : m_cols)
+      c[k] = c[i];
+
+    // rows only move down, so the neighbors can be moved in place too
+    for (uint64_t j = start; j < end; j++, e++) {
+      m_graph_ids[e] = m_graph_ids[j];
+      m_graph_dist[e] = m_graph_dist[j];
+      m_graph_flags[e] = m_graph_flags[j];
+    }
+    m_graph_offsets[++k] = e;
+  }
+
+  m_ids.resize(k);
+  m_pheno_flags.resize(k);
+  m_cell_flags.resize(k);
+  m_x.resize(k);
+  m_y.resize(k);
+  for (auto& c : m_cols)
+    c.resize(k);
+
+  m_graph_offsets.resize(k + 1);
+  m_graph_ids.resize(e);
+  m_graph_dist.resize(e);
+  m_graph_flags.resize(e);
+}
+
+void CellBlock::Encode(std::string& buffer) const {
+
+  const size_t n = size();
+  const size_t e = NumEdges();
+
+  BlockLayout layout;
+  layout.num_cells = n;
+  layout.num_cols = m_cols.size();
+  layout.num_edges = e;
+  layout.graph_encoding = m_graph_encoding;
+
+  // the compact graph has to be built first, to know its size
+  std::string stream;
+  std::vector<cy_uint> dict;
+  std::vector<uint64_t> graph_sizes;
+  if (m_graph_encoding == CYS_GRAPH_VARINT) {
+    encode_graph_varint(stream, dict);
+    graph_sizes = {stream.size(), dict.size()};
+  }
+  
+  // size everything up front so there is a single allocation
+  size_t total = cys_pad(sizeof(BlockLayout)) +
+    cys_pad(n * sizeof(uint32_t)) +
+    2 * cys_pad(n * sizeof(cy_uint)) +
+    2 * cys_pad(n * sizeof(float)) +
+    m_cols.size() * cys_pad(n * sizeof(float));
+
+  if (m_graph_encoding == CYS_GRAPH_VARINT)
+    total += cys_pad(graph_sizes.size() * sizeof(uint64_t)) +
+      cys_pad(dict.size() * sizeof(cy_uint)) +
+      cys_pad(stream.size());
+  else
+    total += cys_pad((n + 1) * sizeof(uint64_t)) +
+      2 * cys_pad(e * sizeof(uint32_t)) +
+      cys_pad(e * sizeof(cy_uint));
+
+  buffer.assign(total, 0);
+
+  size_t pos = 0;
+  std::memcpy(&buffer[pos], &layout, sizeof(BlockLayout));
+  pos += cys_pad(sizeof(BlockLayout));
+
+  put_array(buffer, pos, m_ids);
+  put_array(buffer, pos, m_pheno_flags);
+  put_array(buffer, pos, m_cell_flags);
+  put_array(buffer, pos, m_x);
+  put_array(buffer, pos, m_y);
+
+  for (const auto& c : m_cols)
+    put_array(buffer, pos, c);
+
+  if (m_graph_encoding == CYS_GRAPH_VARINT) {
+    put_array(buffer, pos, graph_sizes);
+    put_array(buffer, pos, dict);
+    if (!stream.empty())
+      std::memcpy(&buffer[pos], stream.data(), stream.size());
+    pos += cys_pad(stream.size());
+  } else {
+    put_array(buffer, pos, m_graph_offsets);
+    put_array(buffer, pos, m_graph_ids);
+    put_array(buffer, pos, m_graph_dist);
+    put_array(buffer, pos, m_graph_flags);
+  }
+
+  assert(pos == total);
+}
+
+void CellBlock::encode_graph_varint(std::string& stream, std::vector<cy_uint>& dict) const {
+
+  std::unordered_map<cy_uint, uint64_t> dict_index;
+  std::vector<size_t> order;
+
+  stream.reserve(NumEdges() * 3 + size());
+  
+  for (size_t i = 0; i < size(); i++) {
+
+    const uint64_t start = m_graph_offsets[i];
+    const uint64_t end   = m_graph_offsets[i + 1];
+    put_varint(stream, end - start);
+
+    // sort the neighbors so the id deltas are small
+    order.resize(end - start);
+    std::iota(order.begin(), order.end(), start);
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return m_graph_ids[a] < m_graph_ids[b];
+    });
+
+    int64_t prev = m_ids[i];
+    for (size_t k : order) {
+
+      const int64_t id = m_graph_ids[k];
+      put_varint(stream, zigzag(id - prev));
+      prev = id;
+
+      put_varint(stream, m_graph_dist[k]);
+
+      auto it = dict_index.find(m_graph_flags[k]);
+      if (it == dict_index.end()) {
+	it = dict_index.emplace(m_graph_flags[k], dict.size()).first;
+	dict.push_back(m_graph_flags[k]);
+      }
+      put_varint(stream, it->second);
+    }
+  }
+
+}
+
+void BlockView::Map(const char* data, size_t len, bool graph) {
+
+  if (len < sizeof(BlockLayout))
+    throw std::runtime_error("CellBlock: block payload too small");
+
+  std::memcpy(&layout, data, sizeof(BlockLayout));
+
+  if (layout.flag_width != sizeof(cy_uint))
+    throw std::runtime_error("CellBlock: file written with " + std::to_string(layout.flag_width * 8) +
+			     "-bit flags, but cysift built with " + std::to_string(sizeof(cy_uint) * 8) + "-bit flags");
+
+  const size_t n = layout.num_cells;
+  const size_t e = layout.num_edges;
+  size_t pos = cys_pad(sizeof(BlockLayout));
+
+  map_array(data, len, pos, n, ids);
+  map_array(data, len, pos, n, pheno_flags);
+  map_array(data, len, pos, n, cell_flags);
+  map_array(data, len, pos, n, x);
+  map_array(data, len, pos, n, y);
+
+  cols.resize(layout.num_cols);
+  for (auto& c : cols)
+    map_array(data, len, pos, n, c);
+
+  graph_offsets = ConstSpan<uint64_t>();
+  graph_ids = ConstSpan<uint32_t>();
+  graph_dist = ConstSpan<uint32_t>();
+  graph_flags = ConstSpan<cy_uint>();
+  if (!graph)
+    return;
+  
+  if (layout.graph_encoding == CYS_GRAPH_RAW) {
+    map_array(data, len, pos, n + 1, graph_offsets);
+    map_array(data, len, pos, e, graph_ids);
+    map_array(data, len, pos, e, graph_dist);
+    map_array(data, len, pos, e, graph_flags);
+    return;
+  }
+
+  if (layout.graph_encoding != CYS_GRAPH_VARINT)
+    throw std::runtime_error("CellBlock: unknown graph encoding " + std::to_string(layout.graph_encoding));
+
+  ConstSpan<uint64_t> graph_sizes;
+  ConstSpan<cy_uint> dict;
+  ConstSpan<char> stream;
+  map_array(data, len, pos, 2, graph_sizes);
+  map_array(data, len, pos, graph_sizes[1], dict);
+  map_array(data, len, pos, graph_sizes[0], stream);
+
+  // decode the graph into the view's own storage
+  decoded_offsets.resize(n + 1);
+  decoded_ids.resize(e);
+  decoded_dist.resize(e);
+  decoded_flags.resize(e);
+
+  const uint8_t* p   = reinterpret_cast<const uint8_t*>(stream.begin());
+  const uint8_t* end = reinterpret_cast<const uint8_t*>(stream.end());
+  uint64_t k = 0;
+  decoded_offsets[0] = 0;
+  for (size_t i = 0; i < n; i++) {
+    
+    const uint64_t count = get_varint(p, end);
+    if (k + count > e)
+      throw std::runtime_error("CellBlock: corrupt graph stream");
+    
+    int64_t prev = ids[i];
+    for (uint64_t j = 0; j < count; j++, k++) {
+      prev += unzigzag(get_varint(p, end));
+      decoded_ids[k] = static_cast<uint32_t>(prev);
+      decoded_dist[k] = static_cast<uint32_t>(get_varint(p, end));
+      const uint64_t f = get_varint(p, end);
+      if (f >= dict.size())
+	throw std::runtime_error("CellBlock: corrupt graph flag index");
+      decoded_flags[k] = dict[f];
+    }
+    decoded_offsets[i + 1] = k;
+  }
+  
+  graph_offsets = ConstSpan<uint64_t>(decoded_offsets.data(), decoded_offsets.size());
+  graph_ids     = ConstSpan<uint32_t>(decoded_ids.data(), decoded_ids.size());
+  graph_dist    = ConstSpan<uint32_t>(decoded_dist.data(), decoded_dist.size());
+  graph_flags   = ConstSpan<cy_uint>(decoded_flags.data(), decoded_flags.size());
+
+}
+
+void CellBlock::Decode(const char* data, size_t len) {
+
+  BlockView view;
+  view.Map(data, len);
+
+  copy_span(view.ids, m_ids);
+  copy_span(view.pheno_flags, m_pheno_flags);
+  copy_span(view.cell_flags, m_cell_flags);
+  copy_span(view.x, m_x);
+  copy_span(view.y, m_y);
+
+  m_cols.resize(view.cols.size());
+  for (size_t i = 0; i < m_cols.size(); i++)
+    copy_span(view.cols[i], m_cols[i]);
+
+  // a decoded graph can be taken over rather than copied
+  if (view.layout.graph_encoding == CYS_GRAPH_RAW) {
+    copy_span(view.graph_offsets, m_graph_offsets);
+    copy_span(view.graph_ids, m_graph_ids);
+    copy_span(view.graph_dist, m_graph_dist);
+    copy_span(view.graph_flags, m_graph_flags);
+  } else {
+    m_graph_offsets.swap(view.decoded_offsets);
+    m_graph_ids.swap(view.decoded_ids);
+    m_graph_dist.swap(view.decoded_dist);
+    m_graph_flags.swap(view.decoded_flags);
+  }
+
+}
+
+// range of the non-NaN values in v
+static void min_max(const std::vector<float>& v, float& lo, float& hi) {
+  lo = std::numeric_limits<float>::infinity();
+  hi = -std::numeric_limits<float>::infinity();
+  for (const float f : v) {
+    if (f < lo) lo = f;
+    if (f > hi) hi = f;
+  }
+}
+
+void BlockStats::Compute(const CellBlock& block) {
+
+  num_cells = block.size();
+
+  pflag_or = cflag_or = 0;
+  pflag_and = cflag_and = num_cells ? ~static_cast<cy_uint>(0) : 0;
+  for (size_t i = 0; i < num_cells; i++) {
+    pflag_or |= block.m_pheno_flags[i];
+    pflag_and &= block.m_pheno_flags[i];
+    cflag_or |= block.m_cell_flags[i];
+    cflag_and &= block.m_cell_flags[i];
+  }
+
+  min_max(block.m_x, x_min, x_max);
+  min_max(block.m_y, y_min, y_max);
+
+  col_min.resize(block.NumCols());
+  col_max.resize(block.NumCols());
+  for (size_t c = 0; c < block.NumCols(); c++)
+    min_max(block.m_cols[c], col_min[c], col_max[c]);
+}
+
+// layout: num_cells, num_cols, flag_width, then the four flag summaries,
+// the x and y ranges, and the column minimums then maximums
+void BlockStats::Encode(std::string& buffer) const {
+
+  const uint32_t fixed[3] = {num_cells, static_cast<uint32_t>(col_min.size()),
+			     static_cast<uint32_t>(sizeof(cy_uint))};
+  const cy_uint flags[4] = {pflag_or, pflag_and, cflag_or, cflag_and};
+  const float xy[4] = {x_min, x_max, y_min, y_max};
+
+  buffer.clear();
+  buffer.append(reinterpret_cast<const char*>(fixed), sizeof(fixed));
+  buffer.append(reinterpret_cast<const char*>(flags), sizeof(flags));
+  buffer.append(reinterpret_cast<const char*>(xy), sizeof(xy));
+  buffer.append(reinterpret_cast<const char*>(col_min.data()), col_min.size() * sizeof(float));
+  buffer.append(reinterpret_cast<const char*>(col_max.data()), col_max.size() * sizeof(float));
+}
+
+void BlockStats::Decode(const char* data, size_t len) {
+
+  uint32_t fixed[3];
+  cy_uint flags[4];
+  float xy[4];
+  const size_t head = sizeof(fixed) + sizeof(flags) + sizeof(xy);
+
+  if (len < sizeof(fixed))
+    throw std::runtime_error("Corrupt .cys file: truncated block stats");
+  std::memcpy(fixed, data, sizeof(fixed));
+
+  if (fixed[2] != sizeof(cy_uint))
+    throw std::runtime_error("Block stats written with " + std::to_string(fixed[2] * 8) +
+			     " bit flags, but cysift was built with " +
+			     std::to_string(sizeof(cy_uint) * 8) + " bit flags");
+  if (len < head + 2 * fixed[1] * sizeof(float))
+    throw std::runtime_error("Corrupt .cys file: truncated block stats");
+
+  std::memcpy(flags, data + sizeof(fixed), sizeof(flags));
+  std::memcpy(xy, data + sizeof(fixed) + sizeof(flags), sizeof(xy));
+
+  num_cells = fixed[0];
+  pflag_or = flags[0];
+  pflag_and = flags[1];
+  cflag_or = flags[2];
+  cflag_and = flags[3];
+  x_min = xy[0];
+  x_max = xy[1];
+  y_min = xy[2];
+  y_max = xy[3];
+
+  col_min.resize(fixed[1]);
+  col_max.resize(fixed[1]);
+  if (fixed[1]) {
+    std::memcpy(col_min.data(), data + head, fixed[1] * sizeof(float));
+    std::memcpy(col_max.data(), data + head + fixed[1] * sizeof(float), fixed[1] * sizeof(float));
+  }
+}
+
+void FileStats::Init(size_t num_cols) {
+
+  num_cells = 0;
+  x_min = y_min = std::numeric_limits<float>::infinity();
+  x_max = y_max = -std::numeric_limits<float>::infinity();
+  pflag_or = cflag_or = 0;
+
+  ColumnStats empty;
+  empty.min = std::numeric_limits<float>::infinity();
+  empty.max = -std::numeric_limits<float>::infinity();
+  cols.assign(num_cols, empty);
+}
+
+void FileStats::Add(const CellBlock& block, const BlockStats& stats) {
+
+  if (cols.size() != block.NumCols())
+    throw std::runtime_error("FileStats: block has " + std::to_string(block.NumCols()) +
+			     " columns, expected " + std::to_string(cols.size()));
+
+  num_cells += block.size();
+  x_min = std::min(x_min, stats.x_min);
+  x_max = std::max(x_max, stats.x_max);
+  y_min = std::min(y_min, stats.y_min);
+  y_max = std::max(y_max, stats.y_max);
+  pflag_or |= stats.pflag_or;
+  cflag_or |= stats.cflag_or;
+
+  for (size_t c = 0; c < cols.size(); c++) {
+    ColumnStats& cs = cols[c];
+    cs.min = std::min(cs.min, stats.col_min[c]);
+    cs.max = std::max(cs.max, stats.col_max[c]);
+    for (const float f : block.m_cols[c]) {
+      if (std::isnan(f))
+	continue;
+      cs.count++;
+      cs.sum += f;
+      cs.sumsq += static_cast<double>(f) * f;
+    }
+  }
+}
+
+// layout: num_cells, num_cols and flag_width, the bounding box,
+// the flag summaries, then a ColumnStats record per column
+void FileStats::Encode(std::string& buffer) const {
+
+  const uint32_t fixed[2] = {static_cast<uint32_t>(cols.size()),
+			     static_cast<uint32_t>(sizeof(cy_uint))};
+  const float xy[4] = {x_min, x_max, y_min, y_max};
+  const cy_uint flags[2] = {pflag_or, cflag_or};
+
+  buffer.clear();
+  buffer.append(reinterpret_cast<const char*>(&num_cells), sizeof(num_cells));
+  buffer.append(reinterpret_cast<const char*>(fixed), sizeof(fixed));
+  buffer.append(reinterpret_cast<const char*>(xy), sizeof(xy));
+  buffer.append(reinterpret_cast<const char*>(flags), sizeof(flags));
+  buffer.append(reinterpret_cast<const char*>(cols.data()), cols.size() * sizeof(ColumnStats));
+}
+
+void FileStats::Decode(const char* data, size_t len) {
+
+  uint32_t fixed[2];
+  float xy[4];
+  cy_uint flags[2];
+  const size_t head = sizeof(num_cells) + sizeof(fixed) + sizeof(xy) + sizeof(flags);
+
+  if (len < sizeof(num_cells) + sizeof(fixed))
+    throw std::runtime_error("Corrupt .cys file: truncated footer");
+  std::memcpy(&num_cells, data, sizeof(num_cells));
+  std::memcpy(fixed, data + sizeof(num_cells), sizeof(fixed));
+
+  if (fixed[1] != sizeof(cy_uint))
+    throw std::runtime_error("Footer written with " + std::to_string(fixed[1] * 8) +
+			     " bit flags, but cysift was built with " +
+			     std::to_string(sizeof(cy_uint) * 8) + " bit flags");
+  if (len < head + fixed[0] * sizeof(ColumnStats))
+    throw std::runtime_error("Corrupt .cys file: truncated footer");
+
+  std::memcpy(xy, data + sizeof(num_cells) + sizeof(fixed), sizeof(xy));
+  std::memcpy(flags, data + sizeof(num_cells) + sizeof(fixed) + sizeof(xy), sizeof(flags));
+  x_min = xy[0];
+  x_max = xy[1];
+  y_min = xy[2];
+  y_max = xy[3];
+  pflag_or = flags[0];
+  cflag_or = flags[1];
+
+  cols.resize(fixed[0]);
+  if (fixed[0])
+    std::memcpy(cols.data(), data + head, fixed[0] * sizeof(ColumnStats));
+}
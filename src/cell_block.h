@@ -0,0 +1,309 @@
+#pragma once
+
+#include "cysift.h"
+#include "cell_row.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// number of cells stored in each row group of a block-formatted .cys file
+#define CYS_BLOCK_SIZE 65536
+
+// first bytes of a block-formatted .cys file. Legacy (per-Cell cereal)
+// files start instead with the cereal endianness byte (0 or 1)
+const char CYS_MAGIC[4] = {'C', 'Y', 'S', 2};
+
+// every frame and payload starts on this byte boundary
+const size_t CYS_ALIGN = 8;
+
+// frame types
+const uint32_t CYS_FRAME_END   = 0; // end of the cell data
+const uint32_t CYS_FRAME_BLOCK = 1; // a row group of cells
+const uint32_t CYS_FRAME_STATS = 2; // zone map of the block frame that follows
+const uint32_t CYS_FRAME_FOOTER = 3;// whole-file FileStats, just before the end frame
+
+// marks the start of every frame, for sanity checking
+const uint32_t CYS_FRAME_MAGIC = 0x46535943; // "CYSF"
+
+// storage of the spatial graph within a block
+const uint32_t CYS_GRAPH_RAW    = 0; // flat offset, id, dist and flag arrays
+const uint32_t CYS_GRAPH_VARINT = 1; // per-cell sorted by id (so reordered), delta + varint coded, with a flag dictionary
+
+/**
+ * @struct BlockFrame
+ * @brief Fixed-size record that precedes every frame of a block-formatted .cys file
+ *
+ * The payload follows directly after the frame and is padded to CYS_ALIGN
+ */
+struct BlockFrame {
+  uint32_t magic = CYS_FRAME_MAGIC;
+  uint32_t type = CYS_FRAME_END;
+  uint32_t codec = 0;      // compression of the payload (0 = none)
+  uint32_t num_cells = 0;  // number of cells in the block
+  uint64_t raw_size = 0;   // size of the decoded payload
+  uint64_t stored_size = 0;// size of the payload as stored in the file
+};
+
+static_assert(sizeof(BlockFrame) == 32, "BlockFrame must be packed to 32 bytes");
+
+/**
+ * @struct BlockLayout
+ * @brief Leading record of a decoded block payload, giving the column sizes
+ */
+struct BlockLayout {
+  uint32_t num_cells = 0;
+  uint32_t num_cols = 0;
+  uint64_t num_edges = 0;
+  uint32_t flag_width = sizeof(cy_uint); // width of the stored flags, to catch 32/64 bit mismatch
+  uint32_t graph_encoding = 0;
+};
+
+static_assert(sizeof(BlockLayout) == 24, "BlockLayout must be packed to 24 bytes");
+
+// pad a byte count up to the next CYS_ALIGN boundary
+inline uint64_t cys_pad(uint64_t n) {
+  return (n + CYS_ALIGN - 1) / CYS_ALIGN * CYS_ALIGN;
+}
+
+/**
+ * @struct ConstSpan
+ * @brief Read-only view of a contiguous array that is owned elsewhere
+ */
+template <typename T>
+struct ConstSpan {
+
+  ConstSpan() = default;
+
+  ConstSpan(const T* d, size_t n) : data(d), len(n) {}
+
+  const T& operator[](size_t i) const { return data[i]; }
+
+  size_t size() const { return len; }
+
+  bool empty() const { return len == 0; }
+
+  const T* begin() const { return data; }
+
+  const T* end() const { return data + len; }
+
+  const T* data = nullptr;
+  size_t len = 0;
+};
+
+/**
+ * @struct BlockView
+ * @brief Column spans pointing directly into an encoded block payload
+ *
+ * The payload must outlive the view. Used by CellBlock::Decode and
+ * by MappedCysFile to read columns without copying them.
+ *
+ * A varint-coded graph can't be viewed in place, so it is decoded
+ * into storage held by the view, and the graph spans point there.
+ * The view can be moved but not copied, to keep those spans valid
+ */
+struct BlockView {
+
+  BlockView() = default;
+  BlockView(const BlockView&) = delete;
+  BlockView& operator=(const BlockView&) = delete;
+  BlockView(BlockView&&) = default;
+  BlockView& operator=(BlockView&&) = default;
+
+  // point the spans at the sections of an encoded payload. Without
+  // graph, the graph spans are left empty and a varint graph isn't decoded
+  void Map(const char* data, size_t len, bool graph = true);
+
+  size_t size() const { return ids.size(); }
+
+  BlockLayout layout;
+
+  ConstSpan<uint32_t> ids;
+  ConstSpan<cy_uint> pheno_flags;
+  ConstSpan<cy_uint> cell_flags;
+  ConstSpan<float> x;
+  ConstSpan<float> y;
+
+  std::vector<ConstSpan<float>> cols;
+
+  ConstSpan<uint64_t> graph_offsets;
+  ConstSpan<uint32_t> graph_ids;
+  ConstSpan<uint32_t> graph_dist;
+  ConstSpan<cy_uint> graph_flags;
+
+  // decoded graph, for CYS_GRAPH_VARINT blocks
+  std::vector<uint64_t> decoded_offsets;
+  std::vector<uint32_t> decoded_ids;
+  std::vector<uint32_t> decoded_dist;
+  std::vector<cy_uint> decoded_flags;
+};
+
+/**
+ * @class CellBlock
+ * @brief A row group of cells, stored column by column
+ *
+ * Each fixed field (id, flags, x, y) and each data column is its own
+ * contiguous vector. The spatial graph is stored in compressed sparse row
+ * form: the neighbors of cell i are at [m_graph_offsets[i], m_graph_offsets[i+1])
+ * in the m_graph_* vectors.
+ *
+ * The encoded payload is a short layout record followed by each column as raw
+ * (host byte order) values, each padded to CYS_ALIGN. With CYS_GRAPH_VARINT
+ * (the default), the graph is instead written per cell with neighbors sorted
+ * by id, ids delta coded from the previous neighbor (starting from the cell's
+ * own id), and the flags stored as indices into a per-block dictionary.
+ *
+ * So varint coding reorders each cell's neighbor list: it decodes sorted by
+ * id, with each distance and flag still paired with its neighbor, rather
+ * than in the order it was built (e.g. nearest first). Output that needs the
+ * original order is written with CYS_GRAPH_RAW (cysift --raw-graph)
+ */
+class CellBlock {
+
+ public:
+
+  CellBlock() = default;
+
+  explicit CellBlock(size_t num_cols) { Init(num_cols); }
+
+  // clear the block and set the number of data columns
+  void Init(size_t num_cols);
+
+  void clear();
+
+  void reserve(size_t n);
+
+  size_t size() const { return m_ids.size(); }
+
+  size_t NumCols() const { return m_cols.size(); }
+
+  size_t NumEdges() const { return m_graph_ids.size(); }
+
+  // add a cell to the end of the block
+  void AddCell(const Cell& cell);
+
+  // fill a cell with the values from row i
+  void GetCell(size_t i, Cell& cell) const;
+
+  // keep only the rows i with keep[i] set, in order, compacting
+  // every column and the graph in place
+  void KeepRows(const std::vector<char>& keep);
+
+  // set how the graph is stored by Encode
+  void SetGraphEncoding(uint32_t encoding) { m_graph_encoding = encoding; }
+
+  // serialize the block to a contiguous buffer
+  void Encode(std::string& buffer) const;
+
+  // fill the block from an encoded buffer
+  void Decode(const char* data, size_t len);
+
+  // fixed fields
+  std::vector<uint32_t> m_ids;
+  std::vector<cy_uint> m_pheno_flags;
+  std::vector<cy_uint> m_cell_flags;
+  std::vector<float> m_x;
+  std::vector<float> m_y;
+
+  // data columns, in header order
+  std::vector<std::vector<float>> m_cols;
+
+  // spatial graph (CSR)
+  std::vector<uint64_t> m_graph_offsets = {0};
+  std::vector<uint32_t> m_graph_ids;
+  std::vector<uint32_t> m_graph_dist;
+  std::vector<cy_uint> m_graph_flags;
+
+ private:
+
+  uint32_t m_graph_encoding = CYS_GRAPH_VARINT;
+
+  // write the graph as a varint stream and the flag dictionary
+  void encode_graph_varint(std::string& stream, std::vector<cy_uint>& dict) const;
+
+};
+
+/**
+ * @struct BlockStats
+ * @brief Zone map of one block: value ranges of x, y and each data column,
+ * and OR / AND summaries of the flags
+ *
+ * Written as a small uncompressed frame just before each block frame,
+ * so that readers can rule out a whole block without inflating it.
+ * NaN values are left out of the ranges, and an empty range has min > max
+ */
+struct BlockStats {
+
+  // fill the stats from the cells of a block
+  void Compute(const CellBlock& block);
+
+  void Encode(std::string& buffer) const;
+
+  void Decode(const char* data, size_t len);
+
+  uint32_t num_cells = 0;
+
+  cy_uint pflag_or = 0;   // bits set in any cell
+  cy_uint pflag_and = 0;  // bits set in every cell
+  cy_uint cflag_or = 0;
+  cy_uint cflag_and = 0;
+
+  float x_min = 0;
+  float x_max = 0;
+  float y_min = 0;
+  float y_max = 0;
+
+  // data columns, in header order
+  std::vector<float> col_min;
+  std::vector<float> col_max;
+};
+
+/**
+ * @struct ColumnStats
+ * @brief Running summary of one data column. NaN values are not counted
+ */
+struct ColumnStats {
+  uint64_t count = 0;
+  double sum = 0;
+  double sumsq = 0;
+  float min = 0;
+  float max = 0;
+};
+
+static_assert(sizeof(ColumnStats) == 32, "ColumnStats must be packed to 32 bytes");
+
+/**
+ * @struct FileStats
+ * @brief Summary of every cell in a .cys file
+ *
+ * Accumulated by CellWriter and written as a footer frame. The end frame
+ * stores the offset of the footer in its raw_size field, so the footer
+ * can be found by seeking to the end of the file
+ */
+struct FileStats {
+
+  // clear the stats and set the number of data columns
+  void Init(size_t num_cols);
+
+  // add a block, along with its zone map
+  void Add(const CellBlock& block, const BlockStats& stats);
+
+  void Encode(std::string& buffer) const;
+
+  void Decode(const char* data, size_t len);
+
+  uint64_t num_cells = 0;
+
+  // bounding box
+  float x_min = 0;
+  float x_max = 0;
+  float y_min = 0;
+  float y_max = 0;
+
+  // bits set in any cell
+  cy_uint pflag_or = 0;
+  cy_uint cflag_or = 0;
+
+  // data columns, in header order
+  std::vector<ColumnStats> cols;
+};
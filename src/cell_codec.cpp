@@ -0,0 +1,135 @@
+#include "cell_codec.h"
+
+#include <stdexcept>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+CysCodec ParseCodec(const std::string& spec) {
+
+  CysCodec codec;
+
+  std::string name = spec;
+  size_t colon = spec.find(':');
+  if (colon != std::string::npos) {
+    name = spec.substr(0, colon);
+    try {
+      codec.level = std::stoi(spec.substr(colon + 1));
+    } catch (const std::exception& e) {
+      throw std::runtime_error("Invalid codec level in: " + spec);
+    }
+  }
+
+  if (name.empty() || name == "none") {
+    codec.id = CYS_CODEC_NONE;
+  } else if (name == "lz4") {
+#ifndef HAVE_LZ4
+    throw std::runtime_error("cysift was built without LZ4 support (HAVE_LZ4)");
+#endif
+    codec.id = CYS_CODEC_LZ4;
+  } else if (name == "zstd") {
+#ifndef HAVE_ZSTD
+    throw std::runtime_error("cysift was built without Zstd support (HAVE_ZSTD)");
+#endif
+    codec.id = CYS_CODEC_ZSTD;
+  } else {
+    throw std::runtime_error("Unknown codec: " + name + " (expected none, lz4 or zstd)");
+  }
+
+  return codec;
+}
+
+std::string CodecName(uint32_t id) {
+  switch (id) {
+  case CYS_CODEC_NONE: return "none";
+  case CYS_CODEC_LZ4:  return "lz4";
+  case CYS_CODEC_ZSTD: return "zstd";
+  default: return "unknown(" + std::to_string(id) + ")";
+  }
+}
+
+void CodecCompress(const CysCodec& codec, const std::string& in, std::string& out) {
+
+  switch (codec.id) {
+
+  case CYS_CODEC_NONE:
+    out = in;
+    return;
+
+#ifdef HAVE_LZ4
+  case CYS_CODEC_LZ4: {
+    if (in.size() > LZ4_MAX_INPUT_SIZE)
+      throw std::runtime_error("LZ4: block too large to compress");
+    out.resize(LZ4_compressBound(in.size()));
+    int n = codec.level > 1 ?
+      LZ4_compress_HC(in.data(), &out[0], in.size(), out.size(), codec.level) :
+      LZ4_compress_default(in.data(), &out[0], in.size(), out.size());
+    if (n <= 0)
+      throw std::runtime_error("LZ4: compression failed");
+    out.resize(n);
+    return;
+  }
+#endif
+
+#ifdef HAVE_ZSTD
+  case CYS_CODEC_ZSTD: {
+    out.resize(ZSTD_compressBound(in.size()));
+    size_t n = ZSTD_compress(&out[0], out.size(), in.data(), in.size(),
+			     codec.level ? codec.level : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(n))
+      throw std::runtime_error(std::string("Zstd: ") + ZSTD_getErrorName(n));
+    out.resize(n);
+    return;
+  }
+#endif
+
+  default:
+    throw std::runtime_error("Codec not available in this build: " + CodecName(codec.id));
+  }
+
+}
+
+void CodecDecompress(uint32_t id, const char* in, size_t len, size_t raw_size, std::string& out) {
+
+  out.resize(raw_size);
+
+  switch (id) {
+
+  case CYS_CODEC_NONE:
+    if (len != raw_size)
+      throw std::runtime_error("Corrupt .cys block: stored and raw sizes differ");
+    out.assign(in, len);
+    return;
+
+#ifdef HAVE_LZ4
+  case CYS_CODEC_LZ4: {
+    int n = LZ4_decompress_safe(in, &out[0], len, raw_size);
+    if (n < 0 || static_cast<size_t>(n) != raw_size)
+      throw std::runtime_error("LZ4: corrupt block");
+    return;
+  }
+#endif
+
+#ifdef HAVE_ZSTD
+  case CYS_CODEC_ZSTD: {
+    size_t n = ZSTD_decompress(&out[0], raw_size, in, len);
+    if (ZSTD_isError(n))
+      throw std::runtime_error(std::string("Zstd: ") + ZSTD_getErrorName(n));
+    if (n != raw_size)
+      throw std::runtime_error("Zstd: corrupt block");
+    return;
+  }
+#endif
+
+  default:
+    throw std::runtime_error("Unsupported .cys block compression codec: " + CodecName(id) +
+			     ". Rebuild cysift with the codec enabled");
+  }
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// compression codecs for the payload of a .cys block frame
+const uint32_t CYS_CODEC_NONE = 0;
+const uint32_t CYS_CODEC_LZ4  = 1; // needs HAVE_LZ4
+const uint32_t CYS_CODEC_ZSTD = 2; // needs HAVE_ZSTD
+
+/**
+ * @struct CysCodec
+ * @brief A block compression codec and its level
+ *
+ * A level of 0 means the codec's default. For LZ4, levels above 1
+ * select the slower, higher ratio LZ4-HC compressor
+ */
+struct CysCodec {
+  uint32_t id = CYS_CODEC_NONE;
+  int level = 0;
+};
+
+// parse a codec spec: none, lz4, zstd, or name:level (e.g. zstd:19).
+// Throws if the codec is unknown, or cysift was built without it
+CysCodec ParseCodec(const std::string& spec);
+
+std::string CodecName(uint32_t id);
+
+// compress a block payload
+void CodecCompress(const CysCodec& codec, const std::string& in, std::string& out);
+
+// decompress a block payload, which must decode to exactly raw_size bytes
+void CodecDecompress(uint32_t id, const char* in, size_t len, size_t raw_size, std::string& out);
@@ -4,6 +4,7 @@
 #include "cell_utils.h"
 #include "cell_flag.h"
 #include "cell_graph.h"
+#include "cell_kernel.h"
 
 using namespace std;
 
@@ -55,7 +56,9 @@ public:
   virtual float Min() const = 0;
   virtual float Max() const = 0;
 
-  virtual void Order(const std::vector<size_t> indicies) = 0;
+  // re-order the rows so that row i is old row indicies[i]. indicies
+  // must be a permutation of the rows
+  virtual void Order(const std::vector<size_t>& indicies) = 0;
 
   virtual void reserve(size_t n) = 0;
 
@@ -117,6 +120,14 @@ class NumericColumn : public Column {
   }
 
   float Pearson(const Column& c) const override {
+
+    // straight over the arrays for the numeric columns
+    if (c.size() == m_vec.size()) {
+      if (auto f = dynamic_cast<const NumericColumn<float>*>(&c))
+	return static_cast<float>(kernels::pearson(f->View(), View()));
+      if (auto u = dynamic_cast<const NumericColumn<cy_uint>*>(&c))
+	return static_cast<float>(kernels::pearson(u->View(), View()));
+    }
     
     double mean_v1 = c.Mean();
     double mean_v2 = this->Mean();
@@ -158,17 +169,21 @@ class NumericColumn : public Column {
     m_vec.push_back(elem);
   }
 
+  // copy n values into rows [start, start + n). Column must already be sized
+  template <typename U>
+  void SetRange(size_t start, const U* data, size_t n) {
+    if (start + n > m_vec.size())
+      throw std::out_of_range("SetRange: range out of bounds");
+    std::copy(data, data + n, m_vec.begin() + start);
+  }
+
   float Mean() const override {
 
-    double nr = this->size();
     if (this->size() == 0) {
       throw std::runtime_error("Cannot compute the mean of an empty column.");
     }
 
-    double sum = std::accumulate(m_vec.begin(), m_vec.end(), 0.0);
-    double mean = sum / m_vec.size();
-    
-    return sum / nr;
+    return static_cast<float>(kernels::mean(View()));
   }
   
   float Min() const override {
@@ -176,7 +191,7 @@ class NumericColumn : public Column {
     if (this->size() == 0) {
       throw std::runtime_error("Cannot compute the min of an empty column.");
     }
-    return static_cast<float>(*std::min_element(m_vec.begin(), m_vec.end()));
+    return static_cast<float>(kernels::minmax(View()).first);
   }
   
   float Max() const override {
@@ -184,7 +199,7 @@ class NumericColumn : public Column {
       throw std::runtime_error("Cannot compute the max of an empty column.");
     }
     
-    return static_cast<float>(*std::max_element(m_vec.begin(), m_vec.end()));
+    return static_cast<float>(kernels::minmax(View()).second);
   }
   
   size_t size() const override {
@@ -215,15 +230,13 @@ class NumericColumn : public Column {
     }
 
     void SubsetColumn(const std::vector<size_t>& indices) override {
-      std::vector<T> new_vec;
-      new_vec.reserve(indices.size());
       for (const auto& index : indices) {
-	if (index < 0 || index >= m_vec.size()) {
+	if (index >= m_vec.size()) {
 	  throw std::out_of_range("Index out of range");
 	}
-	new_vec.push_back(m_vec[index]);
       }
-      m_vec = std::move(new_vec);
+      std::vector<T> new_vec;
+      kernels::permute(m_vec, indices, new_vec);
     }
     
     // Add this method to NumericColumn, StringColumn
@@ -264,6 +277,12 @@ class NumericColumn : public Column {
       return m_vec;
     }
 
+  // the values as one contiguous array, for the kernels
+  ConstSpan<T> View() const { return ConstSpan<T>(m_vec.data(), m_vec.size()); }
+
+  // writable values, for filling a sized column in place
+  T* Data() { return m_vec.data(); }
+
   void reserve(size_t n) override {
     m_vec.clear();
     m_vec.reserve(n);
@@ -273,12 +292,8 @@ class NumericColumn : public Column {
     m_vec.resize(n);
   }
 
-  void Order(const std::vector<size_t> indicies) override {
-    std::vector<T> tmp_vec(this->size());
-    for (size_t i = 0; i < indicies.size(); i++) {
-      tmp_vec[i] = m_vec.at(indicies.at(i));
-    }
-    m_vec = tmp_vec;
+  void Order(const std::vector<size_t>& indicies) override {
+    kernels::permute_in_place(m_vec, indicies);
   }
   
 protected:
@@ -386,12 +401,8 @@ public:
     m_vec.resize(n);
   }
 
-  void Order(const std::vector<size_t> indicies) override {
-    std::vector<std::string> tmp_vec(this->size());
-    for (size_t i = 0; i < indicies.size(); i++) {
-      tmp_vec[i] = m_vec.at(indicies.at(i));
-    }
-    m_vec = tmp_vec;
+  void Order(const std::vector<size_t>& indicies) override {
+    kernels::permute_in_place(m_vec, indicies);
   }
 
   
@@ -400,20 +411,62 @@ public:
 };
 
 
+/**
+ * @struct GraphNode
+ * @brief The neighbors of one row of a GraphColumn, as views into its arrays
+ *
+ * Only valid until the column is next changed
+ */
+struct GraphNode {
+
+  ConstSpan<uint32_t> ids;  // cell ids of the neighbors
+  ConstSpan<float> dist;    // distance to each neighbor
+  ConstSpan<cy_uint> flags; // pheno flag of each neighbor, or empty
+
+  size_t size() const { return ids.size(); }
+
+  bool empty() const { return ids.empty(); }
+
+  // as id^dist;id^dist;...
+  std::string toString() const {
+    std::ostringstream oss;
+    for (size_t k = 0; k < ids.size(); k++) {
+      if (k > 0)
+	oss << ';';
+      oss << ids[k] << '^' << dist[k];
+    }
+    return oss.str();
+  }
+};
+
+/**
+ * @class GraphColumn
+ * @brief The spatial graph, in compressed sparse row form
+ *
+ * As in CellBlock, the neighbors of row i are at [m_offsets[i], m_offsets[i+1])
+ * of flat id, distance and flag arrays, so the graph is a handful of
+ * allocations however many cells it has, and walking it streams through
+ * memory. The flag array stays empty until a row with flags is added.
+ */
 class GraphColumn : public Column {
   
  public:
  
   GraphColumn() = default;
 
-  GraphColumn(const CellNode& initial_elem) {
-    m_vec.push_back(initial_elem);
+  // take over a graph that is already in CSR form. flags is empty or
+  // one per neighbor
+  GraphColumn(std::vector<uint64_t> offsets, std::vector<uint32_t> ids,
+	      std::vector<float> dist, std::vector<cy_uint> flags)
+    : m_offsets(std::move(offsets)), m_ids(std::move(ids)),
+      m_dist(std::move(dist)), m_flags(std::move(flags)) {
+    if (m_offsets.empty() || m_offsets.front() != 0 || m_offsets.back() != m_ids.size() ||
+	m_dist.size() != m_ids.size() || (!m_flags.empty() && m_flags.size() != m_ids.size()))
+      throw std::runtime_error("GraphColumn: arrays are not a CSR graph");
   }
   
   std::string GetStringElem(size_t i) const override {
-    if (i >= m_vec.size())
-      throw std::out_of_range("Index out of range");
-    return m_vec.at(i).toString();
+    return GetNode(i).toString();
   }
   
   std::shared_ptr<Column> clone() const override {
@@ -424,35 +477,48 @@ class GraphColumn : public Column {
     return ColumnType::GRAPH; 
   }
   
-  void PushElem(const CellNode& elem) {
-    m_vec.emplace_back(elem);
-  }
+  // add a row with n neighbors. flags may be null
+  void PushNode(const uint32_t* ids, const uint32_t* dist, const cy_uint* flags, size_t n) {
 
-  void SetValueAt(size_t index, const CellNode& value) {
-    if (index > this->size()) {
-      throw std::runtime_error("i is out of bounds on SetElem in GraphColumn");
-    }
-    m_vec[index] = value;
+    // the first flags seen: earlier neighbors get none
+    if (flags && n && m_flags.empty())
+      m_flags.assign(m_ids.size(), 0);
+
+    m_ids.insert(m_ids.end(), ids, ids + n);
+    m_dist.insert(m_dist.end(), dist, dist + n);
+    if (flags && n)
+      m_flags.insert(m_flags.end(), flags, flags + n);
+    else if (!m_flags.empty())
+      m_flags.resize(m_ids.size(), 0);
+    m_offsets.push_back(m_ids.size());
   }
 
-  
   size_t size() const override {
-    return m_vec.size();
+    return m_offsets.size() - 1;
   }
 
-  const CellNode& GetNode(size_t index) const {
-    if (index > this->size()) {
+  size_t NumEdges() const { return m_ids.size(); }
+
+  GraphNode GetNode(size_t index) const {
+    if (index >= this->size()) {
       throw std::runtime_error("i is out of bounds on GetNode in GraphColumn");
     }
-    return m_vec[index];
+    const uint64_t s = m_offsets[index];
+    const size_t n = m_offsets[index + 1] - s;
+    GraphNode node;
+    node.ids = ConstSpan<uint32_t>(m_ids.data() + s, n);
+    node.dist = ConstSpan<float>(m_dist.data() + s, n);
+    if (!m_flags.empty())
+      node.flags = ConstSpan<cy_uint>(m_flags.data() + s, n);
+    return node;
   }
   
   std::string toString() const override {
         std::stringstream ss;
-        ss << "GraphColumn<CellNode>: [";
+        ss << "GraphColumn<CSR>: [";
         for (size_t i = 0; i < std::min(size(), (size_t)3); i++) {
 	  if (i > 0) ss << ", ";
-	  ss << m_vec[i];
+	  ss << GetNode(i).toString();
         }
         if (size() > 3) ss << ", ...";
         ss << "]";
@@ -474,48 +540,103 @@ class GraphColumn : public Column {
   }
   
   void SubsetColumn(const std::vector<size_t>& indices) override {
-    std::vector<CellNode> new_vec;
-    new_vec.reserve(indices.size());
-    for (auto i : indices) {
-      if (i >= 0 && i < m_vec.size()) {
-	new_vec.push_back(m_vec[i]);
-      } else {
-	throw std::out_of_range("SubsetColumn: index out of range");
-      }
-    }
-    m_vec = std::move(new_vec);
+    gather_rows(indices);
   }
   
   void PrintElem(size_t i) const override {
     
-    if (i < m_vec.size()) {
-      std::cout << GetStringElem(i); //m_vec.at(i);
+    if (i < this->size()) {
+      std::cout << GetStringElem(i);
     } else {
       throw std::runtime_error("Out of bounds in PrintElem");
     }
   }
 
   void reserve(size_t n) override {
-    m_vec.clear();
-    m_vec.reserve(n);
+    m_offsets.assign(1, 0);
+    m_offsets.reserve(n + 1);
+    m_ids.clear();
+    m_dist.clear();
+    m_flags.clear();
   }
 
+  // grow with rows that have no neighbors, or drop rows from the end
   void resize(size_t n) override {
-    m_vec.resize(n);
+    if (n < this->size()) {
+      m_offsets.resize(n + 1);
+      m_ids.resize(m_offsets.back());
+      m_dist.resize(m_offsets.back());
+      if (!m_flags.empty())
+	m_flags.resize(m_offsets.back());
+    } else {
+      m_offsets.resize(n + 1, m_offsets.back());
+    }
   }
 
-  void Order(const std::vector<size_t> indicies) override {
-    std::vector<CellNode> tmp_vec(this->size());
-    for (size_t i = 0; i < indicies.size(); i++) {
-      tmp_vec[i] = m_vec.at(indicies.at(i));
-    }
-    m_vec = tmp_vec;
+  // size the column for n rows and num_edges neighbors, to be
+  // filled by SetRange calls that cover every row
+  void resize(size_t n, uint64_t num_edges) {
+    m_offsets.assign(n + 1, 0);
+    m_ids.resize(num_edges);
+    m_dist.resize(num_edges);
+    m_flags.clear();
+  }
+
+  // fill rows [start, start + n) from the CSR arrays of a block, whose
+  // offsets has n + 1 entries. Their neighbors go from edge_start on
+  void SetRange(size_t start, uint64_t edge_start, const uint64_t* offsets,
+		const uint32_t* ids, const uint32_t* dist, size_t n) {
+    const uint64_t num = offsets[n] - offsets[0];
+    if (start + n > this->size() || edge_start + num > m_ids.size())
+      throw std::out_of_range("SetRange: range out of bounds");
+    for (size_t i = 0; i < n; i++)
+      m_offsets[start + i + 1] = edge_start + offsets[i + 1] - offsets[0];
+    std::copy(ids + offsets[0], ids + offsets[n], m_ids.begin() + edge_start);
+    std::copy(dist + offsets[0], dist + offsets[n], m_dist.begin() + edge_start);
+  }
+
+  void Order(const std::vector<size_t>& indicies) override {
+    if (indicies.size() != this->size())
+      throw std::out_of_range("Order: wrong number of indices");
+    gather_rows(indicies);
   }
 
   
  private:
 
-  std::vector<CellNode> m_vec;
+  std::vector<uint64_t> m_offsets = {0};
+  std::vector<uint32_t> m_ids;
+  std::vector<float> m_dist;
+  std::vector<cy_uint> m_flags;
+
+  // keep rows indices, in that order
+  void gather_rows(const std::vector<size_t>& indices) {
+
+    std::vector<uint64_t> offsets(indices.size() + 1, 0);
+    for (size_t k = 0; k < indices.size(); k++) {
+      const size_t i = indices[k];
+      if (i >= this->size())
+	throw std::out_of_range("SubsetColumn: index out of range");
+      offsets[k + 1] = offsets[k] + m_offsets[i + 1] - m_offsets[i];
+    }
+
+    std::vector<uint32_t> ids(offsets.back());
+    std::vector<float> dist(offsets.back());
+    std::vector<cy_uint> flags(m_flags.empty() ? 0 : offsets.back());
+    for (size_t k = 0; k < indices.size(); k++) {
+      const uint64_t s = m_offsets[indices[k]];
+      const uint64_t e = m_offsets[indices[k] + 1];
+      std::copy(m_ids.begin() + s, m_ids.begin() + e, ids.begin() + offsets[k]);
+      std::copy(m_dist.begin() + s, m_dist.begin() + e, dist.begin() + offsets[k]);
+      if (!m_flags.empty())
+	std::copy(m_flags.begin() + s, m_flags.begin() + e, flags.begin() + offsets[k]);
+    }
+
+    m_offsets.swap(offsets);
+    m_ids.swap(ids);
+    m_dist.swap(dist);
+    m_flags.swap(flags);
+  }
 
 };
 
@@ -646,12 +767,8 @@ class FlagColumn : public Column {
     m_vec.resize(n);
   }
 
-  void Order(const std::vector<size_t> indicies) override {
-    std::vector<CellFlag> tmp_vec(this->size());
-    for (size_t i = 0; i < indicies.size(); i++) {
-      tmp_vec[i] = m_vec.at(indicies.at(i));
-    }
-    m_vec = tmp_vec;
+  void Order(const std::vector<size_t>& indicies) override {
+    kernels::permute_in_place(m_vec, indicies);
   }
 
   
@@ -671,3 +788,27 @@ using FloatColPtr = std::shared_ptr<FloatCol>;
 using StringColPtr= std::shared_ptr<StringColumn>;
 using FlagColPtr  = std::shared_ptr<FlagColumn>;
 using ColPtr      = std::shared_ptr<Column>;
+
+/** Contiguous view of a numeric column of type T
+ * @param col Column to view. Must outlive the view, unresized
+ * @throws std::runtime_error if the column does not hold T
+ */
+template <typename T>
+inline ConstSpan<T> ColumnView(const ColPtr& col) {
+  auto c = dynamic_cast<const NumericColumn<T>*>(col.get());
+  if (!c)
+    throw std::runtime_error("ColumnView: column is not of the expected type");
+  return c->View();
+}
+
+/** Call f with a view of a numeric column, as whichever type it holds
+ * @throws std::runtime_error if the column is not numeric
+ */
+template <typename F>
+inline auto VisitNumeric(const ColPtr& col, F f) {
+  if (auto c = dynamic_cast<const FloatCol*>(col.get()))
+    return f(c->View());
+  if (auto c = dynamic_cast<const IntCol*>(col.get()))
+    return f(c->View());
+  throw std::runtime_error("VisitNumeric: column is not numeric");
+}
@@ -0,0 +1,242 @@
+#include "cell_csv.h"
+
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+// bytes read from the input at a time
+static const size_t CSV_CHUNK_SIZE = 16 * 1024 * 1024;
+
+// the field starting at p, up to the next comma or end. Moves p past
+// the comma, or sets it to null after the last field
+static inline std::pair<const char*, const char*> next_field(const char*& p, const char* end) {
+  const char* start = p;
+  const char* comma = static_cast<const char*>(std::memchr(p, ',', end - p));
+  if (comma) {
+    p = comma + 1;
+    return { start, comma };
+  }
+  p = nullptr;
+  return { start, end };
+}
+
+// libstdc++ before GCC 12 parses floats in from_chars with strtod and a
+// locale switch on every call, which is slower than strtof itself
+#if defined(_GLIBCXX_RELEASE) && _GLIBCXX_RELEASE < 12
+#define CSV_FLOAT_FROM_CHARS 0
+#else
+#define CSV_FLOAT_FROM_CHARS 1
+#endif
+
+// parse a float as strtof would, so odd fields come out as they used to.
+// The buffer is NUL-terminated, so strtof can't run off the end of it
+static inline float parse_float(const std::pair<const char*, const char*>& f) {
+
+  if (f.first == f.second)
+    return 0;
+
+#if CSV_FLOAT_FROM_CHARS
+  float val = 0;
+  if (std::from_chars(f.first, f.second, val).ec == std::errc())
+    return val;
+#endif
+
+  char* end;
+  const float v = std::strtof(f.first, &end);
+
+  // leading white space could have run on into the next line
+  return end <= f.second ? v : 0;
+}
+
+bool CsvReader::Open(const std::string& file) {
+
+  if (file == "-") {
+    m_in = &std::cin;
+  } else {
+    m_is = std::make_unique<std::ifstream>(file, std::ios::binary);
+    if (!m_is->good())
+      return false;
+    m_in = m_is.get();
+  }
+
+  return true;
+}
+
+bool CsvReader::fill() {
+
+  if (m_eof)
+    return false;
+
+  const size_t n = m_buf.size();
+  m_buf.resize(n + CSV_CHUNK_SIZE);
+  m_in->read(&m_buf[n], CSV_CHUNK_SIZE);
+  const size_t got = m_in->gcount();
+  m_buf.resize(n + got);
+
+  if (!got)
+    m_eof = true;
+  return got > 0;
+}
+
+bool CsvReader::next_line(size_t& start, size_t& end) {
+
+  while (true) {
+
+    const char* nl = static_cast<const char*>(std::memchr(m_buf.data() + m_scan, '\n', m_buf.size() - m_scan));
+    if (nl) {
+      start = m_pos;
+      end = nl - m_buf.data();
+      m_pos = m_scan = end + 1;
+      break;
+    }
+
+    m_scan = m_buf.size();
+    if (!fill()) {
+
+      // the last line may not end in a newline
+      if (m_pos == m_buf.size())
+	return false;
+      start = m_pos;
+      end = m_pos = m_buf.size();
+      break;
+    }
+  }
+
+  if (end > start && m_buf[end - 1] == '\r')
+    end--;
+  return true;
+}
+
+void CsvReader::ReadHeader(CellHeader& header) {
+
+  assert(m_in);
+
+  size_t start, end;
+  while (next_line(start, end)) {
+
+    if (start == end) {
+      m_done = true;
+      break;
+    }
+
+    // put back the first data line
+    if (m_buf[start] != '@') {
+      m_pos = m_scan = start;
+      break;
+    }
+
+    header.addTag(Tag(m_buf.substr(start, end - start)));
+  }
+
+  m_num_cols = header.GetDataTags().size();
+}
+
+size_t CsvReader::parse_line(const std::pair<size_t, size_t>& line, size_t i, CellBlock& block) const {
+
+  const char* p = m_buf.data() + line.first;
+  const char* end = m_buf.data() + line.second;
+
+  if (*p == '@')
+    throw std::runtime_error("Misformed file: header lines should all be at top of file");
+
+  // id, x and y come first
+  auto f = next_field(p, end);
+  uint32_t id = 0;
+  if (std::from_chars(f.first, f.second, id).ec != std::errc()) {
+    try {
+      id = std::stoi(std::string(f.first, f.second));
+    } catch (const std::exception& e) {
+      throw std::runtime_error("Unable to parse cell id: " + std::string(f.first, f.second));
+    }
+  }
+  if (!p)
+    throw std::runtime_error("CSV file should have at least three columns: id, x, y");
+  block.m_ids[i] = id;
+  block.m_x[i] = parse_float(next_field(p, end));
+  if (!p)
+    throw std::runtime_error("CSV file should have at least three columns: id, x, y");
+  block.m_y[i] = parse_float(next_field(p, end));
+
+  // then the data columns
+  size_t j = 0;
+  for (; p && j < m_num_cols; j++)
+    block.m_cols[j][i] = parse_float(next_field(p, end));
+
+  // count any extra columns
+  for (; p; j++)
+    next_field(p, end);
+
+  return j;
+}
+
+bool CsvReader::ReadBlock(CellBlock& block) {
+
+  assert(m_in);
+
+  // drop the lines that have been parsed
+  m_buf.erase(0, m_pos);
+  m_scan -= m_pos;
+  m_pos = 0;
+
+  // find the lines of the block
+  m_lines.clear();
+  size_t start, end;
+  while (!m_done && m_lines.size() < CYS_BLOCK_SIZE && next_line(start, end)) {
+    if (start == end) {
+      m_done = true;
+      break;
+    }
+    m_lines.emplace_back(start, end);
+  }
+
+  const size_t n = m_lines.size();
+  if (!n)
+    return false;
+
+  // size the columns, so each line can be parsed straight into place
+  block.Init(m_num_cols);
+  block.m_ids.resize(n);
+  block.m_pheno_flags.resize(n, 0);
+  block.m_cell_flags.resize(n, 0);
+  block.m_x.resize(n);
+  block.m_y.resize(n);
+  for (auto& c : block.m_cols)
+    c.resize(n);
+  block.m_graph_offsets.assign(n + 1, 0);
+
+  // report the first bad line, whichever thread finds it
+  std::string error;
+  size_t error_line = n;
+  size_t extra = 0;
+#pragma omp parallel for num_threads(m_threads) schedule(static)
+  for (size_t i = 0; i < n; i++) {
+    try {
+      const size_t fields = parse_line(m_lines[i], i, block);
+      if (fields < m_num_cols)
+	throw std::runtime_error("Only " + std::to_string(fields) + " data columns, but header specified " +
+				 std::to_string(m_num_cols));
+      if (fields > m_num_cols) {
+#pragma omp atomic write
+	extra = fields;
+      }
+    } catch (const std::exception& e) {
+#pragma omp critical
+      if (i < error_line) {
+	error_line = i;
+	error = e.what();
+      }
+    }
+  }
+  if (!error.empty())
+    throw std::runtime_error(error + " (line " + std::to_string(m_num_lines + error_line + 1) + ")");
+
+  // let user know if they are short on header specs
+  if (extra)
+    std::cerr << "warning: more data columns " << extra << " in file than specified in header " <<
+      m_num_cols << std::endl;
+
+  m_num_lines += n;
+  return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "cell_block.h"
+#include "cell_header.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @class CsvReader
+ * @brief Reads a cell table CSV (id,x,y,data...) a block at a time
+ *
+ * The @ header lines are read as Tags. Data lines are gathered CYS_BLOCK_SIZE
+ * at a time from a large read buffer, and parsed in parallel straight into
+ * the columns of a CellBlock, without copying each line or splitting it
+ * into strings. Numbers are parsed with std::from_chars, falling back to
+ * strtof / stoi for anything it doesn't take (e.g. a leading '+'), so
+ * fields are read as they were line by line.
+ *
+ * As with the line-by-line reader, an empty line ends the input.
+ */
+class CsvReader {
+
+ public:
+
+  CsvReader() = default;
+
+  CsvReader(const CsvReader&) = delete;
+  CsvReader& operator=(const CsvReader&) = delete;
+
+  // file is a path, or "-" for stdin. Returns false if unable to open
+  bool Open(const std::string& file);
+
+  // number of threads to parse each block with
+  void SetThreads(size_t threads) { m_threads = threads ? threads : 1; }
+
+  // read the @ header lines. Must be called before reading cells
+  void ReadHeader(CellHeader& header);
+
+  // parse the next CYS_BLOCK_SIZE lines (or fewer, at the end) into
+  // block. Returns false at the end of the input. Throws on a
+  // malformed line, giving its line number among the data lines
+  bool ReadBlock(CellBlock& block);
+
+  // number of data lines read so far
+  size_t NumLines() const { return m_num_lines; }
+
+ private:
+
+  std::unique_ptr<std::ifstream> m_is;
+  std::istream* m_in = nullptr;
+
+  // input read so far. Lines from m_pos on have yet to be returned,
+  // and m_scan is where to look for the next newline
+  std::string m_buf;
+  size_t m_pos = 0;
+  size_t m_scan = 0;
+  bool m_eof = false;
+  bool m_done = false; // hit an empty line
+
+  // [start, end) in m_buf of each line of the current block
+  std::vector<std::pair<size_t, size_t>> m_lines;
+
+  size_t m_num_cols = 0;
+  size_t m_num_lines = 0;
+  size_t m_threads = 1;
+
+  // read more input onto the end of m_buf. Returns false at the end of input
+  bool fill();
+
+  // find the next line, without its line ending. Returns false at the end of input
+  bool next_line(size_t& start, size_t& end);
+
+  // parse line into row i of block. Returns the number of data fields found
+  size_t parse_line(const std::pair<size_t, size_t>& line, size_t i, CellBlock& block) const;
+
+};
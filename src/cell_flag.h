@@ -10,6 +10,10 @@
 #include <vector>
 #include <cmath>
 
+// cell flag bit of the halo cells that split copies into a tile from
+// its neighbors. merge drops them, as each is a core cell of another tile
+const cy_uint CELL_FLAG_HALO = static_cast<cy_uint>(1) << 31;
+
 class CellFlag {
 public:
   
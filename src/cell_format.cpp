@@ -0,0 +1,86 @@
+#include "cell_format.h"
+
+#include <cstdio>
+
+void CellFormatter::append_float(float val, std::string& out) const {
+
+  char buf[64];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), val, m_format, m_precision);
+  if (res.ec == std::errc()) {
+    out.append(buf, res.ptr - buf);
+    return;
+  }
+
+  // too long for the buffer, e.g. a huge value in fixed notation
+  const int fixed = m_format == std::chars_format::fixed;
+  const int len = std::snprintf(nullptr, 0, fixed ? "%.*f" : "%.*g", m_precision, val);
+  const size_t n = out.size();
+  out.resize(n + len + 1);
+  std::snprintf(&out[n], len + 1, fixed ? "%.*f" : "%.*g", m_precision, val);
+  out.resize(n + len);
+}
+
+void CellFormatter::append_graph(const uint32_t* ids, const uint32_t* dist, const cy_uint* flags,
+				 size_t n, std::string& out) const {
+
+  // print delimiter if graph non-empty
+  if (n)
+    out += m_delim;
+
+  for (size_t i = 0; i < n; i++) {
+    if (i)
+      out += ';';
+    append_int(ids[i], out);
+    out += '^';
+    append_int(dist[i], out);
+    out += '&';
+    append_int(flags[i], out);
+  }
+}
+
+void CellFormatter::FormatRow(const CellBlock& block, size_t i, std::string& out) const {
+
+  append_int(block.m_ids[i], out);
+  out += m_delim;
+  append_int(block.m_cell_flags[i], out);
+  out += m_delim;
+  append_int(block.m_pheno_flags[i], out);
+  out += m_delim;
+  append_float(block.m_x[i], out);
+  out += m_delim;
+  append_float(block.m_y[i], out);
+
+  for (const auto& c : block.m_cols) {
+    out += m_delim;
+    append_float(c[i], out);
+  }
+
+  const uint64_t s = block.m_graph_offsets[i];
+  append_graph(block.m_graph_ids.data() + s, block.m_graph_dist.data() + s,
+	       block.m_graph_flags.data() + s, block.m_graph_offsets[i + 1] - s, out);
+
+  out += '\n';
+}
+
+void CellFormatter::FormatCell(const Cell& cell, std::string& out) const {
+
+  append_int(cell.m_id, out);
+  out += m_delim;
+  append_int(cell.m_cell_flag, out);
+  out += m_delim;
+  append_int(cell.m_pheno_flag, out);
+  out += m_delim;
+  append_float(cell.m_x, out);
+  out += m_delim;
+  append_float(cell.m_y, out);
+
+  for (const auto& c : cell.m_cols) {
+    out += m_delim;
+    append_float(c, out);
+  }
+
+  append_graph(cell.m_spatial_ids.data(), cell.m_spatial_dist.data(),
+	       cell.m_spatial_flags.data(), cell.m_spatial_ids.size(), out);
+
+  out += '\n';
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "cell_block.h"
+#include "cell_row.h"
+
+#include <charconv>
+#include <string>
+
+/**
+ * @class CellFormatter
+ * @brief Formats cells as delimited text, appended to a caller's buffer
+ *
+ * Each row is id, cell flag, phenotype flag, x, y and the data columns,
+ * then the graph as id^dist&flag entries separated by ';'. Numbers are
+ * written with std::to_chars, so there is no stream state, locking or
+ * flushing per value. By default floats are written as %g with 6
+ * significant digits, which is what the stream output gave.
+ */
+class CellFormatter {
+
+ public:
+
+  CellFormatter() = default;
+
+  // significant digits of floats, or decimal places if fixed.
+  // Negative for the default of 6
+  void SetPrecision(int precision) { m_precision = precision < 0 ? 6 : precision; }
+
+  // write floats with a fixed number of decimal places
+  void SetFixed(bool fixed) { m_format = fixed ? std::chars_format::fixed : std::chars_format::general; }
+
+  void SetDelimiter(char delim) { m_delim = delim; }
+
+  // append row i of a block, and a newline
+  void FormatRow(const CellBlock& block, size_t i, std::string& out) const;
+
+  // append a cell, and a newline
+  void FormatCell(const Cell& cell, std::string& out) const;
+
+ private:
+
+  char m_delim = ',';
+  int m_precision = 6;
+  std::chars_format m_format = std::chars_format::general;
+
+  void append_float(float val, std::string& out) const;
+
+  template <typename T>
+  void append_int(T val, std::string& out) const {
+    char buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof(buf), val);
+    out.append(buf, res.ptr - buf);
+  }
+
+  void append_graph(const uint32_t* ids, const uint32_t* dist, const cy_uint* flags,
+		    size_t n, std::string& out) const;
+
+};
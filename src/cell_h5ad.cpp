@@ -0,0 +1,721 @@
+#include "cell_h5ad.h"
+#include "cell_utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+// the HDF5 type of the cell and phenotype flags
+static const H5::PredType& flag_type() {
+  return sizeof(cy_uint) == 8 ? H5::PredType::NATIVE_UINT64 : H5::PredType::NATIVE_UINT32;
+}
+
+// write the AnnData encoding-type and encoding-version attributes
+static void write_encoding(H5::H5Object& obj, const char* type, const char* version) {
+
+  H5::DataSpace scalar_dataspace(H5S_SCALAR);
+  H5::StrType strdatatype(H5::PredType::C_S1, H5T_VARIABLE);
+
+  H5::Attribute attr = obj.createAttribute("encoding-type", strdatatype, scalar_dataspace);
+  attr.write(strdatatype, &type);
+  attr = obj.createAttribute("encoding-version", strdatatype, scalar_dataspace);
+  attr.write(strdatatype, &version);
+}
+
+// create an empty chunked dataset that grows along its rows. A width
+// of 0 makes it 1-D, otherwise it is rows x width
+static H5::DataSet create_rows(H5::Group& group, const std::string& name, const H5::DataType& type,
+			       hsize_t width, int level) {
+
+  const int rank = width ? 2 : 1;
+  const hsize_t dims[2] = {0, width};
+  const hsize_t maxdims[2] = {H5S_UNLIMITED, H5S_UNLIMITED};
+  const hsize_t chunk[2] = {width ? std::max<hsize_t>(1, CYS_BLOCK_SIZE / width) : CYS_BLOCK_SIZE,
+			    std::max<hsize_t>(1, width)};
+
+  H5::DSetCreatPropList plist;
+  plist.setChunk(rank, chunk);
+  if (level > 0)
+    plist.setDeflate(level);
+
+  H5::DataSpace space(rank, dims, maxdims);
+  return group.createDataSet(name, type, space, plist);
+}
+
+// append n rows to a dataset from create_rows
+static void append_rows(H5::DataSet& ds, const void* data, const H5::DataType& type, hsize_t n) {
+
+  if (!n)
+    return;
+
+  H5::DataSpace space = ds.getSpace();
+  const int rank = space.getSimpleExtentNdims();
+  hsize_t dims[2] = {0, 0};
+  space.getSimpleExtentDims(dims);
+
+  const hsize_t start[2] = {dims[0], 0};
+  const hsize_t count[2] = {n, dims[1]};
+  dims[0] += n;
+  ds.extend(dims);
+
+  H5::DataSpace file_space = ds.getSpace();
+  file_space.selectHyperslab(H5S_SELECT_SET, count, start);
+  H5::DataSpace mem_space(rank, count);
+  ds.write(data, type, mem_space, file_space);
+}
+
+H5adWriter::~H5adWriter() {
+  try {
+    Close();
+  } catch (const std::exception& e) {
+    std::cerr << "Error: unable to finish writing h5ad file: " << e.what() << std::endl;
+  } catch (const H5::Exception& e) {
+    std::cerr << "Error: unable to finish writing h5ad file: " << e.getDetailMsg() << std::endl;
+  }
+}
+
+void H5adWriter::Open(const std::string& file, const CellHeader& header) {
+
+  const std::vector<Tag> tags = header.GetDataTags();
+  std::vector<const char*> obs_names = {"x", "y", "cflag", "pflag"};
+  std::vector<const char*> var_names;
+  size_t k = 0;
+  for (const auto& t : tags) {
+    if (t.type == Tag::MA_TAG) {
+      m_markers.push_back(k);
+      var_names.push_back(t.id.c_str());
+    } else {
+      m_metas.push_back(k);
+      obs_names.push_back(t.id.c_str());
+    }
+    k++;
+  }
+  m_block.Init(k);
+
+  try {
+
+    m_file = H5::H5File(file, H5F_ACC_TRUNC);
+    m_open = true;
+
+    H5::Group root = m_file.openGroup("/");
+    write_encoding(root, "anndata", "0.1.0");
+
+    H5::StrType strdatatype(H5::PredType::C_S1, H5T_VARIABLE);
+
+    // obs, one dataset per column
+    H5::Group obs = m_file.createGroup("obs");
+    write_hdf5_dataframe_attributes(obs);
+    const hsize_t odim[1] = {obs_names.size()};
+    H5::Attribute column_order = obs.createAttribute("column-order", strdatatype, H5::DataSpace(1, odim));
+    column_order.write(strdatatype, obs_names.data());
+
+    for (size_t i = 0; i < obs_names.size(); i++) {
+      const bool flag = i == 2 || i == 3;
+      m_obs.push_back(create_rows(obs, obs_names[i], flag ? flag_type() : H5::PredType::NATIVE_FLOAT, 0, m_level));
+      write_encoding(m_obs.back(), "array", "0.2.0");
+    }
+
+    // variable length strings can't be compressed
+    m_index = create_rows(obs, "_index", strdatatype, 0, 0);
+    write_encoding(m_index, "string-array", "0.2.0");
+
+    // var, just the marker names
+    H5::Group var = m_file.createGroup("var");
+    write_hdf5_dataframe_attributes(var);
+    const hsize_t vdim[1] = {var_names.size()};
+    const hsize_t empty_dim[1] = {0};
+    var.createAttribute("column-order", strdatatype, H5::DataSpace(1, empty_dim));
+    H5::DataSet var_index = var.createDataSet("_index", strdatatype, H5::DataSpace(1, vdim));
+    if (var_names.size())
+      var_index.write(var_names.data(), strdatatype);
+    write_encoding(var_index, "string-array", "0.2.0");
+
+    H5::Group uns = m_file.createGroup("uns");
+    write_encoding(uns, "dict", "0.1.0");
+    H5::DataSet all_markers = uns.createDataSet("all_markers", strdatatype, H5::DataSpace(1, vdim));
+    if (var_names.size())
+      all_markers.write(var_names.data(), strdatatype);
+
+    H5::Group obsm = m_file.createGroup("obsm");
+    write_encoding(obsm, "dict", "0.1.0");
+    m_spatial = create_rows(obsm, "spatial", H5::PredType::NATIVE_FLOAT, 2, m_level);
+    write_encoding(m_spatial, "array", "0.2.0");
+
+    // a 0-wide X can't be chunked, so it is written at Close
+    if (m_markers.size()) {
+      m_x_data = create_rows(root, "X", H5::PredType::NATIVE_FLOAT, m_markers.size(), m_level);
+      write_encoding(m_x_data, "array", "0.2.0");
+    }
+
+  } catch (const H5::Exception& e) {
+    throw std::runtime_error("Unable to write h5ad file " + file + ": " + e.getDetailMsg());
+  }
+
+  if (m_graph) {
+    m_edges = std::tmpfile();
+    if (!m_edges)
+      throw std::runtime_error("Unable to open a temporary file for the graph of " + file);
+  }
+}
+
+void H5adWriter::WriteBlock(const CellBlock& block, size_t start, size_t end) {
+
+  assert(m_open);
+  try {
+    write_block(block, start, end);
+  } catch (const H5::Exception& e) {
+    throw std::runtime_error("Unable to write h5ad file: " + e.getDetailMsg());
+  }
+}
+
+void H5adWriter::write_block(const CellBlock& block, size_t start, size_t end) {
+
+  const size_t n = end - start;
+  if (!n)
+    return;
+
+  // X, row major
+  const size_t nm = m_markers.size();
+  m_buf.resize(n * std::max<size_t>(nm, 2));
+  if (nm) {
+    for (size_t j = 0; j < nm; j++) {
+      const float* col = block.m_cols[m_markers[j]].data() + start;
+      for (size_t i = 0; i < n; i++)
+	m_buf[i * nm + j] = col[i];
+    }
+    append_rows(m_x_data, m_buf.data(), H5::PredType::NATIVE_FLOAT, n);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    m_buf[2 * i] = block.m_x[start + i];
+    m_buf[2 * i + 1] = block.m_y[start + i];
+  }
+  append_rows(m_spatial, m_buf.data(), H5::PredType::NATIVE_FLOAT, n);
+
+  // obs columns are contiguous in the block already
+  append_rows(m_obs[0], block.m_x.data() + start, H5::PredType::NATIVE_FLOAT, n);
+  append_rows(m_obs[1], block.m_y.data() + start, H5::PredType::NATIVE_FLOAT, n);
+  append_rows(m_obs[2], block.m_cell_flags.data() + start, flag_type(), n);
+  append_rows(m_obs[3], block.m_pheno_flags.data() + start, flag_type(), n);
+  for (size_t j = 0; j < m_metas.size(); j++)
+    append_rows(m_obs[4 + j], block.m_cols[m_metas[j]].data() + start, H5::PredType::NATIVE_FLOAT, n);
+
+  // cell names, packed one after the other. At most 18 characters
+  // each, so the buffer never moves while they are added
+  m_names.clear();
+  m_names.reserve(n * 18);
+  m_name_ptrs.resize(n);
+  char num[16];
+  for (size_t i = 0; i < n; i++) {
+    m_name_ptrs[i] = m_names.data() + m_names.size();
+    const auto res = std::to_chars(num, num + sizeof(num), block.m_ids[start + i]);
+    m_names.append("cellid_");
+    m_names.append(num, res.ptr - num);
+    m_names.push_back('\0');
+  }
+  append_rows(m_index, m_name_ptrs.data(), H5::StrType(H5::PredType::C_S1, H5T_VARIABLE), n);
+
+  // spool the edges
+  if (m_edges) {
+    m_edge_buf.clear();
+    for (size_t i = start; i < end; i++) {
+      m_ids.push_back(block.m_ids[i]);
+      m_degree.push_back(block.m_graph_offsets[i + 1] - block.m_graph_offsets[i]);
+      for (uint64_t e = block.m_graph_offsets[i]; e < block.m_graph_offsets[i + 1]; e++) {
+	m_edge_buf.push_back(block.m_graph_ids[e]);
+	m_edge_buf.push_back(block.m_graph_dist[e]);
+      }
+    }
+    if (std::fwrite(m_edge_buf.data(), sizeof(uint32_t), m_edge_buf.size(), m_edges) != m_edge_buf.size())
+      throw std::runtime_error("Unable to write the graph to a temporary file");
+  }
+
+  m_num_cells += n;
+}
+
+void H5adWriter::WriteCell(const Cell& cell) {
+
+  m_block.AddCell(cell);
+  if (m_block.size() >= CYS_BLOCK_SIZE)
+    flush_block();
+}
+
+void H5adWriter::flush_block() {
+  WriteBlock(m_block, 0, m_block.size());
+  m_block.clear();
+}
+
+void H5adWriter::Close() {
+
+  if (!m_open)
+    return;
+
+  try {
+    flush_block();
+    if (m_edges)
+      write_graph();
+
+    // cells x 0 markers, as a contiguous dataset that holds no data
+    if (m_markers.empty()) {
+      H5::Group root = m_file.openGroup("/");
+      const hsize_t xdim[2] = {m_num_cells, 0};
+      H5::DataSet x = root.createDataSet("X", H5::PredType::NATIVE_FLOAT, H5::DataSpace(2, xdim));
+      write_encoding(x, "array", "0.2.0");
+    }
+
+    m_file.close();
+  } catch (const H5::Exception& e) {
+    release();
+    throw std::runtime_error("Unable to write h5ad file: " + e.getDetailMsg());
+  } catch (...) {
+    release();
+    throw;
+  }
+  release();
+}
+
+// done with the file either way, so a failed Close isn't retried by the destructor
+void H5adWriter::release() {
+  m_open = false;
+  if (m_edges) {
+    std::fclose(m_edges);
+    m_edges = nullptr;
+  }
+}
+
+void H5adWriter::write_graph() {
+
+  const size_t n = m_num_cells;
+
+  // row of each cell id
+  std::vector<std::pair<uint32_t, uint32_t>> rows(n);
+  for (size_t i = 0; i < n; i++)
+    rows[i] = {m_ids[i], static_cast<uint32_t>(i)};
+  std::sort(rows.begin(), rows.end());
+
+  H5::Group obsp = m_file.createGroup("obsp");
+  write_encoding(obsp, "dict", "0.1.0");
+  H5::Group csr = obsp.createGroup("spatial_distances");
+  write_encoding(csr, "csr_matrix", "0.1.0");
+  const int64_t shape[2] = {static_cast<int64_t>(n), static_cast<int64_t>(n)};
+  const hsize_t sdim[1] = {2};
+  H5::Attribute shape_attr = csr.createAttribute("shape", H5::PredType::NATIVE_INT64, H5::DataSpace(1, sdim));
+  shape_attr.write(H5::PredType::NATIVE_INT64, shape);
+
+  H5::DataSet data = create_rows(csr, "data", H5::PredType::NATIVE_FLOAT, 0, m_level);
+  H5::DataSet indices = create_rows(csr, "indices", H5::PredType::NATIVE_INT64, 0, m_level);
+  H5::DataSet indptr = create_rows(csr, "indptr", H5::PredType::NATIVE_INT64, 0, m_level);
+
+  int64_t nnz = 0;
+  append_rows(indptr, &nnz, H5::PredType::NATIVE_INT64, 1);
+
+  // read back the edges a block of rows at a time
+  std::rewind(m_edges);
+  std::vector<std::pair<int64_t, float>> row_edges;
+  std::vector<int64_t> block_indices, block_indptr;
+  std::vector<float> block_data;
+  for (size_t s = 0; s < n; s += CYS_BLOCK_SIZE) {
+
+    const size_t e = std::min(n, s + CYS_BLOCK_SIZE);
+    size_t num_edges = 0;
+    for (size_t i = s; i < e; i++)
+      num_edges += m_degree[i];
+    m_edge_buf.resize(2 * num_edges);
+    if (std::fread(m_edge_buf.data(), sizeof(uint32_t), m_edge_buf.size(), m_edges) != m_edge_buf.size())
+      throw std::runtime_error("Unable to read the graph back from a temporary file");
+
+    block_indices.clear();
+    block_data.clear();
+    block_indptr.clear();
+    const uint32_t* edge = m_edge_buf.data();
+    for (size_t i = s; i < e; i++) {
+      row_edges.clear();
+      for (uint32_t k = 0; k < m_degree[i]; k++, edge += 2) {
+	auto it = std::lower_bound(rows.begin(), rows.end(), std::make_pair(edge[0], uint32_t(0)));
+	if (it != rows.end() && it->first == edge[0])
+	  row_edges.emplace_back(it->second, static_cast<float>(edge[1]));
+      }
+      std::sort(row_edges.begin(), row_edges.end());
+      for (const auto& r : row_edges) {
+	block_indices.push_back(r.first);
+	block_data.push_back(r.second);
+      }
+      nnz += row_edges.size();
+      block_indptr.push_back(nnz);
+    }
+
+    append_rows(data, block_data.data(), H5::PredType::NATIVE_FLOAT, block_data.size());
+    append_rows(indices, block_indices.data(), H5::PredType::NATIVE_INT64, block_indices.size());
+    append_rows(indptr, block_indptr.data(), H5::PredType::NATIVE_INT64, block_indptr.size());
+  }
+}
+
+// read rows [start, start + n) of a 1-D or 2-D dataset, with all of their columns
+static void read_rows(H5::DataSet& ds, size_t start, size_t n, const H5::DataType& type, void* out) {
+
+  if (!n)
+    return;
+
+  H5::DataSpace file_space = ds.getSpace();
+  const int rank = file_space.getSimpleExtentNdims();
+  hsize_t dims[2] = {0, 0};
+  file_space.getSimpleExtentDims(dims);
+
+  const hsize_t offset[2] = {start, 0};
+  const hsize_t count[2] = {n, dims[1]};
+  file_space.selectHyperslab(H5S_SELECT_SET, count, offset);
+  H5::DataSpace mem_space(rank, count);
+  ds.read(out, type, mem_space, file_space);
+}
+
+// number of rows, and of columns (0 if 1-D), of a dataset
+static std::pair<size_t, size_t> get_dims(const H5::DataSet& ds) {
+  H5::DataSpace space = ds.getSpace();
+  hsize_t dims[2] = {0, 0};
+  if (space.getSimpleExtentNdims() > 2)
+    throw std::runtime_error("h5ad: datasets with more than 2 dimensions are not supported");
+  space.getSimpleExtentDims(dims);
+  return {dims[0], dims[1]};
+}
+
+// number of dimensions of a dataset
+static int get_rank(const H5::DataSet& ds) {
+  return ds.getSpace().getSimpleExtentNdims();
+}
+
+// read n strings, fixed or variable length, of file_type. read(type, buf)
+// reads them from the dataset or attribute as type
+template <typename Read>
+static std::vector<std::string> read_strings(const H5::StrType& file_type, size_t n, Read read) {
+
+  std::vector<std::string> out;
+  out.reserve(n);
+  if (!n)
+    return out;
+
+  if (file_type.isVariableStr()) {
+    H5::StrType str_type(H5::PredType::C_S1, H5T_VARIABLE);
+    std::vector<char*> ptrs(n, nullptr);
+    read(str_type, ptrs.data());
+    for (const char* p : ptrs)
+      out.emplace_back(p ? p : "");
+    const hsize_t dims[1] = {n};
+    H5::DataSet::vlenReclaim(ptrs.data(), str_type, H5::DataSpace(1, dims));
+  } else {
+    const size_t len = file_type.getSize();
+    std::string buf(n * len, '\0');
+    read(file_type, &buf[0]);
+    for (size_t i = 0; i < n; i++)
+      out.emplace_back(buf.data() + i * len, strnlen(buf.data() + i * len, len));
+  }
+  return out;
+}
+
+// all of the strings of a 1-D dataset
+static std::vector<std::string> read_strings(H5::DataSet& ds) {
+  return read_strings(ds.getStrType(), ds.getSpace().getSimpleExtentNpoints(),
+		      [&ds](const H5::DataType& t, void* buf) { ds.read(buf, t); });
+}
+
+// the strings of an attribute, or empty if there is no such attribute
+static std::vector<std::string> read_string_attr(const H5::H5Object& obj, const std::string& name) {
+
+  if (!obj.attrExists(name))
+    return {};
+  H5::Attribute attr = obj.openAttribute(name);
+  if (attr.getTypeClass() != H5T_STRING)
+    return {};
+  return read_strings(attr.getStrType(), attr.getSpace().getSimpleExtentNpoints(),
+		      [&attr](const H5::DataType& t, void* buf) { attr.read(t, buf); });
+}
+
+// the encoding-type attribute of an AnnData element, or empty if none
+static std::string encoding_type(const H5::H5Object& obj) {
+  const std::vector<std::string> enc = read_string_attr(obj, "encoding-type");
+  return enc.empty() ? std::string() : enc[0];
+}
+
+static bool has_child(const H5::Group& group, const std::string& name) {
+  return H5Lexists(group.getId(), name.c_str(), H5P_DEFAULT) > 0;
+}
+
+// open the data, indices and indptr of a csr_matrix group
+static void open_csr(const H5::Group& group, const std::string& what,
+		     H5::DataSet& data, H5::DataSet& indices, H5::DataSet& indptr) {
+
+  const std::string enc = encoding_type(group);
+  if (enc != "csr_matrix")
+    throw std::runtime_error("h5ad: " + what + " is stored as " + (enc.empty() ? "unknown" : enc) +
+			     ", only dense arrays and csr_matrix are supported");
+  data = group.openDataSet("data");
+  indices = group.openDataSet("indices");
+  indptr = group.openDataSet("indptr");
+}
+
+void H5adReader::Open(const std::string& file) {
+
+  try {
+
+    m_file = H5::H5File(file, H5F_ACC_RDONLY);
+    H5::Group root = m_file.openGroup("/");
+
+    // X
+    if (!has_child(root, "X"))
+      throw std::runtime_error("h5ad: no X in " + file);
+    if (root.childObjType("X") == H5O_TYPE_GROUP) {
+      m_sparse = true;
+      open_csr(root.openGroup("X"), "X", m_x_data, m_x_indices, m_x_indptr);
+      m_num_cells = get_dims(m_x_indptr).first - 1;
+    } else {
+      m_x_data = root.openDataSet("X");
+      m_num_cells = get_dims(m_x_data).first;
+    }
+
+    // markers are the var names
+    H5::Group var = root.openGroup("var");
+    std::vector<std::string> var_index = read_string_attr(var, "_index");
+    H5::DataSet var_names = var.openDataSet(var_index.empty() ? "_index" : var_index[0]);
+    m_markers = read_strings(var_names);
+
+    // a dense X is read a row of markers at a time
+    if (!m_sparse && (get_rank(m_x_data) != 2 || get_dims(m_x_data).second != m_markers.size()))
+      throw std::runtime_error("h5ad: X should be " + std::to_string(m_num_cells) + " x " +
+			       std::to_string(m_markers.size()) + " (cells x var)");
+
+    // numeric obs columns
+    H5::Group obs = root.openGroup("obs");
+    std::vector<std::string> obs_index = read_string_attr(obs, "_index");
+    const std::string index_name = obs_index.empty() ? "_index" : obs_index[0];
+    std::vector<std::string> columns = read_string_attr(obs, "column-order");
+    if (columns.empty())
+      for (hsize_t i = 0; i < obs.getNumObjs(); i++)
+	if (obs.getObjnameByIdx(i) != index_name && obs.getObjnameByIdx(i) != "__categories")
+	  columns.push_back(obs.getObjnameByIdx(i));
+
+    bool has_x = false, has_y = false, has_cflag = false, has_pflag = false;
+    for (const auto& c : columns) {
+
+      H5::DataSet ds;
+      if (obs.childObjType(c) == H5O_TYPE_GROUP) {
+	H5::Group g = obs.openGroup(c);
+	if (encoding_type(g) != "categorical") {
+	  std::cerr << "warning: skipping obs column " << c << ", of type " << encoding_type(g) << std::endl;
+	  continue;
+	}
+	ds = g.openDataSet("codes");
+      } else {
+	ds = obs.openDataSet(c);
+	const H5T_class_t cls = ds.getTypeClass();
+	if (cls != H5T_INTEGER && cls != H5T_FLOAT) {
+	  std::cerr << "warning: skipping non-numeric obs column " << c << std::endl;
+	  continue;
+	}
+      }
+
+      if (get_rank(ds) != 1)
+	throw std::runtime_error("h5ad: obs column " + c + " is not one-dimensional");
+      if (get_dims(ds).first != m_num_cells)
+	throw std::runtime_error("h5ad: obs column " + c + " has " + std::to_string(get_dims(ds).first) +
+				 " rows, X has " + std::to_string(m_num_cells));
+
+      if (c == "x") {
+	m_obs_x = ds;
+	has_x = true;
+      } else if (c == "y") {
+	m_obs_y = ds;
+	has_y = true;
+      } else if (c == "cflag") {
+	m_cflag = ds;
+	has_cflag = true;
+      } else if (c == "pflag") {
+	m_pflag = ds;
+	has_pflag = true;
+      } else {
+	m_metas.push_back(c);
+	m_meta_sets.push_back(ds);
+      }
+    }
+    m_has_flags = has_cflag && has_pflag;
+
+    // x and y
+    if (has_child(root, "obsm") && has_child(root.openGroup("obsm"), "spatial")) {
+      m_spatial = root.openGroup("obsm").openDataSet("spatial");
+      if (get_rank(m_spatial) != 2 || get_dims(m_spatial).first != m_num_cells ||
+	  get_dims(m_spatial).second < 2)
+	throw std::runtime_error("h5ad: obsm['spatial'] should be " + std::to_string(m_num_cells) + " x 2");
+      m_obsm_spatial = true;
+    } else if (!has_x || !has_y) {
+      throw std::runtime_error("h5ad: no obsm['spatial'] or obs x and y columns in " + file);
+    }
+
+    // spatial graph
+    if (m_graph) {
+      if (!has_child(root, "obsp"))
+	throw std::runtime_error("h5ad: no obsp in " + file + " to read the graph from");
+      H5::Group obsp = root.openGroup("obsp");
+      if (m_graph_name.empty()) {
+	for (const char* name : {"spatial_distances", "spatial_connectivities", "connectivities"})
+	  if (has_child(obsp, name)) {
+	    m_graph_name = name;
+	    break;
+	  }
+      }
+      if (m_graph_name.empty() || !has_child(obsp, m_graph_name))
+	throw std::runtime_error("h5ad: no graph " + m_graph_name + " in obsp of " + file);
+      open_csr(obsp.openGroup(m_graph_name), "obsp['" + m_graph_name + "']", m_g_data, m_g_indices, m_g_indptr);
+      if (get_dims(m_g_indptr).first != m_num_cells + 1)
+	throw std::runtime_error("h5ad: obsp['" + m_graph_name + "'] has the wrong number of rows");
+    }
+
+    read_ids();
+
+  } catch (const H5::Exception& e) {
+    throw std::runtime_error("Unable to read h5ad file " + file + ": " + e.getDetailMsg());
+  }
+}
+
+void H5adReader::read_ids() {
+
+  H5::Group obs = m_file.openGroup("obs");
+  std::vector<std::string> obs_index = read_string_attr(obs, "_index");
+  H5::DataSet names = obs.openDataSet(obs_index.empty() ? "_index" : obs_index[0]);
+  const H5::StrType str_type = names.getStrType();
+
+  // a block of names at a time
+  m_ids.resize(m_num_cells);
+  H5::DataSpace file_space = names.getSpace();
+  for (size_t s = 0; s < m_num_cells; s += CYS_BLOCK_SIZE) {
+
+    const hsize_t offset[1] = {s};
+    const hsize_t count[1] = {std::min<hsize_t>(CYS_BLOCK_SIZE, m_num_cells - s)};
+    file_space.selectHyperslab(H5S_SELECT_SET, count, offset);
+    H5::DataSpace mem_space(1, count);
+    const std::vector<std::string> block = read_strings(str_type, count[0], [&](const H5::DataType& t, void* buf) {
+      names.read(buf, t, mem_space, file_space);
+    });
+    for (size_t i = 0; i < block.size(); i++) {
+      const std::string& name = block[i];
+      size_t d = name.size();
+      while (d > 0 && name[d - 1] >= '0' && name[d - 1] <= '9')
+	d--;
+      uint32_t id = s + i;
+      if (d < name.size())
+	std::from_chars(name.data() + d, name.data() + name.size(), id);
+      m_ids[s + i] = id;
+    }
+  }
+}
+
+void H5adReader::ReadHeader(CellHeader& header) {
+
+  for (const auto& m : m_markers)
+    header.addTag(Tag(Tag::MA_TAG, m, ""));
+  for (const auto& m : m_metas)
+    header.addTag(Tag(Tag::CA_TAG, m, ""));
+  if (m_graph)
+    header.addTag(Tag(Tag::GA_TAG, "spat", "h5ad:" + m_graph_name));
+}
+
+void H5adReader::read_csr(H5::DataSet& data, H5::DataSet& indices, H5::DataSet& indptr,
+			  size_t start, size_t end) {
+
+  m_indptr.resize(end - start + 1);
+  read_rows(indptr, start, m_indptr.size(), H5::PredType::NATIVE_INT64, m_indptr.data());
+
+  const size_t s = m_indptr.front();
+  const size_t nnz = m_indptr.back() - m_indptr.front();
+  m_indices.resize(nnz);
+  m_buf.resize(nnz);
+  read_rows(indices, s, nnz, H5::PredType::NATIVE_INT64, m_indices.data());
+  read_rows(data, s, nnz, H5::PredType::NATIVE_FLOAT, m_buf.data());
+}
+
+bool H5adReader::ReadBlock(CellBlock& block) {
+
+  const size_t n = std::min<size_t>(CYS_BLOCK_SIZE, m_num_cells - m_row);
+  if (!n)
+    return false;
+
+  const size_t nm = m_markers.size();
+  block.Init(nm + m_metas.size());
+  block.m_ids.assign(m_ids.begin() + m_row, m_ids.begin() + m_row + n);
+  block.m_pheno_flags.resize(n, 0);
+  block.m_cell_flags.resize(n, 0);
+  block.m_x.resize(n);
+  block.m_y.resize(n);
+  for (auto& c : block.m_cols)
+    c.resize(n);
+
+  try {
+
+    // X, into the marker columns
+    if (m_sparse) {
+      read_csr(m_x_data, m_x_indices, m_x_indptr, m_row, m_row + n);
+      for (size_t j = 0; j < nm; j++)
+	std::fill(block.m_cols[j].begin(), block.m_cols[j].end(), 0.0f);
+      for (size_t i = 0; i < n; i++)
+	for (int64_t k = m_indptr[i]; k < m_indptr[i + 1]; k++) {
+	  const int64_t j = m_indices[k - m_indptr[0]];
+	  if (j < 0 || static_cast<size_t>(j) >= nm)
+	    throw std::runtime_error("h5ad: column index " + std::to_string(j) + " of X is out of range");
+	  block.m_cols[j][i] = m_buf[k - m_indptr[0]];
+	}
+    } else {
+      m_buf.resize(n * nm);
+      read_rows(m_x_data, m_row, n, H5::PredType::NATIVE_FLOAT, m_buf.data());
+      for (size_t i = 0; i < n; i++)
+	for (size_t j = 0; j < nm; j++)
+	  block.m_cols[j][i] = m_buf[i * nm + j];
+    }
+
+    // the meta columns go straight into place
+    for (size_t j = 0; j < m_meta_sets.size(); j++)
+      read_rows(m_meta_sets[j], m_row, n, H5::PredType::NATIVE_FLOAT, block.m_cols[nm + j].data());
+
+    if (m_obsm_spatial) {
+      const size_t w = get_dims(m_spatial).second;
+      m_buf.resize(n * w);
+      read_rows(m_spatial, m_row, n, H5::PredType::NATIVE_FLOAT, m_buf.data());
+      for (size_t i = 0; i < n; i++) {
+	block.m_x[i] = m_buf[i * w];
+	block.m_y[i] = m_buf[i * w + 1];
+      }
+    } else {
+      read_rows(m_obs_x, m_row, n, H5::PredType::NATIVE_FLOAT, block.m_x.data());
+      read_rows(m_obs_y, m_row, n, H5::PredType::NATIVE_FLOAT, block.m_y.data());
+    }
+
+    if (m_has_flags) {
+      read_rows(m_cflag, m_row, n, flag_type(), block.m_cell_flags.data());
+      read_rows(m_pflag, m_row, n, flag_type(), block.m_pheno_flags.data());
+    }
+
+    // graph, with the columns as cell ids
+    block.m_graph_offsets.assign(n + 1, 0);
+    if (m_graph) {
+      read_csr(m_g_data, m_g_indices, m_g_indptr, m_row, m_row + n);
+      const size_t nnz = m_indices.size();
+      block.m_graph_ids.resize(nnz);
+      block.m_graph_dist.resize(nnz);
+      block.m_graph_flags.assign(nnz, 0);
+      for (size_t k = 0; k < nnz; k++) {
+	if (m_indices[k] < 0 || static_cast<size_t>(m_indices[k]) >= m_num_cells)
+	  throw std::runtime_error("h5ad: column index of obsp['" + m_graph_name + "'] is out of range");
+	block.m_graph_ids[k] = m_ids[m_indices[k]];
+	block.m_graph_dist[k] = static_cast<uint32_t>(std::lround(std::max(0.0f, m_buf[k])));
+      }
+      for (size_t i = 0; i <= n; i++)
+	block.m_graph_offsets[i] = m_indptr[i] - m_indptr[0];
+    }
+
+  } catch (const H5::Exception& e) {
+    throw std::runtime_error("Unable to read h5ad file: " + e.getDetailMsg());
+  }
+
+  m_row += n;
+  return true;
+}
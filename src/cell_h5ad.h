@@ -0,0 +1,188 @@
+#pragma once
+
+#include "cell_block.h"
+#include "cell_header.h"
+
+#include <H5Cpp.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * @class H5adWriter
+ * @brief Writes cells to an AnnData (.h5ad) file a block at a time
+ *
+ * The markers go to X (cells x markers), and x, y, the flags and the meta
+ * columns to obs, with x and y also as obsm['spatial']. Every dataset is
+ * chunked, gzip compressed and grows as blocks are written, so only one
+ * block is held in memory. Cell names ("cellid_<id>") for obs/_index are
+ * packed into one buffer per block.
+ *
+ * With SetGraph, the spatial graph is written at Close as the sparse CSR
+ * matrix obsp['spatial_distances']. Its columns are rows of the output,
+ * so the edges are spooled to a temporary file until all of the cell ids
+ * are known. Neighbors that are not in the output are dropped.
+ */
+class H5adWriter {
+
+ public:
+
+  H5adWriter() = default;
+
+  H5adWriter(const H5adWriter&) = delete;
+  H5adWriter& operator=(const H5adWriter&) = delete;
+
+  ~H5adWriter();
+
+  // gzip level of the datasets, 0 for none
+  void SetCompression(int level) { m_level = level; }
+
+  // write the spatial graph as obsp['spatial_distances']
+  void SetGraph(bool graph) { m_graph = graph; }
+
+  // create the file and its datasets for the columns of header.
+  // Throws a runtime_error if the file can't be written
+  void Open(const std::string& file, const CellHeader& header);
+
+  // append rows [start, end) of a block.
+  // Throws a runtime_error if the rows can't be written
+  void WriteBlock(const CellBlock& block, size_t start, size_t end);
+
+  // append one cell. Cells are gathered into a block before writing
+  void WriteCell(const Cell& cell);
+
+  // write anything buffered and the graph, and close the file.
+  // Throws a runtime_error if the file can't be finished
+  void Close();
+
+  // number of cells written
+  size_t NumCells() const { return m_num_cells; }
+
+ private:
+
+  H5::H5File m_file;
+  bool m_open = false;
+
+  int m_level = 4;
+  bool m_graph = false;
+
+  // index in the block columns of each marker and meta column
+  std::vector<size_t> m_markers;
+  std::vector<size_t> m_metas;
+
+  H5::DataSet m_x_data;
+  H5::DataSet m_spatial;
+  H5::DataSet m_index;
+  std::vector<H5::DataSet> m_obs; // x, y, cflag, pflag, then metas
+
+  // cells of WriteCell not yet written
+  CellBlock m_block;
+
+  // reused for the rows of a block
+  std::vector<float> m_buf;
+  std::string m_names;
+  std::vector<const char*> m_name_ptrs;
+
+  size_t m_num_cells = 0;
+
+  // for the graph: the id and number of edges of each cell, and the
+  // (neighbor id, distance) of each edge
+  std::vector<uint32_t> m_ids;
+  std::vector<uint32_t> m_degree;
+  std::FILE* m_edges = nullptr;
+  std::vector<uint32_t> m_edge_buf;
+
+  void write_block(const CellBlock& block, size_t start, size_t end);
+
+  void flush_block();
+
+  void write_graph();
+
+  void release();
+
+};
+
+/**
+ * @class H5adReader
+ * @brief Reads cells from an AnnData (.h5ad) file a block at a time
+ *
+ * The columns of X (dense, or a csr_matrix) become the markers and the
+ * numeric obs columns the metas. Categorical obs columns are read as their
+ * codes, and string and boolean columns are skipped. x and y come from obsm['spatial'],
+ * or else from obs columns x and y. Obs columns cflag and pflag, as written
+ * by H5adWriter, are read back as the flags.
+ *
+ * Cell ids are the trailing digits of the obs names ("cellid_12" is 12),
+ * or the row number for names without them. With SetGraph, a csr_matrix
+ * in obsp is read as the spatial graph, its values rounded to distances.
+ * Only the ids of the cells are held for the whole file; everything else
+ * is read CYS_BLOCK_SIZE rows at a time.
+ */
+class H5adReader {
+
+ public:
+
+  H5adReader() = default;
+
+  H5adReader(const H5adReader&) = delete;
+  H5adReader& operator=(const H5adReader&) = delete;
+
+  // read the graph from obsp[name]. Empty for the first of
+  // spatial_distances, spatial_connectivities and connectivities
+  void SetGraph(const std::string& name) { m_graph = true; m_graph_name = name; }
+
+  // open the file and find its datasets. Throws a runtime_error
+  // if it can't be read
+  void Open(const std::string& file);
+
+  // the marker and meta tags, and a graph tag with SetGraph
+  void ReadHeader(CellHeader& header);
+
+  // read the next CYS_BLOCK_SIZE cells (or fewer, at the end) into
+  // block. Returns false at the end of the file
+  bool ReadBlock(CellBlock& block);
+
+  size_t NumCells() const { return m_num_cells; }
+
+ private:
+
+  H5::H5File m_file;
+
+  size_t m_num_cells = 0;
+  size_t m_row = 0;
+
+  // X, dense or as the data, indices and indptr of a csr_matrix
+  bool m_sparse = false;
+  H5::DataSet m_x_data, m_x_indices, m_x_indptr;
+  std::vector<std::string> m_markers;
+
+  // numeric obs columns
+  std::vector<std::string> m_metas;
+  std::vector<H5::DataSet> m_meta_sets;
+
+  // x and y, as obsm['spatial'] or two obs columns
+  bool m_obsm_spatial = false;
+  H5::DataSet m_spatial, m_obs_x, m_obs_y;
+
+  bool m_has_flags = false;
+  H5::DataSet m_cflag, m_pflag;
+
+  bool m_graph = false;
+  std::string m_graph_name;
+  H5::DataSet m_g_data, m_g_indices, m_g_indptr;
+
+  std::vector<uint32_t> m_ids;
+
+  // reused for the rows of a block
+  std::vector<float> m_buf;
+  std::vector<int64_t> m_indptr;
+  std::vector<int64_t> m_indices;
+
+  void read_ids();
+
+  // read the csr rows [start, end) into values / column indices
+  void read_csr(H5::DataSet& data, H5::DataSet& indices, H5::DataSet& indptr,
+		size_t start, size_t end);
+
+};
@@ -0,0 +1,163 @@
+#include "cell_index.h"
+#include "cell_mmap.h"
+#include "cell_reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+// what an index records of its .cys file, to tell when it is stale
+struct IndexStamp {
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  uint64_t footer_offset = 0; // from the end frame, 0 if there is none
+};
+
+// stamp of a .cys file on disk. Returns false if it can't be found
+static bool file_stamp(const std::string& file, IndexStamp& stamp) {
+
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0)
+    return false;
+  stamp.size = st.st_size;
+  stamp.mtime = st.st_mtime;
+
+  // the end frame is the last thing in the file, and points to the footer
+  stamp.footer_offset = 0;
+  std::ifstream is(file, std::ios::binary);
+  BlockFrame frame;
+  if (stamp.size >= sizeof(BlockFrame) &&
+      is.seekg(stamp.size - sizeof(BlockFrame)) &&
+      is.read(reinterpret_cast<char*>(&frame), sizeof(frame)) &&
+      frame.magic == CYS_FRAME_MAGIC && frame.type == CYS_FRAME_END)
+    stamp.footer_offset = frame.raw_size;
+
+  return true;
+}
+
+bool CellIndex::Read(const std::string& file) {
+
+  m_entries.clear();
+
+  if (file == "-")
+    return false;
+
+  std::ifstream is(IndexPath(file), std::ios::binary);
+  if (!is.good())
+    return false;
+
+  char magic[sizeof(CYS_INDEX_MAGIC)];
+  uint32_t version = 0;
+  IndexStamp stamp;
+  uint64_t num_entries = 0;
+  is.read(magic, sizeof(magic));
+  is.read(reinterpret_cast<char*>(&version), sizeof(version));
+  is.read(reinterpret_cast<char*>(&stamp.size), sizeof(stamp.size));
+  is.read(reinterpret_cast<char*>(&stamp.mtime), sizeof(stamp.mtime));
+  is.read(reinterpret_cast<char*>(&stamp.footer_offset), sizeof(stamp.footer_offset));
+  is.read(reinterpret_cast<char*>(&num_entries), sizeof(num_entries));
+
+  if (!is.good() || std::memcmp(magic, CYS_INDEX_MAGIC, sizeof(magic)) != 0 ||
+      version != CYS_INDEX_VERSION)
+    return false;
+
+  // stale index, from an earlier version of the file
+  IndexStamp current;
+  if (!file_stamp(file, current) || current.size != stamp.size ||
+      current.mtime != stamp.mtime || current.footer_offset != stamp.footer_offset)
+    return false;
+
+  // every block takes more than an entry's worth of the file, so a
+  // larger count is a corrupt index
+  if (num_entries > stamp.size / sizeof(BlockIndexEntry))
+    return false;
+
+  m_entries.resize(num_entries);
+  is.read(reinterpret_cast<char*>(m_entries.data()), num_entries * sizeof(BlockIndexEntry));
+  if (!is.good()) {
+    m_entries.clear();
+    return false;
+  }
+
+  return true;
+}
+
+void CellIndex::Write(const std::string& file) const {
+
+  IndexStamp stamp;
+  if (!file_stamp(file, stamp))
+    throw std::runtime_error("Unable to find: " + file);
+
+  std::ofstream os(IndexPath(file), std::ios::binary);
+  if (!os.good())
+    throw std::runtime_error("Unable to write index: " + IndexPath(file));
+
+  const uint64_t num_entries = m_entries.size();
+  os.write(CYS_INDEX_MAGIC, sizeof(CYS_INDEX_MAGIC));
+  os.write(reinterpret_cast<const char*>(&CYS_INDEX_VERSION), sizeof(CYS_INDEX_VERSION));
+  os.write(reinterpret_cast<const char*>(&stamp.size), sizeof(stamp.size));
+  os.write(reinterpret_cast<const char*>(&stamp.mtime), sizeof(stamp.mtime));
+  os.write(reinterpret_cast<const char*>(&stamp.footer_offset), sizeof(stamp.footer_offset));
+  os.write(reinterpret_cast<const char*>(&num_entries), sizeof(num_entries));
+  os.write(reinterpret_cast<const char*>(m_entries.data()), num_entries * sizeof(BlockIndexEntry));
+
+  if (!os.good())
+    throw std::runtime_error("Error writing index: " + IndexPath(file));
+}
+
+void CellIndex::Build(const std::string& file, size_t threads) {
+
+  m_entries.clear();
+
+  // the frames give the offsets and sizes, so only the id column of
+  // each block is read, and neither the other columns nor the graph
+  MappedCysFile mfile;
+  if (!mfile.Open(file)) {
+    CellReader reader;
+    if (reader.Open(file)) {
+      CellHeader header;
+      reader.ReadHeader(header);
+      if (!reader.IsBlockFormat())
+	throw std::runtime_error("Can only index block-formatted .cys files. Re-write " + file +
+				 " with this version of cysift first");
+    }
+    throw std::runtime_error("Unable to open " + file);
+  }
+
+  m_entries.resize(mfile.NumBlocks());
+
+  // blocks are independent, so map them in parallel
+  std::string error;
+#pragma omp parallel for num_threads(threads ? threads : 1) schedule(dynamic)
+  for (size_t b = 0; b < mfile.NumBlocks(); b++) {
+    try {
+      BlockIndexEntry& entry = m_entries[b];
+      entry.offset = mfile.BlockOffset(b);
+      entry.row_start = mfile.BlockStart(b);
+      entry.num_cells = mfile.BlockSize(b);
+      const ConstSpan<uint32_t> ids = mfile.GetBlock(b).ids;
+      if (ids.size()) {
+	auto mm = std::minmax_element(ids.begin(), ids.end());
+	entry.min_id = *mm.first;
+	entry.max_id = *mm.second;
+      }
+      mfile.ReleaseBlock(b);
+    } catch (const std::exception& e) {
+#pragma omp critical
+      error = e.what();
+    }
+  }
+  if (!error.empty()) {
+    m_entries.clear();
+    throw std::runtime_error(error);
+  }
+}
+
+uint64_t CellIndex::NumCells() const {
+  if (m_entries.empty())
+    return 0;
+  return m_entries.back().row_start + m_entries.back().num_cells;
+}
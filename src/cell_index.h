@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// first bytes of a .cys.idx sidecar index
+const char CYS_INDEX_MAGIC[4] = {'C', 'Y', 'S', 'I'};
+const uint32_t CYS_INDEX_VERSION = 2;
+
+/**
+ * @struct BlockIndexEntry
+ * @brief Location and row / cell id range of one block of a .cys file
+ */
+struct BlockIndexEntry {
+  uint64_t offset = 0;    // byte offset of the first frame of the block (its stats) in the .cys file
+  uint64_t row_start = 0; // row number of the first cell in the block
+  uint32_t num_cells = 0;
+  uint32_t reserved = 0;
+  uint32_t min_id = 0;    // smallest and largest cell id in the block
+  uint32_t max_id = 0;
+};
+
+static_assert(sizeof(BlockIndexEntry) == 32, "BlockIndexEntry must be packed to 32 bytes");
+
+/**
+ * @class CellIndex
+ * @brief Sidecar index of a block-formatted .cys file (<file>.idx)
+ *
+ * Maps row ranges and cell id ranges to the byte offsets of blocks,
+ * so readers can seek to just the blocks they need. The index records
+ * the size, modification time and footer offset of the .cys file it was
+ * built from, and is ignored if any of them has since changed.
+ */
+class CellIndex {
+
+ public:
+
+  CellIndex() = default;
+
+  // path of the sidecar index for a .cys file
+  static std::string IndexPath(const std::string& file) { return file + ".idx"; }
+
+  // add the next block
+  void AddBlock(const BlockIndexEntry& entry) { m_entries.push_back(entry); }
+
+  // read the sidecar index of a .cys file. Returns false if there is
+  // none, or it is out of date
+  bool Read(const std::string& file);
+
+  // write the sidecar index for a .cys file, once it is complete on disk
+  void Write(const std::string& file) const;
+
+  // build the index by scanning a .cys file. Throws if the file
+  // is not in the block format
+  void Build(const std::string& file, size_t threads);
+
+  const std::vector<BlockIndexEntry>& GetEntries() const { return m_entries; }
+
+  size_t size() const { return m_entries.size(); }
+
+  // total number of cells
+  uint64_t NumCells() const;
+
+ private:
+
+  std::vector<BlockIndexEntry> m_entries;
+
+};
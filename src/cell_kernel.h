@@ -0,0 +1,334 @@
+#pragma once
+
+#include "cell_block.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Typed kernels over contiguous column data
+ *
+ * Columns are passed as ConstSpan<T> views, and outputs as plain pointers,
+ * so each loop runs over a bare array of the column's own type: no
+ * virtual call, bounds check or conversion to float per value, and
+ * simple enough for the compiler to vectorize. Indices are not checked,
+ * so callers check sizes once before calling.
+ */
+namespace kernels {
+
+/** out[i] = f(in[i]) */
+template <typename T, typename U, typename F>
+inline void map(ConstSpan<T> in, U* out, F f) {
+  const T* a = in.data;
+  const size_t n = in.size();
+  for (size_t i = 0; i < n; i++)
+    out[i] = f(a[i]);
+}
+
+/** out[i] = f(a[i], b[i]). a and b have the same size */
+template <typename T, typename U, typename V, typename F>
+inline void map2(ConstSpan<T> a, ConstSpan<U> b, V* out, F f) {
+  const T* pa = a.data;
+  const U* pb = b.data;
+  const size_t n = a.size();
+  for (size_t i = 0; i < n; i++)
+    out[i] = f(pa[i], pb[i]);
+}
+
+/** Fold f over the values, starting from init */
+template <typename T, typename A, typename F>
+inline A reduce(ConstSpan<T> in, A init, F f) {
+  const T* a = in.data;
+  const size_t n = in.size();
+  for (size_t i = 0; i < n; i++)
+    init = f(init, a[i]);
+  return init;
+}
+
+template <typename T>
+inline double sum(ConstSpan<T> in) {
+  return reduce(in, 0.0, [](double s, T v) { return s + static_cast<double>(v); });
+}
+
+/** Mean of the values. in must not be empty */
+template <typename T>
+inline double mean(ConstSpan<T> in) {
+  return sum(in) / static_cast<double>(in.size());
+}
+
+/** Smallest and largest value, skipping NaN. in must not be empty.
+ * If every value is NaN, both are NaN
+ */
+template <typename T>
+inline std::pair<T, T> minmax(ConstSpan<T> in) {
+  const T* a = in.data;
+  const size_t n = in.size();
+
+  // start from the first value that is not NaN (NaN != NaN)
+  size_t i = 0;
+  while (i < n && a[i] != a[i])
+    i++;
+  if (i == n)
+    return {a[0], a[0]};
+
+  // NaN compares false, so it never replaces lo or hi
+  T lo = a[i];
+  T hi = a[i];
+  for (i++; i < n; i++) {
+    lo = a[i] < lo ? a[i] : lo;
+    hi = a[i] > hi ? a[i] : hi;
+  }
+  return {lo, hi};
+}
+
+/** out[i] = in[idx[i]] */
+template <typename T, typename I>
+inline void gather(ConstSpan<T> in, ConstSpan<I> idx, T* out) {
+  const T* a = in.data;
+  const I* p = idx.data;
+  const size_t n = idx.size();
+  for (size_t i = 0; i < n; i++)
+    out[i] = a[p[i]];
+}
+
+/** Re-order v so that its new row i is its old row order[i].
+ * scratch is used for the gather, and swapped in as v
+ */
+template <typename T>
+inline void permute(std::vector<T>& v, const std::vector<size_t>& order, std::vector<T>& scratch) {
+  scratch.resize(order.size());
+  gather(ConstSpan<T>(v.data(), v.size()), ConstSpan<size_t>(order.data(), order.size()), scratch.data());
+  v.swap(scratch);
+}
+
+/** Re-order v in place, as permute does, by following the cycles of
+ * order. Needs one bit per row rather than a copy of the column.
+ * Throws an out_of_range if order is not a permutation of the rows
+ */
+template <typename T>
+inline void permute_in_place(std::vector<T>& v, const std::vector<size_t>& order) {
+  const size_t n = v.size();
+  if (order.size() != n)
+    throw std::out_of_range("permute_in_place: wrong number of indices");
+
+  std::vector<bool> done(n);
+  for (size_t s = 0; s < n; s++) {
+    if (done[s])
+      continue;
+    T tmp = std::move(v[s]);
+    size_t j = s;
+    for (;;) {
+      done[j] = true;
+      const size_t k = order[j];
+      if (k == s) {
+	v[j] = std::move(tmp);
+	break;
+      }
+      if (k >= n || done[k])
+	throw std::out_of_range("permute_in_place: indices are not a permutation");
+      v[j] = std::move(v[k]);
+      j = k;
+    }
+  }
+}
+
+// unsigned keys that sort in the same order as the values
+inline uint32_t radix_key(float f) {
+  uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  // flip all bits of negatives, and only the sign bit of positives
+  return u ^ ((u >> 31) ? 0xFFFFFFFFu : 0x80000000u);
+}
+inline uint32_t radix_key(uint32_t u) { return u; }
+inline uint64_t radix_key(uint64_t u) { return u; }
+
+/** The stable sort order of the values: out[i] is the row of the i'th
+ * smallest (or largest, with reverse) value. An LSD radix sort on the
+ * bytes of radix_key, with each pass split over threads. Passes where
+ * every key has the same byte are skipped
+ */
+template <typename T>
+inline std::vector<size_t> radix_order(ConstSpan<T> in, bool reverse, size_t threads) {
+
+  using K = decltype(radix_key(T()));
+  const size_t n = in.size();
+
+  std::vector<K> keys(n);
+  map(in, keys.data(), [reverse](T v) { K k = radix_key(v); return reverse ? static_cast<K>(~k) : k; });
+
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+
+  const size_t nt = std::max<size_t>(1, std::min(threads, n / 65536 + 1));
+  const size_t chunk = (n + nt - 1) / nt;
+
+  std::vector<K> keys2(n);
+  std::vector<size_t> order2(n);
+  std::vector<size_t> counts(nt * 256);
+
+  for (size_t shift = 0; shift < sizeof(K) * 8; shift += 8) {
+
+    // histogram of this byte, per chunk
+    std::fill(counts.begin(), counts.end(), 0);
+#pragma omp parallel for num_threads(nt)
+    for (size_t t = 0; t < nt; t++) {
+      size_t* c = &counts[t * 256];
+      const size_t end = std::min(n, (t + 1) * chunk);
+      for (size_t i = t * chunk; i < end; i++)
+	c[(keys[i] >> shift) & 0xFF]++;
+    }
+
+    // skip the pass if all keys share the byte
+    bool skip = false;
+    for (size_t b = 0; b < 256 && !skip; b++) {
+      size_t total = 0;
+      for (size_t t = 0; t < nt; t++)
+	total += counts[t * 256 + b];
+      skip = total == n;
+    }
+    if (skip)
+      continue;
+
+    // start of each (byte, chunk) in the output, in that order so the pass is stable
+    size_t pos = 0;
+    for (size_t b = 0; b < 256; b++) {
+      for (size_t t = 0; t < nt; t++) {
+	const size_t c = counts[t * 256 + b];
+	counts[t * 256 + b] = pos;
+	pos += c;
+      }
+    }
+
+#pragma omp parallel for num_threads(nt)
+    for (size_t t = 0; t < nt; t++) {
+      size_t* c = &counts[t * 256];
+      const size_t end = std::min(n, (t + 1) * chunk);
+      for (size_t i = t * chunk; i < end; i++) {
+	const size_t p = c[(keys[i] >> shift) & 0xFF]++;
+	keys2[p] = keys[i];
+	order2[p] = order[i];
+      }
+    }
+
+    keys.swap(keys2);
+    order.swap(order2);
+  }
+
+  return order;
+}
+
+/** Space-filling curves for ordering cells so that cells near each
+ * other in (x,y) are near each other in the file
+ */
+enum class SpaceCurve { HILBERT, MORTON };
+
+// "hilbert" or "morton". Throws a runtime_error for other names
+inline SpaceCurve ParseCurve(const std::string& name) {
+  if (name == "hilbert")
+    return SpaceCurve::HILBERT;
+  if (name == "morton")
+    return SpaceCurve::MORTON;
+  throw std::runtime_error("Unknown space-filling curve: " + name + " (expected hilbert or morton)");
+}
+
+// spread the low 16 bits of v to the even bits
+inline uint32_t spread_bits(uint32_t v) {
+  v &= 0xFFFF;
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+/** Position of the grid point (x, y), each 0-65535, along the Z-order curve */
+inline uint32_t morton_key(uint32_t x, uint32_t y) {
+  return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+/** Position of the grid point (x, y), each 0-65535, along the Hilbert curve */
+inline uint32_t hilbert_key(uint32_t x, uint32_t y) {
+  const uint32_t n = 1u << 16;
+  uint32_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    const uint32_t rx = (x & s) > 0;
+    const uint32_t ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    // rotate the quadrant so the sub-curve joins up
+    if (ry == 0) {
+      if (rx == 1) {
+	x = n - 1 - x;
+	y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+/** Curve keys of the points (x[i], y[i]) in out. The bounding box
+ * [xmin,xmax] x [ymin,ymax] is put on a 65536 x 65536 grid, with the
+ * same scale on both axes. A point with a NaN coordinate gets the
+ * largest key, so it sorts after every other point
+ */
+inline void curve_keys(ConstSpan<float> x, ConstSpan<float> y,
+		       float xmin, float xmax, float ymin, float ymax,
+		       SpaceCurve curve, uint32_t* out) {
+
+  const float range = std::max(xmax - xmin, ymax - ymin);
+  const float scale = range > 0 ? 65535.0f / range : 0.0f;
+
+  // out of the box goes to the nearest edge
+  auto cell = [scale](float v, float lo) {
+    const float g = (v - lo) * scale;
+    return g > 0 ? static_cast<uint32_t>(std::min(g, 65535.0f)) : 0u;
+  };
+
+  const uint32_t nan_key = UINT32_MAX;
+  if (curve == SpaceCurve::HILBERT)
+    map2(x, y, out, [&](float a, float b) {
+      return std::isnan(a) || std::isnan(b) ? nan_key : hilbert_key(cell(a, xmin), cell(b, ymin)); });
+  else
+    map2(x, y, out, [&](float a, float b) {
+      return std::isnan(a) || std::isnan(b) ? nan_key : morton_key(cell(a, xmin), cell(b, ymin)); });
+}
+
+/** Pearson correlation of two columns of the same size */
+template <typename T, typename U>
+inline double pearson(ConstSpan<T> a, ConstSpan<U> b) {
+
+  const double ma = mean(a);
+  const double mb = mean(b);
+
+  double num = 0, da = 0, db = 0;
+  const size_t n = a.size();
+  for (size_t i = 0; i < n; i++) {
+    const double va = static_cast<double>(a.data[i]) - ma;
+    const double vb = static_cast<double>(b.data[i]) - mb;
+    num += va * vb;
+    da += va * va;
+    db += vb * vb;
+  }
+
+  return num / (std::sqrt(da) * std::sqrt(db));
+}
+
+/** Interleave two columns into rows: out[2i] = a[i], out[2i+1] = b[i] */
+template <typename T, typename U, typename V>
+inline void interleave(ConstSpan<T> a, ConstSpan<U> b, V* out) {
+  const size_t n = a.size();
+  for (size_t i = 0; i < n; i++) {
+    out[2 * i]     = static_cast<V>(a.data[i]);
+    out[2 * i + 1] = static_cast<V>(b.data[i]);
+  }
+}
+
+} // namespace kernels
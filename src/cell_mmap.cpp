@@ -0,0 +1,164 @@
+#include "cell_mmap.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cereal/archives/portable_binary.hpp>
+
+MappedCysFile::~MappedCysFile() {
+  Close();
+}
+
+bool MappedCysFile::Open(const std::string& file) {
+
+  Close();
+
+  if (file == "-")
+    return false;
+
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < static_cast<off_t>(sizeof(CYS_MAGIC) + sizeof(uint64_t))) {
+    close(fd);
+    return false;
+  }
+
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping holds its own reference to the file
+  if (addr == MAP_FAILED)
+    return false;
+
+  m_data = static_cast<const char*>(addr);
+  m_size = st.st_size;
+
+  // legacy files can't be mapped, so leave them to the stream reader
+  if (std::memcmp(m_data, CYS_MAGIC, sizeof(CYS_MAGIC)) != 0) {
+    Close();
+    return false;
+  }
+
+  // columns are read front to back
+  madvise(addr, m_size, MADV_SEQUENTIAL);
+
+  // the header
+  size_t pos = sizeof(CYS_MAGIC);
+  uint64_t hdr_size;
+  std::memcpy(&hdr_size, m_data + pos, sizeof(hdr_size));
+  pos += sizeof(hdr_size);
+  if (pos + hdr_size > m_size)
+    throw std::runtime_error("Corrupt .cys file: truncated header");
+
+  std::istringstream iss(std::string(m_data + pos, hdr_size), std::ios::binary);
+  cereal::PortableBinaryInputArchive iarchive(iss);
+  iarchive(m_header);
+
+  index_blocks(cys_pad(pos + hdr_size));
+
+  return true;
+}
+
+void MappedCysFile::Close() {
+
+  if (m_data)
+    munmap(const_cast<char*>(m_data), m_size);
+
+  m_data = nullptr;
+  m_size = 0;
+  m_frames.clear();
+  m_offsets.clear();
+  m_block_offsets.clear();
+  m_block_starts.clear();
+  m_blocks.clear();
+  m_mapped.clear();
+  m_decompressed.clear();
+  m_num_cells = 0;
+}
+
+void MappedCysFile::index_blocks(size_t pos) {
+
+  // find the block frames
+  BlockStats stats;
+  bool have_stats = false;
+  size_t stats_pos = 0;
+  while (pos + sizeof(BlockFrame) <= m_size) {
+
+    const size_t frame_pos = pos;
+    BlockFrame frame;
+    std::memcpy(&frame, m_data + pos, sizeof(BlockFrame));
+    pos += sizeof(BlockFrame);
+
+    if (frame.magic != CYS_FRAME_MAGIC)
+      throw std::runtime_error("Corrupt .cys file: bad frame marker");
+
+    if (frame.type == CYS_FRAME_END)
+      break;
+
+    if (pos + frame.stored_size > m_size)
+      throw std::runtime_error("Corrupt .cys file: truncated block");
+
+    if (frame.type == CYS_FRAME_STATS) {
+      stats.Decode(m_data + pos, frame.stored_size);
+      have_stats = true;
+      stats_pos = frame_pos;
+    } else if (frame.type == CYS_FRAME_BLOCK) {
+      // filtered blocks are never mapped
+      if (!(have_stats && m_skip && m_skip(stats))) {
+	m_frames.push_back(frame);
+	m_offsets.push_back(pos);
+	m_block_offsets.push_back(have_stats ? stats_pos : frame_pos);
+	m_block_starts.push_back(m_num_cells);
+	m_num_cells += frame.num_cells;
+      }
+      have_stats = false;
+    }
+
+    pos += cys_pad(frame.stored_size);
+  }
+
+  m_blocks.resize(m_frames.size());
+  m_mapped.assign(m_frames.size(), 0);
+  m_decompressed.resize(m_frames.size());
+}
+
+ConstSpan<char> MappedCysFile::payload(size_t i) {
+
+  const BlockFrame& frame = m_frames.at(i);
+  const char* data = m_data + m_offsets[i];
+  if (frame.codec == CYS_CODEC_NONE)
+    return ConstSpan<char>(data, frame.stored_size);
+
+  std::string& buffer = m_decompressed[i];
+  if (buffer.empty())
+    CodecDecompress(frame.codec, data, frame.stored_size, frame.raw_size, buffer);
+  return ConstSpan<char>(buffer.data(), buffer.size());
+}
+
+const BlockView& MappedCysFile::GetBlock(size_t i, bool graph) {
+
+  const char want = graph ? 2 : 1;
+  if (m_mapped.at(i) < want) {
+    const ConstSpan<char> p = payload(i);
+    m_blocks[i].Map(p.data, p.size(), graph);
+    if (m_blocks[i].size() != m_frames[i].num_cells)
+      throw std::runtime_error("Corrupt .cys file: block has " + std::to_string(m_blocks[i].size()) +
+			       " cells, its frame says " + std::to_string(m_frames[i].num_cells));
+    m_mapped[i] = want;
+  }
+  return m_blocks[i];
+}
+
+void MappedCysFile::ReleaseBlock(size_t i) {
+  m_mapped.at(i) = 0;
+  m_blocks[i] = BlockView();
+  std::string().swap(m_decompressed[i]);
+}
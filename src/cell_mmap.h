@@ -0,0 +1,106 @@
+#pragma once
+
+#include "cell_block.h"
+#include "cell_codec.h"
+#include "cell_header.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @class MappedCysFile
+ * @brief Read-only memory map of a block-formatted .cys file
+ *
+ * The file is mapped once and each row group is exposed as a BlockView,
+ * whose column spans point straight into the mapped pages. Nothing is
+ * copied until the caller reads from the spans, and separate cysift
+ * processes on the same file share the page cache.
+ *
+ * Opening only walks the frames, so its cost doesn't depend on the codec.
+ * A block is mapped the first time it is asked for, and a compressed
+ * block is inflated then, into memory owned by this object until
+ * ReleaseBlock. Different blocks can be asked for from several threads
+ * at once, but not the same block.
+ *
+ * Only regular files in the block format can be mapped. Open() returns
+ * false for stdin and for legacy files, which should go through CellReader.
+ */
+class MappedCysFile {
+
+ public:
+
+  MappedCysFile() = default;
+
+  ~MappedCysFile();
+
+  MappedCysFile(const MappedCysFile&) = delete;
+  MappedCysFile& operator=(const MappedCysFile&) = delete;
+
+  // leave out blocks whose zone map this returns true for. Set before Open()
+  void SetBlockFilter(std::function<bool(const BlockStats&)> skip) { m_skip = std::move(skip); }
+
+  // map the file and index its blocks. Returns false if the file
+  // can't be mapped, or isn't in the block format
+  bool Open(const std::string& file);
+
+  // unmap the file. Any spans from this file are no longer valid
+  void Close();
+
+  const CellHeader& GetHeader() const { return m_header; }
+
+  size_t NumBlocks() const { return m_blocks.size(); }
+
+  // total number of cells, across all blocks
+  size_t NumCells() const { return m_num_cells; }
+
+  // row offset of the first cell of block i
+  size_t BlockStart(size_t i) const { return m_block_starts.at(i); }
+
+  // number of cells in block i, from its frame
+  size_t BlockSize(size_t i) const { return m_frames.at(i).num_cells; }
+
+  // byte offset in the file of the first frame of block i (its stats, if any)
+  uint64_t BlockOffset(size_t i) const { return m_block_offsets.at(i); }
+
+  // block i, mapped (and inflated) if it hasn't been yet. The graph
+  // spans are empty unless graph is set, and a varint graph is only
+  // decoded the first time a block's graph is asked for
+  const BlockView& GetBlock(size_t i, bool graph = false);
+
+  // drop the inflated payload of block i. Its views are no longer
+  // valid, and it is inflated again if asked for
+  void ReleaseBlock(size_t i);
+
+ private:
+
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+
+  CellHeader m_header;
+
+  // frame and payload position in the file of each block
+  std::vector<BlockFrame> m_frames;
+  std::vector<size_t> m_offsets;
+  std::vector<uint64_t> m_block_offsets;
+  std::vector<size_t> m_block_starts;
+
+  // views of the blocks, and whether each is mapped yet: 0 not at
+  // all, 1 without its graph, 2 with its graph
+  std::vector<BlockView> m_blocks;
+  std::vector<char> m_mapped;
+
+  // inflated payloads of compressed blocks, indexed as m_blocks
+  std::vector<std::string> m_decompressed;
+
+  size_t m_num_cells = 0;
+
+  std::function<bool(const BlockStats&)> m_skip;
+
+  // walk the frames after the header and find each block
+  void index_blocks(size_t pos);
+
+  // the payload of block i, inflating it if needed
+  ConstSpan<char> payload(size_t i);
+
+};
@@ -4,6 +4,24 @@
 
 #include "cell_row.h"
 
+#include <limits>
+#include <unordered_map>
+
+void CellProcessor::ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+				 Cell* cells, int* vals) {
+
+  size_t i = start;
+  for (; i < end && !Done(); i++) {
+    block.GetCell(i, cells[i - start]);
+    SetCurrentRow(row + i);
+    vals[i - start] = ProcessLine(cells[i - start]);
+  }
+
+  // the rest aren't needed
+  for (; i < end; i++)
+    vals[i - start] = NO_WRITE_CELL;
+}
+
 int SelectProcessor::ProcessHeader(CellHeader& header) {
   
   m_header = header;
@@ -33,8 +51,7 @@ int SelectProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream();
   
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
   
   return 0;
 }
@@ -63,8 +80,7 @@ int AverageProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream();
   
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
   
   return 0;
 }
@@ -80,6 +96,26 @@ int AverageProcessor::ProcessLine(Cell& cell) {
   return CellProcessor::NO_WRITE_CELL;
 }
 
+void AverageProcessor::MergeWorker(const CellProcessor& worker) {
+
+  const AverageProcessor& w = static_cast<const AverageProcessor&>(worker);
+  n += w.n;
+  for (size_t i = 0; i < sums.size(); i++)
+    sums[i] += w.sums[i];
+}
+
+void AverageProcessor::SetStats(const FileStats& stats) {
+
+  assert(stats.cols.size() == sums.size());
+
+  n = stats.num_cells;
+
+  // as when streaming, a column with any NaN averages to NaN
+  for (size_t i = 0; i < sums.size(); i++)
+    sums[i] = stats.cols[i].count == n ? stats.cols[i].sum :
+      std::numeric_limits<double>::quiet_NaN();
+}
+
 void AverageProcessor::EmitCell() const {
 
   Cell cell;
@@ -97,59 +133,119 @@ void AverageProcessor::EmitCell() const {
   OutputLine(cell);
 }
 
+bool SelectProcessor::SkipBlock(const BlockIndexEntry& entry) const {
+
+  if (m_ids.empty())
+    return false;
+
+  // skip if none of the ids fall in the id range of the block
+  auto it = std::lower_bound(m_ids.begin(), m_ids.end(), entry.min_id);
+  return it == m_ids.end() || *it > entry.max_id;
+}
+
+// true if no cell with flags in the range given by their OR and AND
+// summaries can have testAndOr(logor, logand) != lognot
+static bool flags_rule_out(cy_uint flag_or, cy_uint flag_and,
+			   cy_uint logor, cy_uint logand, bool lognot) {
+
+  // no cell can pass the test
+  bool none = (logor != 0 && (flag_or & logor) == 0) ||
+    (logand != 0 && (flag_or & logand) != logand);
+
+  // every cell passes the test
+  bool all = (logor == 0 || (flag_and & logor) != 0) &&
+    (logand == 0 || (flag_and & logand) == logand);
+
+  return lognot ? all : none;
+}
+
+bool SelectProcessor::SkipBlockStats(const BlockStats& stats) const {
+
+  if (flags_rule_out(stats.pflag_or, stats.pflag_and, m_por, m_pand, m_pnot) ||
+      flags_rule_out(stats.cflag_or, stats.cflag_and, m_cor, m_cand, m_cnot))
+    return true;
+
+  if (m_i < 0 || static_cast<size_t>(m_i) >= stats.col_min.size())
+    return false;
+
+  const float lo = stats.col_min[m_i];
+  const float hi = stats.col_max[m_i];
+  if (m_greater != dummy_float)
+    return hi <= m_greater;
+  if (m_less != dummy_float)
+    return lo >= m_less;
+  if (m_greater_equal != dummy_float)
+    return hi < m_greater_equal;
+  if (m_less_equal != dummy_float)
+    return lo > m_less_equal;
+  if (m_equal != dummy_float)
+    return m_equal < lo || m_equal > hi;
+  return false;
+}
+
 int SelectProcessor::ProcessLine(Cell& cell) {
 
-  bool write_cell = false;
+  const float value = m_i >= 0 ? cell.m_cols.at(m_i) : 0;
+  if (selected(cell.m_id, cell.m_pheno_flag, cell.m_cell_flag, value))
+    return CellProcessor::WRITE_CELL;
+  
+  return CellProcessor::NO_WRITE_CELL; // don't write if not selected
+}
+
+void SelectProcessor::ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+				   Cell* cells, int* vals) {
+
+  // test straight from the columns, and only build the selected cells
+  const float* field = m_i >= 0 ? block.m_cols.at(m_i).data() : nullptr;
+  for (size_t i = start; i < end; i++) {
+    const float value = field ? field[i] : 0;
+    if (selected(block.m_ids[i], block.m_pheno_flags[i], block.m_cell_flags[i], value)) {
+      vals[i - start] = CellProcessor::WRITE_CELL;
+      block.GetCell(i, cells[i - start]);
+    } else {
+      vals[i - start] = CellProcessor::NO_WRITE_CELL;
+    }
+  }
+}
+
+bool SelectProcessor::selected(uint32_t id, cy_uint pflag, cy_uint cflag, float value) const {
+
+  // select on ids
+  if (!m_ids.empty() && !std::binary_search(m_ids.begin(), m_ids.end(), id))
+    return false;
 
   ///////
   // FLAGS
   ///////
   // NB: even if flags are all empty, default should be to trigger a "write_cell = true"
   
-  // get the flag value from the line
-  CellFlag pflag(cell.m_pheno_flag);
-  CellFlag cflag(cell.m_cell_flag);  
-  
-  // test it and print line if so
-  bool pflags_met = pflag.testAndOr(m_por, m_pand);
-  bool cflags_met = cflag.testAndOr(m_cor, m_cand);  
-
-  //std::cerr << "m_por " << m_por << " m_pand " << m_pand << " pflag " << pflag << " test " << pflags_met << " m_pnot " << m_pnot << std::endl;
-  //std::cerr << "m_cor " << m_cor << " m_cand " << m_cand << " cflag " << cflag << " test " << cflags_met << " m_cnot " << m_cnot << std::endl;  
-  
-  // if flags met, print the cell
-  if ( (pflags_met != m_pnot) && (cflags_met != m_cnot)) {
-    write_cell = true;
-    //std::cerr << " writing cell " << std::endl;
-  }
+  // test the flags
+  bool pflags_met = CellFlag(pflag).testAndOr(m_por, m_pand);
+  bool cflags_met = CellFlag(cflag).testAndOr(m_cor, m_cand);  
 
+  if ( (pflags_met == m_pnot) || (cflags_met == m_cnot))
+    return false;
 
   ///////
   // FIELD
   /////// 
-  if (m_i >= 0) {
-    assert(m_i < cell.m_cols.size());
-    float value = cell.m_cols.at(m_i);
-
-    if (m_greater != dummy_float) {
-      write_cell = write_cell && value > m_greater;
-    } else if (m_less != dummy_float) {
-      write_cell = write_cell && value < m_less;
-    } else if (m_greater_equal != dummy_float) {
-      write_cell = write_cell && value >= m_greater_equal;
-    } else if (m_less_equal != dummy_float) {
-      write_cell = write_cell && value <= m_less_equal;
-    } else if (m_equal != dummy_float) {
-      write_cell = write_cell && value == m_equal;
-    } else {
-      assert(false);
-    }
+  if (m_i < 0)
+    return true;
+  
+  if (m_greater != dummy_float) {
+    return value > m_greater;
+  } else if (m_less != dummy_float) {
+    return value < m_less;
+  } else if (m_greater_equal != dummy_float) {
+    return value >= m_greater_equal;
+  } else if (m_less_equal != dummy_float) {
+    return value <= m_less_equal;
+  } else if (m_equal != dummy_float) {
+    return value == m_equal;
   }
 
-  if (write_cell)
-    return CellProcessor::WRITE_CELL;
-  
-  return CellProcessor::NO_WRITE_CELL; // don't write if not selected
+  assert(false);
+  return false;
 }
 
 int RadialProcessor::ProcessHeader(CellHeader& header) {
@@ -177,6 +273,14 @@ int RadialProcessor::ProcessHeader(CellHeader& header) {
     }
   }
 
+  // the area of each ring, for the density
+  m_area.resize(m_inner.size());
+  for (size_t j = 0; j < m_inner.size(); ++j) {
+    float outerArea = static_cast<float>(m_outer[j]) * static_cast<float>(m_outer[j]) * 3.1415926535f;
+    float innerArea = static_cast<float>(m_inner[j]) * static_cast<float>(m_inner[j]) * 3.1415926535f;
+    m_area[j] = outerArea - innerArea;
+  }
+
   m_header.SortTags();
   
   // just in time output, so as not to write an empty file if the input crashes
@@ -184,8 +288,7 @@ int RadialProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream(); 
 
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
   
   return 0;
   
@@ -193,7 +296,9 @@ int RadialProcessor::ProcessHeader(CellHeader& header) {
 
 int RadialProcessor::ProcessLine(Cell& cell) {
 
-  std::vector<float> cell_count(m_inner.size());
+  // re-use the counts from the last cell
+  std::vector<float>& cell_count = m_cell_count;
+  cell_count.assign(m_inner.size(), 0);
 
   assert(cell.m_spatial_ids.size() == cell.m_spatial_flags.size());
   assert(cell.m_spatial_ids.size() == cell.m_spatial_dist.size());
@@ -203,10 +308,10 @@ int RadialProcessor::ProcessLine(Cell& cell) {
 
     // test if the connected cell meets the flag criteria
     // n.first is cell_id of connected cell to this cell
+    CellFlag tflag(cell.m_spatial_flags.at(i));
+    
     for (size_t j = 0; j < m_inner.size(); j++) {
       
-      CellFlag tflag(cell.m_spatial_flags.at(i));
-      
       // both are 0, so take all cells OR it meets flag criteria
       if ( (!m_logor[j] && !m_logand[j]) ||
 	   tflag.testAndOr(m_logor[j], m_logand[j])) {
@@ -219,18 +324,10 @@ int RadialProcessor::ProcessLine(Cell& cell) {
     }
   }
   
-  // calculate the density
-  std::vector<float> area(m_inner.size());
-  for (size_t j = 0; j < m_inner.size(); ++j) {
-    float outerArea = static_cast<float>(m_outer[j]) * static_cast<float>(m_outer[j]) * 3.1415926535f;
-    float innerArea = static_cast<float>(m_inner[j]) * static_cast<float>(m_inner[j]) * 3.1415926535f;
-    area[j] = outerArea - innerArea;
-  }
-  
   // do the density calculation for each condition
   // remember, i is iterator over cells, j is over conditions
-  for (size_t j = 0; j < area.size(); ++j) {
-    float value = cell.m_spatial_ids.empty() ? 0 : cell_count[j] * 1000000 / area[j]; // density per 1000 square pixels
+  for (size_t j = 0; j < m_area.size(); ++j) {
+    float value = cell.m_spatial_ids.empty() ? 0 : cell_count[j] * 1000000 / m_area[j]; // density per 1000 square pixels
     cell.m_cols.push_back(value);
   }
 
@@ -247,6 +344,10 @@ int CountProcessor::ProcessLine(Cell& cell) {
   return NO_WRITE_CELL; // do nothing
 }
 
+void CountProcessor::MergeWorker(const CellProcessor& worker) {
+  m_count += static_cast<const CountProcessor&>(worker).m_count;
+}
+
 void CountProcessor::PrintCount() {
   std::cout << m_count << std::endl;
 }
@@ -261,8 +362,7 @@ int HeadProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream();
   
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
 
   return 0; 
 }
@@ -297,26 +397,22 @@ int CutProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream();
 
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
   
   return 0; 
 }
 
 int CutProcessor::ProcessLine(Cell& cell) {
 
-  // just transfer to a new set of columns,
-  // not including what is to be cut
-  std::vector<float> m_cols_new;
+  // shift the kept columns down in place
   assert(cell.m_cols.size() >= m_to_remove.size());
-  m_cols_new.reserve(cell.m_cols.size() - m_to_remove.size());
-  
+  size_t k = 0;
   for (size_t i = 0; i < cell.m_cols.size(); i++) {
     if (!m_to_remove.count(i)) {
-      m_cols_new.push_back(cell.m_cols.at(i));
+      cell.m_cols[k++] = cell.m_cols[i];
     }
   }
-  cell.m_cols = m_cols_new;
+  cell.m_cols.resize(k);
   
   return WRITE_CELL;
 }
@@ -330,6 +426,21 @@ int HeadProcessor::ProcessLine(Cell& cell) {
   return NO_WRITE_CELL;
 }
 
+void HeadProcessor::ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+				 Cell* cells, int* vals) {
+
+  // only the first n cells need to be built
+  for (size_t i = start; i < end; i++) {
+    if (m_current_n < m_n) {
+      m_current_n++;
+      block.GetCell(i, cells[i - start]);
+      vals[i - start] = WRITE_CELL;
+    } else {
+      vals[i - start] = NO_WRITE_CELL;
+    }
+  }
+}
+
 
 int LogProcessor::ProcessHeader(CellHeader& header) {
 
@@ -352,8 +463,7 @@ int LogProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream();
   
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
 
   return 0;
 }
@@ -367,10 +477,9 @@ int LogProcessor::ProcessLine(Cell& cell) {
 	cell.m_cols[i] = std::log10(cell.m_cols.at(i));
       } else {
 	
-	if (!m_bool_warning_emitted) {
-	  m_bool_warning_emitted = true;
+	if (!m_bool_warning_emitted->exchange(true)) {
 	  std::cerr << "Warning: encountered zero or negative number to log on " <<
-	    "line " << m_count << " - removing this line in output. This warning " <<
+	    "line " << m_row + 1 << " - removing this line in output. This warning " <<
 	    "will emit only once per file";
 	}
 	
@@ -398,8 +507,7 @@ int ROIProcessor::ProcessHeader(CellHeader& header) {
   this->SetupOutputStream();
   
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
 
   return 0;
 }
@@ -435,8 +543,7 @@ int CleanProcessor::ProcessHeader(CellHeader& header) {
   m_header.SortTags();
   
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
 
   return 0;
 
@@ -444,18 +551,15 @@ int CleanProcessor::ProcessHeader(CellHeader& header) {
 
 int CleanProcessor::ProcessLine(Cell& cell) {
 
-  // just transfer to a new set of columns,
-  // not including what is to be cut
-  std::vector<float> m_cols_new;
+  // shift the kept columns down in place
   assert(cell.m_cols.size() >= m_to_remove.size());
-  m_cols_new.reserve(cell.m_cols.size() - m_to_remove.size());
-  
+  size_t k = 0;
   for (size_t i = 0; i < cell.m_cols.size(); i++) {
     if (m_to_remove.count(i) == 0) {
-      m_cols_new.push_back(cell.m_cols.at(i));
+      cell.m_cols[k++] = cell.m_cols[i];
     }
   }
-  cell.m_cols = m_cols_new;
+  cell.m_cols.resize(k);
 
   // clean the graph
   if (m_clean_graph) {
@@ -524,8 +628,7 @@ int TumorProcessor::ProcessHeader(CellHeader& header) {
   m_header.SortTags();
 
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
 
   return 0;
 }
@@ -579,17 +682,13 @@ int PhenoProcessor::ProcessHeader(CellHeader& header) {
   m_header.SortTags();
 
   // output the header
-  assert(m_archive);
-  (*m_archive)(m_header);
+  OutputHeader();
   
   return 0;
 }
 
 int PhenoProcessor::ProcessLine(Cell& cell) {
 
-  // make a copy of the cell for output
-  Cell cell_new = cell;
-  
   // initialize an empty flag
   CellFlag flag;
   
@@ -633,128 +732,336 @@ int ViewProcessor::ProcessHeader(CellHeader& header) {
 
 int ViewProcessor::ProcessLine(Cell& cell) {
 
-  cell.Print(m_round);
+  if (m_row < m_row_start || m_row >= m_row_end)
+    return 0;
+  m_done = m_row + 1 >= m_row_end;
+  
+  if (m_buffers.empty())
+    m_buffers.resize(1);
+  m_buffers[0].clear();
+  m_format.FormatCell(cell, m_buffers[0]);
+  std::cout.write(m_buffers[0].data(), m_buffers[0].size());
     
   return 0; // don't output, since already printing it
 }
 
-int CatProcessor::ProcessLine(Cell& line) {
-  //int CatProcessor::ProcessLine(const std::string& line) {
+void ViewProcessor::ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+				 Cell* cells, int* vals) {
+
+  for (size_t i = start; i < end; i++)
+    vals[i - start] = NO_WRITE_CELL;
+
+  // the rows of the block to print
+  const size_t first = std::min(end, std::max(start, m_row_start > row ? m_row_start - row : 0));
+  const size_t last = std::min(end, m_row_end > row ? m_row_end - row : 0);
+  m_done = row + end >= m_row_end;
+  if (first >= last)
+    return;
+
+  // format chunks of rows in parallel, then write them in order
+  const size_t chunk = 4096;
+  const size_t num_chunks = (last - first + chunk - 1) / chunk;
+  if (m_buffers.size() < num_chunks)
+    m_buffers.resize(num_chunks);
+
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic)
+  for (size_t c = 0; c < num_chunks; c++) {
+    std::string& buf = m_buffers[c];
+    buf.clear();
+    const size_t s = first + c * chunk;
+    const size_t e = std::min(last, s + chunk);
+    for (size_t i = s; i < e; i++)
+      m_format.FormatRow(block, i, buf);
+  }
 
-  //std::cerr << " processingl ine " << line << std::endl;
-  //std::cerr << " graph indicies " << m_graph_indicies.size() << std::endl;
-  /*  
-  // get the cell id
-  size_t o_cell_id = get_nth_element_as_integer(line, m_cellid_index);
+  for (size_t c = 0; c < num_chunks; c++)
+    std::cout.write(m_buffers[c].data(), m_buffers[c].size());
+}
 
-  // update the new cell id and max
-  size_t n_cell_id = m_offset + o_cell_id;
-  if (n_cell_id > m_max_cellid)
-    m_max_cellid = n_cell_id;
+int H5adProcessor::ProcessHeader(CellHeader& header) {
+
+  m_header = header;
+  m_h5.Open(m_output_file, m_header);
+
+  return 0;
+}
+
+int H5adProcessor::ProcessLine(Cell& cell) {
+
+  m_h5.WriteCell(cell);
+
+  return NO_WRITE_CELL;
+}
+
+void H5adProcessor::ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+				 Cell* cells, int* vals) {
+
+  // straight from the columns of the block
+  m_h5.WriteBlock(block, start, end);
+
+  for (size_t i = start; i < end; i++)
+    vals[i - start] = NO_WRITE_CELL;
+}
+
+void CatProcessor::SetInput(size_t input, int sample) {
+
+  if (input >= m_col_maps.size())
+    throw std::runtime_error("Error: cat input " + std::to_string(input) + " has no header");
+
+  m_input = input;
+  m_sample = static_cast<float>(sample);
+
+  // start past every id so far. Tiles already share one set of ids
+  m_offset = m_any_cells && !m_tiles ? m_max_cellid + 1 : 0;
+}
+
+uint32_t CatProcessor::offset_id(uint32_t id) {
+
+  const uint64_t new_id = m_offset + id;
+  if (new_id > std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Error: too many cells to concatenate, cell ids past " +
+			     std::to_string(std::numeric_limits<uint32_t>::max()));
+
+  if (new_id > m_max_cellid)
+    m_max_cellid = new_id;
+
+  return static_cast<uint32_t>(new_id);
+}
 
+void CatProcessor::start_output() {
+
+  if (m_started)
+    return;
+  m_started = true;
+
+  m_header.addTag(Tag(Tag::PG_TAG, "", m_cmd));
   
-  //  std::cerr << "old cell id: " << o_cell_id << " new " << n_cell_id <<
-  // " offset " << m_offset << " max " << this->GetMaxCellID() << std::endl;
+  SetupOutputStream();
+  OutputHeader();
+}
 
-  // get the tokens
-  std::vector<std::string> tokens = tokenize_comma_delimited(line);
+int CatProcessor::ProcessLine(Cell& cell) {
 
-  // update the graph ids
-  for (const auto& i : m_graph_indicies) {
-    const std::string& graph_line = tokens.at(i);
+  start_output();
 
-    // parse the node and rest the cell-ids with the offset
-    CellNode node(graph_line);
-    node.OffsetNodes(m_offset);
+  if (m_tiles && (cell.m_cell_flag & CELL_FLAG_HALO))
+    return NO_WRITE_CELL;
+  m_any_cells = true;
 
-    tokens[i] = node.toString(false); // false is for "integerize"
-  }
-  */
+  cell.m_id = offset_id(cell.m_id);
+
+  for (auto& n : cell.m_spatial_ids)
+    n = offset_id(n);
+
+  // move the columns into the output order
+  const std::vector<size_t>& col_map = m_col_maps[m_input];
+  std::vector<float> cols(col_map.size());
+  for (size_t j = 0; j < col_map.size(); j++)
+    cols[j] = col_map[j] == static_cast<size_t>(-1) ? m_sample : cell.m_cols.at(col_map[j]);
+  cell.m_cols = std::move(cols);
+
+  OutputLine(cell);
   
-  /*
-  // update the cell id
-  tokens[m_cellid_index] = std::to_string(n_cell_id);
+  return NO_WRITE_CELL;
+}
 
-  // add the sample number
-  tokens.emplace_back(std::to_string(m_sample));
+void CatProcessor::WriteBlock(CellBlock& block) {
+
+  start_output();
+
+  // the halo cells of a tile are core cells of another
+  if (m_tiles) {
+    m_keep.resize(block.size());
+    size_t num_halo = 0;
+    for (size_t i = 0; i < block.size(); i++) {
+      m_keep[i] = !(block.m_cell_flags[i] & CELL_FLAG_HALO);
+      num_halo += !m_keep[i];
+    }
+    if (num_halo)
+      block.KeepRows(m_keep);
+  }
   
-  // output
-  std::cout << tokens_to_comma_string(tokens) << std::endl;
+  const size_t n = block.size();
+  if (!n)
+    return;
+  m_any_cells = true;
+
+  for (auto& id : block.m_ids)
+    id = offset_id(id);
+
+  for (auto& id : block.m_graph_ids)
+    id = offset_id(id);
+
+  // the columns are moved, not copied, into the output order
+  const std::vector<size_t>& col_map = m_col_maps[m_input];
+  m_cols.resize(col_map.size());
+  for (size_t j = 0; j < col_map.size(); j++) {
+    if (col_map[j] == static_cast<size_t>(-1))
+      m_cols[j].assign(n, m_sample);
+    else
+      m_cols[j].swap(block.m_cols.at(col_map[j]));
+  }
+  block.m_cols.swap(m_cols);
 
-  */
-  return 1;
+  assert(m_writer);
+  m_writer->WriteBlock(block);
+}
+
+void CatProcessor::Close() {
+
+  start_output();
+
+  if (m_writer)
+    m_writer->Close();
 }
 
 int CatProcessor::ProcessHeader(CellHeader& header) {
-  
-  /*
-  // if we already have the master header, just compare for error checking
-  if (m_master_set) {
 
-    // loop both master header and new header
-    // but allow for master to have extra sample column
-    std::vector<std::string> header_cols = header.GetColOrder();
-    std::vector<std::string> master_cols = m_master_header.GetColOrder();
-    
-    // remove "sample" from master_cols
-    master_cols.erase(std::remove_if(master_cols.begin(), master_cols.end(),
-				     [](const std::string& s) { return s == "sample"; }), master_cols.end());
+  const size_t input = m_col_maps.size();
+
+  // the first header sets the output columns, plus the sample column
+  if (input == 0) {
+    m_header = header;
     
-    if (!std::equal(header_cols.begin(), header_cols.end(), master_cols.begin(), master_cols.end())) {
-      throw std::runtime_error("Error: All headers have to have the same number of columns in same order");
+    bool has_sample = m_tiles;
+    for (const auto& t : m_header)
+      if ((t.type == Tag::MA_TAG || t.type == Tag::CA_TAG) && t.id == "sample")
+	has_sample = true;
+    if (!has_sample)
+      m_header.addTag(Tag(Tag::CA_TAG, "sample", ""));
+
+  } else {
+
+    // keep graph tags of any input
+    for (const auto& t : header) {
+      if (t.type != Tag::GA_TAG)
+	continue;
+      bool found = false;
+      for (const auto& m : m_header)
+	found = found || (m.type == Tag::GA_TAG && m.id == t.id);
+      if (!found)
+	m_header.addTag(t);
     }
+  }
 
-    return 0;
+  // where each output column is in this input
+  const std::vector<Tag> out_tags = m_header.GetDataTags();
+  const std::vector<Tag> in_tags = header.GetDataTags();
+
+  std::unordered_map<std::string, size_t> in_cols;
+  for (size_t j = 0; j < in_tags.size(); j++)
+    in_cols[in_tags[j].id] = j;
+
+  std::vector<size_t> col_map(out_tags.size());
+  size_t matched = 0;
+  for (size_t j = 0; j < out_tags.size(); j++) {
+
+    // an existing sample column is kept, unless sample numbers were given
+    if (!m_tiles && out_tags[j].id == "sample") {
+      auto it = in_cols.find("sample");
+      if (it == in_cols.end() || m_replace_sample) {
+	if (it != in_cols.end())
+	  std::cerr << "Warning: cat input " << input <<
+	    " already has a sample column, replacing it with the given sample number" << std::endl;
+	col_map[j] = static_cast<size_t>(-1);
+      } else {
+	col_map[j] = it->second;
+      }
+      matched += it != in_cols.end();
+      continue;
+    }
+
+    auto it = in_cols.find(out_tags[j].id);
+    if (it == in_cols.end())
+      throw std::runtime_error("Error: cat input " + std::to_string(input) +
+			       " is missing column " + out_tags[j].id);
+    if (in_tags[it->second].type != out_tags[j].type)
+      throw std::runtime_error("Error: cat input " + std::to_string(input) +
+			       " has column " + out_tags[j].id + " as a different tag type");
+    col_map[j] = it->second;
+    matched++;
   }
+
+  if (matched != in_tags.size())
+    throw std::runtime_error("Error: cat input " + std::to_string(input) +
+			     " has columns not in the first input");
+
+  m_col_maps.push_back(std::move(col_map));
   
-  // find which one the cell id is
-  size_t ii = 0;
-  for (const auto& t : header.GetColTags()) {
+  return 0;
+}
 
-    // get the ID tag
-    if (t.isIDTag()) {
+int SplitProcessor::ProcessHeader(CellHeader& header) {
 
-      // check that there is only one ID tag
-      if (m_cellid_index != static_cast<size_t>(-1))
-	throw std::runtime_error("Error: Cell ID already found - does your header have two?");
-      m_cellid_index = ii;
-    }
+  if (m_width <= 0 || m_height <= 0)
+    throw std::runtime_error("Error: tile width and height must be positive");
+  if (m_halo < 0 || m_halo > m_width || m_halo > m_height)
+    throw std::runtime_error("Error: halo must be between 0 and the tile width and height");
 
-    // set graph tags
-    if (t.isGraphTag())
-      m_graph_indicies.push_back(ii);
-    
-    ii++;
-  }
+  m_prefix = m_output_file;
+  if (m_prefix.size() > 4 && m_prefix.compare(m_prefix.size() - 4, 4, ".cys") == 0)
+    m_prefix.resize(m_prefix.size() - 4);
+
+  m_header = header;
+  m_header.addTag(Tag(Tag::PG_TAG, "", m_cmd));
   
-  // throw error if not found
-  if (m_cellid_index == static_cast<size_t>(-1)) {
-    throw std::runtime_error("Error: no cell id found. ID tag in header required");
-  }
+  return 0;
+}
 
-  // save a copy of the first header to be the master header
-  if (!m_master_header.size()) {
-    m_master_header = header;
-    m_master_set = true;
-  }
+void SplitProcessor::write_to_tile(int64_t i, int64_t j, const Cell& cell) {
+
+  std::unique_ptr<CellWriter>& writer = m_tiles[{i, j}];
 
-  // add the sample tag if not already there
-  if (!m_master_header.hasTag("sample")) {
-    Tag sample_tag("CA","sample");
-    m_master_header.addTag(sample_tag);
+  // open the tile with its first cell
+  if (!writer) {
+    const std::string file = m_prefix + "." + std::to_string(i) + "_" + std::to_string(j) + ".cys";
+    if (m_verbose)
+      std::cerr << "...writing tile " << file << std::endl;
+    writer = std::make_unique<CellWriter>(file);
+    writer->SetCodec(m_codec);
+    writer->SetGraphEncoding(m_graph_encoding);
 
+    // every tile stays open to the end, so keep each one light: no
+    // writer thread, and a block that only grows as cells come in
+    writer->SetBackground(false);
+    writer->SetReserve(false);
+    writer->WriteHeader(m_header);
   }
 
-  // add the command tag
-  Tag cmd_tag("CN", "cysift cat");
-  m_master_header.addTag(cmd_tag);
-  
-  // print the header
-  if (m_print_header && m_master_set)
-    m_master_header.Print();
-  */
+  writer->WriteCell(cell);
+}
+
+int SplitProcessor::ProcessLine(Cell& cell) {
+
+  if (!std::isfinite(cell.m_x) || !std::isfinite(cell.m_y))
+    throw std::runtime_error("Error: cell " + std::to_string(cell.m_id) + " has no x or y to tile by");
+
+  const int64_t i = static_cast<int64_t>(std::floor(cell.m_x / m_width));
+  const int64_t j = static_cast<int64_t>(std::floor(cell.m_y / m_height));
+
+  // the neighboring tiles whose halo the cell is in
+  const float x0 = i * m_width;
+  const float y0 = j * m_height;
+  const int i_lo = cell.m_x - x0 < m_halo ? -1 : 0;
+  const int i_hi = x0 + m_width - cell.m_x <= m_halo ? 1 : 0;
+  const int j_lo = cell.m_y - y0 < m_halo ? -1 : 0;
+  const int j_hi = y0 + m_height - cell.m_y <= m_halo ? 1 : 0;
+
+  const cy_uint flag = cell.m_cell_flag & ~CELL_FLAG_HALO;
+  for (int di = i_lo; di <= i_hi; di++) {
+    for (int dj = j_lo; dj <= j_hi; dj++) {
+      cell.m_cell_flag = (di || dj) ? (flag | CELL_FLAG_HALO) : flag;
+      write_to_tile(i + di, j + dj, cell);
+    }
+  }
   
-  return 0;
+  return NO_WRITE_CELL;
+}
+
+void SplitProcessor::Close() {
+
+  for (auto& t : m_tiles)
+    t.second->Close();
 }
 
 int CerealProcessor::ProcessHeader(CellHeader& header) {
@@ -765,17 +1072,15 @@ int CerealProcessor::ProcessHeader(CellHeader& header) {
   assert(!m_filename.empty());
 
   // set the output to file or stdout
-  if (m_filename == "-") {
-    m_archive = std::make_unique<cereal::PortableBinaryOutputArchive>(std::cout);
-  } else {
-    m_os = std::make_unique<std::ofstream>(m_filename, std::ios::binary);
-    m_archive = std::make_unique<cereal::PortableBinaryOutputArchive>(*m_os);
-  }
+  m_writer = std::make_unique<CellWriter>(m_filename);
+  m_writer->SetCodec(m_codec);
+  m_writer->SetThreads(m_threads);
+  m_writer->SetBackground(true);
 
   m_header.SortTags();
   
   // archive the header
-  (*m_archive)(m_header);
+  m_writer->WriteHeader(m_header);
   
   return 0;
 }
@@ -785,7 +1090,7 @@ int CerealProcessor::ProcessLine(const std::string& line) {
   Cell row(line, m_header);
 
   // serialize it
-  (*m_archive)(row);
+  m_writer->WriteCell(row);
   return 0;
   
 }
@@ -802,3 +1107,73 @@ int BuildProcessor::ProcessLine(Cell& cell) {
   return 2;
   
 }
+
+void ChainProcessor::AddStage(std::unique_ptr<CellProcessor> stage) {
+  stage->SetChained();
+  m_stages.push_back(std::move(stage));
+}
+
+int ChainProcessor::ProcessHeader(CellHeader& header) {
+
+  // each stage works on the header the last one output
+  m_header = header;
+  for (auto& s : m_stages) {
+    if (s->ProcessHeader(m_header) != WRITE_HEADER)
+      throw std::runtime_error("ChainProcessor: stage can't be chained");
+    m_header = s->GetHeader();
+  }
+
+  // the table is built with the header out of the last stage
+  if (m_save) {
+    header = m_header;
+    return SAVE_HEADER;
+  }
+
+  this->SetupOutputStream();
+
+  OutputHeader();
+
+  return WRITE_HEADER;
+}
+
+int ChainProcessor::ProcessLine(Cell& cell) {
+
+  for (auto& s : m_stages) {
+    s->SetCurrentRow(m_row);
+    const int val = s->ProcessLine(cell);
+    if (val == NO_WRITE_CELL)
+      return NO_WRITE_CELL;
+    if (val != WRITE_CELL)
+      throw std::runtime_error("ChainProcessor: stage can't be chained");
+  }
+
+  return m_save ? SAVE_CELL : WRITE_CELL;
+}
+
+bool ChainProcessor::Done() const {
+
+  // once any stage is done, nothing more gets through
+  for (const auto& s : m_stages)
+    if (s->Done())
+      return true;
+  return false;
+}
+
+std::unique_ptr<CellProcessor> ChainProcessor::CloneWorker() const {
+
+  std::unique_ptr<ChainProcessor> chain(new ChainProcessor(*this));
+  for (const auto& s : m_stages) {
+    auto w = s->CloneWorker();
+    if (!w)
+      return nullptr;
+    chain->m_stages.push_back(std::move(w));
+  }
+  return chain;
+}
+
+void ChainProcessor::MergeWorker(const CellProcessor& worker) {
+
+  const ChainProcessor& chain = static_cast<const ChainProcessor&>(worker);
+  for (size_t i = 0; i < m_stages.size(); i++)
+    m_stages[i]->MergeWorker(*chain.m_stages[i]);
+}
@@ -2,11 +2,18 @@
 
 // DataProcessor.h
 #include <string>
+#include "cell_format.h"
+#include "cell_h5ad.h"
 #include "cell_header.h"
+#include "cell_index.h"
 #include "cell_row.h"
+#include "cell_writer.h"
 #include "polygon.h"
 #include "cysift.h"
+#include <atomic>
 #include <cassert>
+#include <algorithm>
+#include <map>
 
 #include <cereal/types/vector.hpp>
 #include <cereal/archives/portable_binary.hpp>
@@ -25,30 +32,88 @@ class CellProcessor {
   static const int ONLY_WRITE_HEADER = 1;
   static const int SAVE_HEADER = 2;
   
+  CellProcessor() = default;
+
+  // copies everything but the output stream, for CloneWorker
+  CellProcessor(const CellProcessor& other) :
+    m_header(other.m_header), m_output_file(other.m_output_file), m_cmd(other.m_cmd),
+    m_codec(other.m_codec), m_threads(other.m_threads), m_index(other.m_index),
+    m_graph_encoding(other.m_graph_encoding), m_verbose(other.m_verbose),
+    m_count(other.m_count), m_row(other.m_row), m_chained(other.m_chained) {}
+  
   virtual ~CellProcessor() = default;
   
   virtual int ProcessHeader(CellHeader& header) = 0;
 
   virtual int ProcessLine(Cell& cell) = 0;
 
+  // process rows [start, end) of a block, whose first row is row in the
+  // input. Sets vals[i - start] to the ProcessLine return code of row i, and
+  // cells[i - start] to the cell to output or save, if any. The default
+  // calls ProcessLine on each cell, and stops once Done(). Processors can
+  // override this to work on the columns of the block directly
+  virtual void ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+			    Cell* cells, int* vals);
+
+  // return true once no more cells are needed, to stop reading early
+  virtual bool Done() const { return false; }
+
+  // return true if no cells in this block are needed. When the input
+  // has a sidecar index, blocks that are skipped are never read
+  virtual bool SkipBlock(const BlockIndexEntry& entry) const { return false; }
+
+  // return true if no cells in a block with this zone map are needed.
+  // Called after ProcessHeader. Skipped blocks are never decoded
+  virtual bool SkipBlockStats(const BlockStats& stats) const { return false; }
+
+  // a copy of this processor to run ProcessLine on a worker thread,
+  // taken after ProcessHeader. Worker copies have no output stream and
+  // their cells are output in order by the caller. Returns nullptr if
+  // the processor has to see every cell itself
+  virtual std::unique_ptr<CellProcessor> CloneWorker() const { return nullptr; }
+
+  // fold the state a worker copy built up back into this processor
+  virtual void MergeWorker(const CellProcessor& worker) {}
+
+  // row number in the input of the cell about to be processed
+  void SetCurrentRow(size_t row) { m_row = row; }
+
   void SetupOutputStream() { 
 
-    // set the output to file or stdout
-    if (m_output_file == "-") {
-      m_archive = std::make_unique<cereal::PortableBinaryOutputArchive>(std::cout);
-    } else {
-      m_os = std::make_unique<std::ofstream>(m_output_file, std::ios::binary);
-      m_archive = std::make_unique<cereal::PortableBinaryOutputArchive>(*m_os);
-    }
+    // stages of a chain hand their cells on instead
+    if (m_chained)
+      return;
 
-    assert(m_archive);
+    // set the output to file or stdout
+    m_writer = std::make_unique<CellWriter>(m_output_file);
+    m_writer->SetCodec(m_codec);
+    m_writer->SetThreads(m_threads);
+    m_writer->SetIndex(m_index);
+    m_writer->SetGraphEncoding(m_graph_encoding);
+    m_writer->SetBackground(true);
+
+    assert(m_writer);
   }
   
   void OutputLine(const Cell& cell) const {
-    assert(m_archive);
-    (*m_archive)(cell);
+    assert(m_writer);
+    m_writer->WriteCell(cell);
+  }
+
+  // write m_header, unless this is a stage of a chain
+  void OutputHeader() const {
+    if (m_chained)
+      return;
+    assert(m_writer);
+    m_writer->WriteHeader(m_header);
   }
 
+  // the header as output by ProcessHeader
+  const CellHeader& GetHeader() const { return m_header; }
+
+  // run as a stage of a ChainProcessor, without an output stream
+  void SetChained() { m_chained = true; }
+
   void SetCommonParams(const std::string& output_file,
 		       const std::string& cmd,
 		       bool verbose) {
@@ -58,6 +123,18 @@ class CellProcessor {
 
     
   }
+
+  // block compression for the output, and threads to compress with
+  void SetCompression(const CysCodec& codec, size_t threads) {
+    m_codec = codec;
+    m_threads = threads;
+  }
+
+  // write a sidecar index for the output
+  void SetIndex(bool index) { m_index = index; }
+
+  // how the output stores the spatial graph (CYS_GRAPH_VARINT by default)
+  void SetGraphEncoding(uint32_t encoding) { m_graph_encoding = encoding; }
   
 protected:
 
@@ -71,15 +148,26 @@ protected:
   // to track in PG tag in header
   std::string m_cmd;
   
-  // common archiver objects
-  std::unique_ptr<std::ofstream> m_os;
-  std::unique_ptr<cereal::PortableBinaryOutputArchive> m_archive;
+  // common output writer
+  std::unique_ptr<CellWriter> m_writer;
+
+  // output compression
+  CysCodec m_codec;
+  size_t m_threads = 1;
+  bool m_index = false;
+  uint32_t m_graph_encoding = CYS_GRAPH_VARINT;
 
   // increase verbosity
   bool m_verbose = false;
 
   // count the lines as they come, for verbosity
   size_t m_count = 0; 
+
+  // row number of the current cell in the input
+  size_t m_row = 0;
+
+  // a stage of a ChainProcessor
+  bool m_chained = false;
 };
 
 class LineProcessor {
@@ -103,6 +191,13 @@ public:
   int ProcessHeader(CellHeader& header) override;
   
   int ProcessLine(Cell& cell) override;
+
+  void ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+		    Cell* cells, int* vals) override;
+
+  bool Done() const override { return m_current_n >= m_n; }
+
+  bool SkipBlock(const BlockIndexEntry& entry) const override { return entry.row_start >= m_n; }
   
  private:
   
@@ -123,6 +218,10 @@ class CutProcessor : public CellProcessor {
   int ProcessHeader(CellHeader& header) override;
   
   int ProcessLine(Cell& cell) override;
+
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<CutProcessor>(*this);
+  }
   
  private:
   
@@ -148,6 +247,10 @@ public:
   
   int ProcessLine(Cell& cell) override;
 
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<CleanProcessor>(*this);
+  }
+
 
 private:
 
@@ -169,6 +272,15 @@ public:
   
   int ProcessLine(Cell& cell) override;
 
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<AverageProcessor>(*this);
+  }
+
+  void MergeWorker(const CellProcessor& worker) override;
+
+  // take the sums from a file footer instead of processing each cell
+  void SetStats(const FileStats& stats);
+
   void EmitCell() const;
   
 private:
@@ -191,6 +303,10 @@ class PhenoProcessor : public CellProcessor {
   int ProcessHeader(CellHeader& header) override;
   
   int ProcessLine(Cell& cell) override;
+
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<PhenoProcessor>(*this);
+  }
   
  private:
 
@@ -237,6 +353,12 @@ class CountProcessor : public CellProcessor {
   
   int ProcessLine(Cell& cell) override;
 
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<CountProcessor>(*this);
+  }
+
+  void MergeWorker(const CellProcessor& worker) override;
+
   void PrintCount();
   
  private:
@@ -270,12 +392,33 @@ class SelectProcessor : public CellProcessor {
     m_equal = et;
   }
   
+  // only keep cells with these ids
+  void SetIDs(const std::vector<uint32_t>& ids) {
+    m_ids = ids;
+    std::sort(m_ids.begin(), m_ids.end());
+    m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+  }
+  
   int ProcessHeader(CellHeader& header) override;
   
   int ProcessLine(Cell& cell) override;
+
+  void ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+		    Cell* cells, int* vals) override;
+
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<SelectProcessor>(*this);
+  }
+
+  bool SkipBlock(const BlockIndexEntry& entry) const override;
+
+  bool SkipBlockStats(const BlockStats& stats) const override;
   
  private:
 
+  // sorted cell ids to select. Empty to select on all ids
+  std::vector<uint32_t> m_ids;
+
   // or flags
   cy_uint m_por;
   cy_uint m_cor;
@@ -297,6 +440,10 @@ class SelectProcessor : public CellProcessor {
   float m_equal         = dummy_float;
 
   int m_i = -1; // index of the field
+
+  // true if a cell with these values is selected. value is
+  // only used when selecting on a field
+  bool selected(uint32_t id, cy_uint pflag, cy_uint cflag, float value) const;
   
 };
 
@@ -311,12 +458,18 @@ class LogProcessor : public CellProcessor {
   int ProcessHeader(CellHeader& header) override;
 
   int ProcessLine(Cell& cell) override;
+
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<LogProcessor>(*this);
+  }
   
  private:
 
   std::unordered_set<size_t> m_to_log;
 
-  bool m_bool_warning_emitted = false;
+  // shared with the copies from CloneWorker, so the warning is emitted once
+  std::shared_ptr<std::atomic<bool>> m_bool_warning_emitted =
+    std::make_shared<std::atomic<bool>>(false);
   
 };
 
@@ -353,15 +506,49 @@ class ViewProcessor : public CellProcessor {
     m_print_header = print_header;
     m_header_only = header_only;
     m_round = round;
+    m_format.SetPrecision(round);
     
   }
+
+  // delimiter between fields, and whether -n is a fixed number of decimals
+  void SetFormat(char delim, bool fixed) {
+    m_format.SetDelimiter(delim);
+    m_format.SetFixed(fixed);
+  }
+
+  // number of threads to format the rows of each block with
+  void SetThreads(size_t threads) { m_threads = threads ? threads : 1; }
+  
+  // only print rows [start, end)
+  void SetRows(size_t start, size_t end) {
+    m_row_start = start;
+    m_row_end = end;
+  }
   
   int ProcessHeader(CellHeader& header) override;
 
   int ProcessLine(Cell& cell) override;
+
+  void ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+		    Cell* cells, int* vals) override;
+
+  bool Done() const override { return m_done; }
+
+  bool SkipBlock(const BlockIndexEntry& entry) const override {
+    return entry.row_start + entry.num_cells <= m_row_start || entry.row_start >= m_row_end;
+  }
   
  private:
 
+  CellFormatter m_format;
+
+  // formatted text of each chunk of rows of a block
+  std::vector<std::string> m_buffers;
+
+  size_t m_row_start = 0;
+  size_t m_row_end = static_cast<size_t>(-1);
+  bool m_done = false;
+
   bool m_header_only;
   
   bool m_print_header;
@@ -370,6 +557,33 @@ class ViewProcessor : public CellProcessor {
   int m_round;
 };
 
+// write the cells to an AnnData .h5ad file instead of a cell table
+class H5adProcessor : public CellProcessor {
+
+ public:
+
+  // gzip level of the datasets, and whether to write the spatial graph
+  void SetParams(int level, bool graph) {
+    m_h5.SetCompression(level);
+    m_h5.SetGraph(graph);
+  }
+
+  int ProcessHeader(CellHeader& header) override;
+
+  int ProcessLine(Cell& cell) override;
+
+  void ProcessBlock(const CellBlock& block, size_t row, size_t start, size_t end,
+		    Cell* cells, int* vals) override;
+
+  // finish writing the file
+  void Close() { m_h5.Close(); }
+
+ private:
+
+  H5adWriter m_h5;
+
+};
+
 class BuildProcessor : public CellProcessor { 
 
  public:
@@ -385,42 +599,129 @@ class BuildProcessor : public CellProcessor {
 };
 
 
+/**
+ * @class CatProcessor
+ * @brief Concatenates the cells of several inputs into one output
+ *
+ * ProcessHeader is called once per input, in input order, before any cells
+ * are written. The first header sets the output columns; later inputs must
+ * have the same data columns, in any order, and their columns are moved
+ * into the order of the first. A "sample" meta column is added with the
+ * sample number of each input. An input that already has a sample column
+ * keeps its values, unless SetReplaceSample is set.
+ *
+ * Cell ids, and the ids of graph neighbors, are offset so that they stay
+ * unique: each input starts one past the largest id of those before it.
+ *
+ * With SetTiles, the inputs are instead the tiles of one table from
+ * SplitProcessor: ids are kept, no sample column is added, and the halo
+ * cells (CELL_FLAG_HALO) are dropped, which stitches the table back.
+ */
 class CatProcessor : public CellProcessor { 
 
  public:
-  
-  void SetParams(int offset,
-		 int sample) {
-    
-    m_offset = offset;
-    m_sample = sample;
-    
-  }
 
-  void SetOffset(size_t offset) { m_offset = offset; }
+  // the cells that follow are from input number input (in the order
+  // of the ProcessHeader calls), and are given this sample number
+  void SetInput(size_t input, int sample);
+
+  // overwrite an existing sample column with the sample numbers of
+  // SetInput, as when they were given explicitly. Must be set before
+  // the headers are processed
+  void SetReplaceSample(bool replace) { m_replace_sample = replace; }
+
+  // merge the tiles of a split table
+  void SetTiles(bool tiles) { m_tiles = tiles; }
 
-  void SetSample(size_t sample) { m_sample = sample; }
-  
   int ProcessHeader(CellHeader& header) override;
 
   int ProcessLine(Cell& cell) override;
 
+  // offset and re-order a whole block of the current input, and write it
+  void WriteBlock(CellBlock& block);
+
+  // write the header (if no cells were) and finish the output
+  void Close();
+
   size_t GetMaxCellID() const { return m_max_cellid; }
   
-private:
-  
-  size_t m_cellid_index = static_cast<size_t>(-1);
-  
-  size_t m_offset;
-  size_t m_sample;
+ private:
+
+  // for each output data column, its column in each input.
+  // npos for a sample column filled with the sample number
+  std::vector<std::vector<size_t>> m_col_maps;
+
+  size_t m_input = 0;
+  float m_sample = 0;
+  uint64_t m_offset = 0;
+
+  bool m_any_cells = false;
+  uint64_t m_max_cellid = 0;
+
+  bool m_started = false;
+
+  bool m_tiles = false;
+  bool m_replace_sample = false;
+
+  // reused to re-order the columns of a block, and to drop halo cells
+  std::vector<std::vector<float>> m_cols;
+  std::vector<char> m_keep;
+
+  // offset a cell id, keeping track of the largest
+  uint32_t offset_id(uint32_t id);
+
+  // open the output and write the header, before the first cell
+  void start_output();
   
-  // the header to compare with (and print if needed)
-  CellHeader m_master_header;
-  bool m_master_set = false;
+};
+
+/**
+ * @class SplitProcessor
+ * @brief Splits the cells into a grid of spatial tiles, one file per tile
+ *
+ * Tile (i, j) holds the cells with x in [i * width, (i + 1) * width) and
+ * y in [j * height, (j + 1) * height), and is written to
+ * <prefix>.<i>_<j>.cys as its first cell comes in. Each tile also gets the
+ * cells of its neighbors that are within halo of its edges, flagged with
+ * CELL_FLAG_HALO, so that spatial modules run on the tile still see every
+ * neighbor of its own cells. Cell ids are kept, so cysift merge
+ * (CatProcessor with SetTiles) can stitch the tiles back together.
+ *
+ * Every tile stays open until Close, so its writer has no writer thread
+ * and does not reserve a whole block up front. Each tile still holds an
+ * open file and up to one block of cells.
+ */
+class SplitProcessor : public CellProcessor {
+
+ public:
 
-  size_t m_max_cellid = 0;
+  void SetParams(float width, float height, float halo) {
+    m_width = width;
+    m_height = height;
+    m_halo = halo;
+  }
+
+  int ProcessHeader(CellHeader& header) override;
+
+  int ProcessLine(Cell& cell) override;
+
+  // finish every tile file
+  void Close();
+
+  size_t NumTiles() const { return m_tiles.size(); }
+
+ private:
 
-  std::vector<size_t> m_graph_indicies;
+  float m_width = 0;
+  float m_height = 0;
+  float m_halo = 0;
+
+  // output file name, less the .cys
+  std::string m_prefix;
+
+  std::map<std::pair<int64_t, int64_t>, std::unique_ptr<CellWriter>> m_tiles;
+
+  void write_to_tile(int64_t i, int64_t j, const Cell& cell);
   
 };
 
@@ -433,6 +734,11 @@ class CerealProcessor : public LineProcessor {
     m_filename = filename;
     m_cmd = cmd;
   }
+
+  void SetCompression(const CysCodec& codec, size_t threads) {
+    m_codec = codec;
+    m_threads = threads;
+  }
   
   int ProcessHeader(CellHeader& header) override;
 
@@ -449,9 +755,10 @@ private:
   
   CellHeader m_header;
   
-  std::unique_ptr<std::ofstream> m_os;
-  std::unique_ptr<cereal::PortableBinaryOutputArchive> m_archive;
-  
+  std::unique_ptr<CellWriter> m_writer;
+
+  CysCodec m_codec;
+  size_t m_threads = 1;
 
 };
 
@@ -481,10 +788,74 @@ class RadialProcessor : public CellProcessor {
   int ProcessHeader(CellHeader& header) override;
 
   int ProcessLine(Cell& cell) override;
+
+  std::unique_ptr<CellProcessor> CloneWorker() const override {
+    return std::make_unique<RadialProcessor>(*this);
+  }
   
  private:
   
   std::vector<cy_uint> m_inner, m_outer, m_logor, m_logand;
   std::vector<std::string> m_label;
+
+  // area of each ring, set in ProcessHeader
+  std::vector<float> m_area;
+
+  // per-cell scratch
+  std::vector<float> m_cell_count;
   
 };
+
+/**
+ * @class ChainProcessor
+ * @brief Runs each cell through several processors in turn, in one pass
+ *
+ * Each stage sees the header and the cells output by the stage before
+ * it, without the cells being written out and read back in between.
+ * The stages have no output stream of their own. A cell that a stage
+ * doesn't write goes no further down the chain. With SetSave, the cells
+ * out of the last stage are saved into the table instead of written out.
+ */
+class ChainProcessor : public CellProcessor {
+
+ public:
+
+  ChainProcessor() = default;
+
+  // takes ownership of the next stage. Stages must only write or drop cells
+  void AddStage(std::unique_ptr<CellProcessor> stage);
+
+  // save the cells into the table, rather than writing them out
+  void SetSave(bool save) { m_save = save; }
+
+  size_t size() const { return m_stages.size(); }
+
+  int ProcessHeader(CellHeader& header) override;
+
+  int ProcessLine(Cell& cell) override;
+
+  bool Done() const override;
+
+  // only the first stage sees the cells as they are in the input
+  bool SkipBlock(const BlockIndexEntry& entry) const override {
+    return !m_stages.empty() && m_stages.front()->SkipBlock(entry);
+  }
+
+  bool SkipBlockStats(const BlockStats& stats) const override {
+    return !m_stages.empty() && m_stages.front()->SkipBlockStats(stats);
+  }
+
+  std::unique_ptr<CellProcessor> CloneWorker() const override;
+
+  void MergeWorker(const CellProcessor& worker) override;
+
+ private:
+
+  // copies all but the stages, for CloneWorker
+  ChainProcessor(const ChainProcessor& other) : CellProcessor(other), m_save(other.m_save) {}
+
+  std::vector<std::unique_ptr<CellProcessor>> m_stages;
+
+  bool m_save = false;
+
+};
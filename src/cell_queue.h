@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * @class BoundedQueue
+ * @brief Blocking first-in first-out queue holding at most a fixed number of items
+ *
+ * Hands blocks between a producer thread and a consumer thread. Push waits
+ * while the queue is full and Pop waits while it is empty. Once closed, Push
+ * fails, and Pop returns what is left and then fails.
+ */
+template <typename T>
+class BoundedQueue {
+
+ public:
+
+  explicit BoundedQueue(size_t capacity = 2) { SetCapacity(capacity); }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  void SetCapacity(size_t capacity) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_capacity = capacity ? capacity : 1;
+  }
+
+  // add an item, waiting for room. Returns false if the queue is closed
+  bool Push(T&& item) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_not_full.wait(guard, [&] { return m_items.size() < m_capacity || m_closed; });
+    if (m_closed)
+      return false;
+    m_items.push_back(std::move(item));
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  // add an item only if there is room
+  bool TryPush(T&& item) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    if (m_closed || m_items.size() >= m_capacity)
+      return false;
+    m_items.push_back(std::move(item));
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  // take the next item, waiting for one. Returns false once the
+  // queue is closed and empty
+  bool Pop(T& item) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_not_empty.wait(guard, [&] { return !m_items.empty() || m_closed; });
+    if (m_items.empty())
+      return false;
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  // take the next item only if there is one
+  bool TryPop(T& item) {
+    std::unique_lock<std::mutex> guard(m_lock);
+    if (m_items.empty())
+      return false;
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  // wake up any waiting threads. No more items can be pushed
+  void Close() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_closed = true;
+    m_not_full.notify_all();
+    m_not_empty.notify_all();
+  }
+
+  // empty and re-open the queue. Only call when no other thread is using it
+  void Reset() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_items.clear();
+    m_closed = false;
+  }
+
+ private:
+
+  std::deque<T> m_items;
+  size_t m_capacity = 2;
+  bool m_closed = false;
+
+  std::mutex m_lock;
+  std::condition_variable m_not_full;
+  std::condition_variable m_not_empty;
+
+};
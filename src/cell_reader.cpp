@@ -0,0 +1,400 @@
+#include "cell_reader.h"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+bool CellReader::Open(const std::string& file) {
+
+  // set input from file or stdin
+  if (file == "-") {
+    m_in = &std::cin;
+  } else {
+    m_fs = std::make_unique<std::ifstream>(file, std::ios::binary);
+    if (!m_fs->good()) {
+      std::cerr << "Error opening: " << file << " - file may not exist" << std::endl;
+      return false;
+    }
+    m_in = m_fs.get();
+  }
+
+  // block files start with the magic bytes, legacy files with
+  // the cereal endianness byte
+  const int first = m_in->peek();
+  m_block_format = first == CYS_MAGIC[0];
+
+  // Arrow files start with ARROW1, and streams with a 0xFFFFFFFF marker
+  if (first == 'A' || first == 0xFF) {
+    try {
+      if (first == 'A' && !m_fs)
+	throw std::runtime_error("Arrow IPC files can't be read from stdin, pipe the stream format (.arrows)");
+      m_arrow = std::make_unique<ArrowReader>();
+      if (first == 0xFF)
+	m_arrow->OpenStream(*m_in);
+      else
+	m_arrow->OpenFile(file);
+    } catch (const std::exception& e) {
+      std::cerr << "Error opening: " << file << " - " << e.what() << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void CellReader::ReadHeader(CellHeader& header) {
+
+  assert(m_in);
+
+  if (m_arrow) {
+    m_arrow->ReadHeader(header);
+    m_num_cols = header.GetDataTags().size();
+    return;
+  }
+
+  if (!m_block_format) {
+    m_archive = std::make_unique<cereal::PortableBinaryInputArchive>(*m_in);
+    (*m_archive)(header);
+    m_num_cols = header.GetDataTags().size();
+    return;
+  }
+
+  char magic[sizeof(CYS_MAGIC)];
+  read_bytes(magic, sizeof(magic));
+  if (std::memcmp(magic, CYS_MAGIC, sizeof(CYS_MAGIC)) != 0)
+    throw std::runtime_error("Not a .cys file, or unsupported .cys version");
+
+  uint64_t hdr_size = 0;
+  read_bytes(reinterpret_cast<char*>(&hdr_size), sizeof(hdr_size));
+
+  std::string hdr(hdr_size, '\0');
+  read_bytes(&hdr[0], hdr_size);
+  skip_padding();
+
+  std::istringstream iss(hdr, std::ios::binary);
+  cereal::PortableBinaryInputArchive iarchive(iss);
+  iarchive(header);
+
+  m_num_cols = header.GetDataTags().size();
+}
+
+CellReader::~CellReader() {
+  stop_worker();
+}
+
+bool CellReader::ReadBlock(CellBlock& block) {
+
+  if (!m_read_ahead)
+    return read_block(block, m_last_offset, m_last_row);
+
+  if (!m_worker.joinable()) {
+    m_queue.SetCapacity(m_threads + 1);
+    m_free.SetCapacity(m_threads + 2);
+    m_worker = std::thread(&CellReader::read_worker, this);
+  }
+
+  ReadAheadBlock rb;
+  if (!m_queue.Pop(rb)) {
+    if (m_error)
+      std::rethrow_exception(m_error);
+    return false;
+  }
+
+  // hand the old block back, to be filled again
+  std::swap(block, rb.block);
+  m_free.TryPush(std::move(rb.block));
+  m_last_offset = rb.offset;
+  m_last_row = rb.row;
+  return true;
+}
+
+void CellReader::read_worker() {
+
+  try {
+    for (;;) {
+      ReadAheadBlock rb;
+      m_free.TryPop(rb.block);
+      if (!read_block(rb.block, rb.offset, rb.row))
+	break;
+      if (!m_queue.Push(std::move(rb)))
+	return; // stopped by the caller
+    }
+  } catch (...) {
+    m_error = std::current_exception();
+  }
+  m_queue.Close();
+}
+
+void CellReader::stop_worker() {
+
+  if (!m_worker.joinable())
+    return;
+
+  m_queue.Close();
+  m_worker.join();
+  m_queue.Reset();
+  m_free.Reset();
+}
+
+bool CellReader::read_block(CellBlock& block, uint64_t& offset, uint64_t& row) {
+
+  if (m_arrow) {
+    if (!m_arrow->ReadBlock(block))
+      return false;
+    offset = 0;
+    row = m_row;
+    m_row += block.size();
+    return true;
+  }
+
+  // legacy format, so build the block one cell at a time
+  if (!m_block_format) {
+    block.Init(m_num_cols);
+    Cell cell;
+    while (block.size() < CYS_BLOCK_SIZE && read_legacy_cell(cell))
+      block.AddCell(cell);
+    offset = 0;
+    row = m_row;
+    m_row += block.size();
+    return block.size() > 0;
+  }
+
+  // decode the next batch if this one is used up
+  if (m_ready_pos >= m_num_ready && !fill_ready())
+    return false;
+
+  std::swap(block, m_ready[m_ready_pos]);
+  offset = m_frames[m_ready_pos].offset;
+  row = m_frames[m_ready_pos].row;
+  m_ready_pos++;
+  return true;
+}
+
+bool CellReader::ReadBlockAt(uint64_t offset, CellBlock& block) {
+
+  if (!m_fs || !m_block_format)
+    throw std::runtime_error("CellReader: can only seek in block-formatted .cys files");
+
+  // drop any read-ahead
+  stop_worker();
+  m_read_ahead = false;
+  m_num_ready = 0;
+  m_ready_pos = 0;
+  m_done = false;
+
+  m_in->clear();
+  m_in->seekg(offset);
+  m_offset = offset;
+
+  PendingFrame& pf = m_seek_frame;
+  if (!read_frame(pf))
+    return false;
+  m_last_offset = pf.offset;
+
+  if (pf.skipped)
+    block.Init(m_num_cols);
+  else
+    decode_frame(pf, block);
+  return true;
+}
+
+bool CellReader::ReadFooter(FileStats& stats) {
+
+  if (!m_fs || !m_block_format)
+    return false;
+
+  assert(!m_worker.joinable());
+  
+  const std::streampos pos = m_in->tellg();
+
+  // the end frame is the last thing in the file, and points to the footer
+  bool found = false;
+  BlockFrame frame;
+  m_in->seekg(0, std::ios::end);
+  const std::streamoff size = m_in->tellg();
+  if (size >= static_cast<std::streamoff>(m_offset + sizeof(BlockFrame))) {
+    m_in->seekg(size - sizeof(BlockFrame));
+    if (m_in->read(reinterpret_cast<char*>(&frame), sizeof(BlockFrame)) &&
+	frame.magic == CYS_FRAME_MAGIC && frame.type == CYS_FRAME_END &&
+	frame.raw_size >= m_offset && frame.raw_size < static_cast<uint64_t>(size)) {
+      m_in->seekg(frame.raw_size);
+      if (m_in->read(reinterpret_cast<char*>(&frame), sizeof(BlockFrame)) &&
+	  frame.magic == CYS_FRAME_MAGIC && frame.type == CYS_FRAME_FOOTER) {
+	std::string payload(frame.stored_size, '\0');
+	if (m_in->read(&payload[0], payload.size())) {
+	  stats.Decode(payload.data(), payload.size());
+	  found = true;
+	}
+      }
+    }
+  }
+
+  m_in->clear();
+  m_in->seekg(pos);
+  return found;
+}
+
+void CellReader::decode_frame(PendingFrame& pf, CellBlock& block) {
+  if (pf.frame.codec == CYS_CODEC_NONE) {
+    block.Decode(pf.payload.data(), pf.payload.size());
+  } else {
+    CodecDecompress(pf.frame.codec, pf.payload.data(), pf.payload.size(), pf.frame.raw_size, pf.raw);
+    block.Decode(pf.raw.data(), pf.raw.size());
+  }
+}
+
+bool CellReader::fill_ready() {
+
+  m_num_ready = 0;
+  m_ready_pos = 0;
+
+  if (m_frames.size() < m_threads || m_ready.size() < m_threads) {
+    m_frames.resize(m_threads);
+    m_ready.resize(m_threads);
+  }
+
+  // skipped blocks don't take up a slot
+  while (m_num_ready < m_threads && read_frame(m_frames[m_num_ready]))
+    if (!m_frames[m_num_ready].skipped)
+      m_num_ready++;
+
+  if (!m_num_ready)
+    return false;
+
+  // blocks are independent, so decompress and decode them in parallel
+  std::string error;
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic)
+  for (size_t i = 0; i < m_num_ready; i++) {
+    try {
+      decode_frame(m_frames[i], m_ready[i]);
+    } catch (const std::exception& e) {
+#pragma omp critical
+      error = e.what();
+    }
+  }
+  if (!error.empty())
+    throw std::runtime_error(error);
+
+  return true;
+}
+
+bool CellReader::read_frame(PendingFrame& pf) {
+
+  bool have_stats = false;
+  
+  while (!m_done) {
+
+    BlockFrame& frame = pf.frame;
+    if (!have_stats)
+      pf.offset = m_offset;
+
+    // a stream that ends without an end frame is treated as ended
+    if (!m_in->read(reinterpret_cast<char*>(&frame), sizeof(BlockFrame))) {
+      m_done = true;
+      return false;
+    }
+    m_offset += sizeof(BlockFrame);
+
+    if (frame.magic != CYS_FRAME_MAGIC)
+      throw std::runtime_error("Corrupt .cys file: bad frame marker");
+
+    if (frame.type == CYS_FRAME_END) {
+      m_done = true;
+      return false;
+    }
+
+    // zone map of the next block
+    if (frame.type == CYS_FRAME_STATS) {
+      m_stats_payload.resize(frame.stored_size);
+      read_bytes(&m_stats_payload[0], frame.stored_size);
+      skip_padding();
+      m_stats.Decode(m_stats_payload.data(), m_stats_payload.size());
+      have_stats = true;
+      continue;
+    }
+
+    // skip frames we don't know about
+    if (frame.type != CYS_FRAME_BLOCK) {
+      skip_bytes(frame.stored_size);
+      skip_padding();
+      have_stats = false;
+      continue;
+    }
+
+    pf.row = m_row;
+    m_row += frame.num_cells;
+
+    pf.skipped = have_stats && m_skip && m_skip(m_stats);
+    if (pf.skipped) {
+      skip_bytes(frame.stored_size);
+    } else {
+      pf.payload.resize(frame.stored_size);
+      read_bytes(&pf.payload[0], frame.stored_size);
+    }
+    skip_padding();
+    return true;
+  }
+
+  return false;
+}
+
+bool CellReader::ReadCell(Cell& cell) {
+
+  if (!m_block_format && !m_arrow)
+    return read_legacy_cell(cell);
+
+  // pull the next block if the current one is used up
+  while (m_block_pos >= m_block.size()) {
+    if (!ReadBlock(m_block))
+      return false;
+    m_block_pos = 0;
+  }
+
+  m_block.GetCell(m_block_pos, cell);
+  m_block_pos++;
+  return true;
+}
+
+bool CellReader::read_legacy_cell(Cell& cell) {
+
+  if (m_done)
+    return false;
+
+  try {
+    (*m_archive)(cell);
+  } catch (const cereal::Exception& e) {
+    // Catch exception thrown on EOF or any other errors
+    m_done = true;
+    return false;
+  }
+  return true;
+}
+
+void CellReader::read_bytes(char* data, size_t n) {
+
+  if (!m_in->read(data, n))
+    throw std::runtime_error("Unexpected end of .cys input");
+  m_offset += n;
+}
+
+void CellReader::skip_bytes(uint64_t n) {
+
+  // seek past it if we can, rather than reading it
+  if (m_fs)
+    m_in->seekg(n, std::ios::cur);
+  else
+    m_in->ignore(n);
+  if (!m_in->good())
+    throw std::runtime_error("Unexpected end of .cys input");
+  m_offset += n;
+}
+
+void CellReader::skip_padding() {
+
+  size_t pad = cys_pad(m_offset) - m_offset;
+  if (pad) {
+    m_in->ignore(pad);
+    m_offset += pad;
+  }
+}
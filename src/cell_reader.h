@@ -0,0 +1,182 @@
+#pragma once
+
+#include "cell_arrow.h"
+#include "cell_block.h"
+#include "cell_codec.h"
+#include "cell_header.h"
+#include "cell_queue.h"
+#include "cell_row.h"
+
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <cereal/archives/portable_binary.hpp>
+
+/**
+ * @class CellReader
+ * @brief Reads a .cys file from a path or stdin
+ *
+ * Handles both the block format written by CellWriter and legacy files
+ * of one cereal record per Cell, which are detected from the leading bytes.
+ * Arrow IPC input (see ArrowReader) is detected the same way, and read a
+ * record batch per block.
+ * Cells can be pulled either a block at a time or one at a time.
+ *
+ * Blocks are read ahead one per thread, so compressed blocks can be
+ * decompressed and decoded in parallel. With read-ahead on, this is
+ * done by a background thread that keeps the next blocks ready while
+ * the caller works on the current one.
+ */
+class CellReader {
+
+ public:
+
+  CellReader() = default;
+
+  ~CellReader();
+
+  CellReader(const CellReader&) = delete;
+  CellReader& operator=(const CellReader&) = delete;
+
+  // file is a path, or "-" for stdin. Returns false if unable to open
+  bool Open(const std::string& file);
+
+  // number of blocks to read ahead and decode at once
+  void SetThreads(size_t threads) { m_threads = threads ? threads : 1; }
+
+  // read and decode blocks on a background thread. The thread
+  // starts with the first ReadBlock, and stops for ReadBlockAt
+  void SetReadAhead(bool read_ahead) { m_read_ahead = read_ahead; }
+
+  // read the header. Must be called before reading cells
+  void ReadHeader(CellHeader& header);
+
+  // read the next row group. Returns false at the end of the stream.
+  // For legacy files, up to CYS_BLOCK_SIZE cells are gathered into a block
+  bool ReadBlock(CellBlock& block);
+
+  // read the block whose frames start at this byte offset (from a CellIndex).
+  // Only for block-formatted files, not stdin. Returns false if there is no
+  // block there. A block ruled out by the block filter comes back empty
+  bool ReadBlockAt(uint64_t offset, CellBlock& block);
+
+  // skip blocks whose zone map this returns true for, without
+  // decompressing or decoding them. Blocks without stats are never skipped
+  void SetBlockFilter(std::function<bool(const BlockStats&)> skip) { m_skip = std::move(skip); }
+
+  // byte offset of the first frame of the block last returned by ReadBlock
+  uint64_t LastBlockOffset() const { return m_last_offset; }
+
+  // read the FileStats footer, leaving the read position as it was.
+  // Returns false if there is none, or the input is stdin or a legacy file.
+  // Call before reading any blocks
+  bool ReadFooter(FileStats& stats);
+
+  // row number of the first cell of the block last returned by ReadBlock.
+  // Skipped blocks are counted, so this is the row in the whole file
+  uint64_t LastBlockRow() const { return m_last_row; }
+
+  // read the next cell. Returns false at the end of the stream
+  bool ReadCell(Cell& cell);
+
+  bool IsBlockFormat() const { return m_block_format; }
+
+ private:
+
+  std::unique_ptr<std::ifstream> m_fs;
+  std::istream* m_in = nullptr;
+
+  // legacy input is read one Cell at a time through cereal
+  std::unique_ptr<cereal::PortableBinaryInputArchive> m_archive;
+
+  // Arrow IPC input
+  std::unique_ptr<ArrowReader> m_arrow;
+
+  bool m_block_format = false;
+  bool m_done = false;
+
+  // number of data columns, from the header
+  size_t m_num_cols = 0;
+
+  // bytes read so far, to keep frames aligned
+  uint64_t m_offset = 0;
+
+  // for ReadCell, the current block and position in it
+  CellBlock m_block;
+  size_t m_block_pos = 0;
+
+  size_t m_threads = 1;
+
+  // a block frame as read from the stream
+  struct PendingFrame {
+    BlockFrame frame;
+    uint64_t offset = 0; // offset of its first frame (the stats, if any)
+    uint64_t row = 0;    // row of its first cell
+    bool skipped = false;// ruled out by the filter, so the payload wasn't read
+    std::string payload;
+    std::string raw;
+  };
+
+  // read-ahead blocks. Buffers are re-used between batches
+  std::vector<PendingFrame> m_frames;
+  std::vector<CellBlock> m_ready;
+  size_t m_num_ready = 0;
+  size_t m_ready_pos = 0;
+
+  // the frame of ReadBlockAt, kept apart from the read-ahead ones
+  PendingFrame m_seek_frame;
+  uint64_t m_last_offset = 0;
+  uint64_t m_last_row = 0;
+
+  // rows seen so far, including skipped blocks
+  uint64_t m_row = 0;
+
+  std::function<bool(const BlockStats&)> m_skip;
+  BlockStats m_stats;
+  std::string m_stats_payload;
+
+  // a decoded block from the read-ahead thread
+  struct ReadAheadBlock {
+    CellBlock block;
+    uint64_t offset = 0;
+    uint64_t row = 0;
+  };
+
+  bool m_read_ahead = false;
+  std::thread m_worker;
+  BoundedQueue<ReadAheadBlock> m_queue;
+  BoundedQueue<CellBlock> m_free; // blocks handed back by the caller, to re-use
+  std::exception_ptr m_error;
+
+  // read the next block, and the offset and row it starts at
+  bool read_block(CellBlock& block, uint64_t& offset, uint64_t& row);
+
+  // run by the read-ahead thread
+  void read_worker();
+
+  // stop the read-ahead thread, dropping anything it has read
+  void stop_worker();
+
+  // read the next block frame and its payload, unless the block is
+  // skipped. Returns false at the end
+  bool read_frame(PendingFrame& pf);
+
+  // inflate (if needed) and decode a block payload
+  static void decode_frame(PendingFrame& pf, CellBlock& block);
+
+  // read and decode the next batch of blocks
+  bool fill_ready();
+
+  void read_bytes(char* data, size_t n);
+
+  void skip_bytes(uint64_t n);
+
+  void skip_padding();
+
+  bool read_legacy_cell(Cell& cell);
+
+};
@@ -1,5 +1,6 @@
 #include <random>
 #include <cstdlib>
+#include <exception>
 #include <boost/functional/hash.hpp>
 
 #include "cairo/cairo.h"
@@ -16,6 +17,9 @@ typedef K::Point_2 Point;
 #include "cell_utils.h"
 #include "cell_table.h"
 #include "cell_graph.h"
+#include "cell_h5ad.h"
+#include "cell_index.h"
+#include "cell_mmap.h"
 #include "tiff_writer.h"
 
 #include <H5Cpp.h>
@@ -90,11 +94,6 @@ struct jline_eq {
 
 static size_t debugr = 0;
 
-#ifdef __clang__
-std::vector<Cell> cell_buffer;
-#pragma omp threadprivate(cell_buffer)
-#endif
-
 const CellHeader& CellTable::GetHeader() const {
   return m_header;
 }
@@ -104,179 +103,45 @@ bool CellTable::ContainsColumn(const std::string& name) const {
 }
 
 void CellTable::HDF5Write(const std::string& file) const {
-  
-  ///////
-  // VAR (markers)
-  ///////
-  // setup for the "var" data (marker string names)
-  std::vector<std::string> var_strings; // Use this to manage the lifetime of the strings
-  std::vector<const char*> var;
-  for (const auto& t : m_header.GetMarkerTags()) {
-    var_strings.push_back(t.id);
-    if (m_table.find(t.id) == m_table.end())
-      std::cerr << " can't find " << t.id << std::endl;
-  }
-  
-  // Then populate var using the strings in var_strings
-  for (const auto& s : var_strings) {
-    var.push_back(s.c_str());
-  }
-
-  /// DIMS
-  hsize_t var_dims[1] = {var.size()};  
-  hsize_t obs_dims[1] = {CellCount()};
-  hsize_t x_dims[2] = {CellCount(), var_strings.size()}; // Number of rows and columns
-  hsize_t empty_dims[1] = {0};
-  
-  ///////
-  // OBS
-  ///////
-  // setup for the "var" data (marker string names)
-  std::vector<std::string> obs_strings; // Use this to manage the lifetime of the strings
-  std::vector<const char*> obs;
-  obs_strings.push_back("x");
-  obs_strings.push_back("y");
-  obs_strings.push_back("cflag");
-  obs_strings.push_back("pflag");  
-  for (const auto& t : m_header.GetMetaTags()) {
-    obs_strings.push_back(t.id);
-    if (m_table.find(t.id) == m_table.end())
-      std::cerr << " can't find " << t.id << std::endl;
-  }
-  
-  // Then populate obs using the strings in obs_strings
-  for (const auto& s : obs_strings) {
-    obs.push_back(s.c_str());
-  }
-
-  ///////
-  // OBS DATA
-  ///////
-  // Convert meta data to contiguous array
-  std::vector<float> flat_data_meta;
-  for (const auto& t : obs_strings) {
-    const auto& ptr = m_table.find(std::string(t));
-    assert(ptr != m_table.end());
-    for (size_t i = 0; i < ptr->second->size(); i++) {
-      flat_data_meta.push_back(ptr->second->GetNumericElem(i));
-    }
-  }
-
-  
-  ///////
-  // X
-  ///////
-  // Convert X data to contiguous array
-  // NOTE that in python, data is read as column major, so we need to do the same here
-  std::vector<float> flat_data;
-  for (const auto& t : var_strings) {
-    const auto& ptr = m_table.find(std::string(t));
-    assert(ptr != m_table.end());
-    for (size_t i = 0; i < ptr->second->size(); i++) {
-      flat_data.push_back(ptr->second->GetNumericElem(i));
-    }
-  }
-
-  ///////
-  // CELL ID
-  ///////
-  // setup for cellid
-  std::vector<const char*> id_data;
-  std::vector<std::unique_ptr<char[]>> unique_id_data;
-  const auto& ptr = m_table.find("id");
-  for (size_t i = 0; i < ptr->second->size(); i++) {
-    std::string str = "cellid_" + std::to_string(static_cast<uint32_t>(ptr->second->GetNumericElem(i)));
-    std::unique_ptr<char[]> cstr(new char[str.length() + 1]);
-    std::strcpy(cstr.get(), str.c_str());
-    id_data.push_back(cstr.get());
-    unique_id_data.push_back(std::move(cstr));
-  }
-
-  //// FILE
-  ///////
-  // just in time setup file output
-  H5::StrType strdatatype(H5::PredType::C_S1, H5T_VARIABLE);  
-  H5::H5File h5file(file, H5F_ACC_TRUNC);
-
-  // setup groups
-  const H5std_string OBS_GROUP_NAME("obs");
-  H5::Group group(h5file.createGroup(OBS_GROUP_NAME));
-
-  const H5std_string VAR_GROUP_NAME("var");
-  H5::Group vargroup(h5file.createGroup(VAR_GROUP_NAME));
-
-  const H5std_string UNS_GROUP_NAME("uns");
-  H5::Group unsgroup(h5file.createGroup(UNS_GROUP_NAME));
-
-  //////
-  // WRITE
-
-  // write obs (float data)
-  assert(obs_strings.size() == obs.size());
-  H5::DataSpace obs_dataspace(1, obs_dims);
-  for (const auto& o : obs_strings) {
-    H5::DataSet obs_dataset(group.createDataSet(o, H5::PredType::NATIVE_FLOAT, obs_dataspace));
-    std::vector<float> odata;
-    const auto ptr = m_table.find(o);
-    odata.reserve(CellCount());
-    for (size_t i = 0; i < CellCount(); i++)
-      odata.push_back(ptr->second->GetNumericElem(i));
-    obs_dataset.write(odata.data(), H5::PredType::NATIVE_FLOAT);
-  }
-
-  // Assume that `obsGroup` is an H5::Group corresponding to the 'obs' group,
-  // and `colName` is a std::string containing the name of your column.
-  //H5::StrType strType(0, H5T_VARIABLE); // 0 means size of the string is variable
-  hsize_t odim[1] = {obs.size()};
-  H5::DataSpace obsnames_dataspace(1, odim);
-  H5::Attribute columnOrderAttribute = group.createAttribute("column-order", strdatatype, obsnames_dataspace);
-  columnOrderAttribute.write(strdatatype, obs.data());
-
-  write_hdf5_dataframe_attributes(group);
-  write_hdf5_dataframe_attributes(vargroup);  
-  
-  // write the _index data for obs
-  H5::DataSet obsnames_dataset(group.createDataSet("_index", strdatatype, obs_dataspace));  
-  obsnames_dataset.write(unique_id_data.data(), strdatatype);
-  
-  // write the _index data va
-  H5::DataSpace var_dataspace(1, var_dims);
-  H5::DataSet varnames_dataset(vargroup.createDataSet("_index", strdatatype, var_dataspace));
-  varnames_dataset.write(var.data(), strdatatype);
-
-  // and the var column order
-  H5::DataSpace empty_dataspace = H5::DataSpace(1, empty_dims);
-  H5::Attribute varcolumnOrderAttribute = vargroup.createAttribute("column-order", strdatatype, empty_dataspace);
-  //varcolumnOrderAttribute.write(strdatatype, var.data());
-  
-  // write obs (index)
-  //H5::DataSet obs_dataset(group.createDataSet("_index", strdatatype, obs_dataspace));
-  //std::vector<const char*> cell_id;
-  //obs_dataset.write(unique_id_data.data(), strdatatype);
-
-  // write uns
-  H5::DataSpace uns_dataspace(1, var_dims);
-  H5::DataSet uns_dataset(unsgroup.createDataSet("all_markers", strdatatype, uns_dataspace));
-  uns_dataset.write(var.data(), strdatatype);
-  
-  /*hsize_t obs_dims[1] = {obs.size()};
-  H5::DataSpace obs_dataspace(1, obs_dims);
-  H5::DataSet obs_dataset = h5file.createDataSet("/obs", strdatatype, obs_dataspace);  
-  obs_dataset.write(obs_data.data(), strdatatype);
-
-  // write obs (numeric)
-  hsize_t obs_data_dims[2] = {CellCount(), obs.size()};
-  H5::DataSpace obs_data_dataspace(1, obs_data_dims);
-  H5::DataSet obs_data_dataset = h5file.createDataSet("/obs_data", H5::PredType::NATIVE_FLOAT, obs_dataspace);
-  obs_data_dataset.write(flat_data_meta.data(), H5::PredType::NATIVE_FLOAT);
-  */
-  
-  // write X (numeric)
-  H5::DataSpace dataspace(2, x_dims);
-  H5::DataSet dataset = h5file.createDataSet("/X", H5::PredType::NATIVE_FLOAT, dataspace);
-  dataset.write(flat_data.data(), H5::PredType::NATIVE_FLOAT);
 
-  h5file.close();
+  if (m_source)
+    throw std::runtime_error("HDF5Write: table was loaded with only some columns");
+
+  // cells go to the writer a block at a time, so nothing
+  // beyond the table itself is held in memory
+  H5adWriter writer;
+  writer.Open(file, m_header);
+
+  const ConstSpan<cy_uint> ids = ColumnView<cy_uint>(m_table.at("id"));
+  const ConstSpan<cy_uint> cflags = ColumnView<cy_uint>(m_table.at("cflag"));
+  const ConstSpan<cy_uint> pflags = ColumnView<cy_uint>(m_table.at("pflag"));
+  const ConstSpan<float> x = ColumnView<float>(m_table.at("x"));
+  const ConstSpan<float> y = ColumnView<float>(m_table.at("y"));
+
+  std::vector<ConstSpan<float>> cols;
+  for (const auto& t : m_header.GetDataTags()) {
+    auto it = m_table.find(t.id);
+    if (it == m_table.end())
+      throw std::runtime_error("HDF5Write: can't find column " + t.id);
+    cols.push_back(ColumnView<float>(it->second));
+    if (cols.back().size() != ids.size())
+      throw std::runtime_error("HDF5Write: column " + t.id + " is not the size of the table");
+  }
+
+  Cell cell;
+  cell.m_cols.resize(cols.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    cell.m_id   = ids[i];
+    cell.m_cell_flag = cflags[i];
+    cell.m_pheno_flag = pflags[i];
+    cell.m_x    = x[i];
+    cell.m_y    = y[i];
+    for (size_t j = 0; j < cols.size(); j++)
+      cell.m_cols[j] = cols[j][i];
+    writer.WriteCell(cell);
+  }
+
+  writer.Close();
   
 }
 
@@ -308,29 +173,83 @@ std::ostream& operator<<(std::ostream& os, const CellTable& table) {
 void CellTable::add_cell_to_table(const Cell& cell, bool nodata, bool nograph) {
 
   // add fixed data
-  static_cast<IntCol*>(m_table["id"].get())->PushElem(cell.m_id);
-  static_cast<IntCol*>(m_table["pflag"].get())->PushElem(cell.m_pheno_flag);
-  static_cast<IntCol*>(m_table["cflag"].get())->PushElem(cell.m_cell_flag);  
-  static_cast<FloatCol*>(m_table["x"].get())->PushElem(cell.m_x);
-  static_cast<FloatCol*>(m_table["y"].get())->PushElem(cell.m_y);
+  m_slots.id->PushElem(cell.m_id);
+  m_slots.pflag->PushElem(cell.m_pheno_flag);
+  m_slots.cflag->PushElem(cell.m_cell_flag);
+  m_slots.x->PushElem(cell.m_x);
+  m_slots.y->PushElem(cell.m_y);
 
   // add the info data
   if (!nodata) {
-    size_t i = 0;
-    for (const auto& t : m_header.GetDataTags()) {
-      static_cast<FloatCol*>(m_table[t.id].get())->PushElem(cell.m_cols.at(i));
-      i++;
-    }
+    if (cell.m_cols.size() < m_slots.data.size())
+      throw std::runtime_error("Cell has " + std::to_string(cell.m_cols.size()) +
+			       " data columns, table has " + std::to_string(m_slots.data.size()));
+    for (size_t j = 0; j < m_slots.data.size(); j++)
+      m_slots.data[j]->PushElem(cell.m_cols[j]);
   }
   
   // add the graph data
   if (!nograph) {
-    CellNode node(cell.m_spatial_ids, cell.m_spatial_dist);
-    static_cast<GraphColumn*>(m_table["spat"].get())->PushElem(node);
+    if (cell.m_spatial_dist.size() != cell.m_spatial_ids.size())
+      throw std::runtime_error("Cell has " + std::to_string(cell.m_spatial_ids.size()) +
+			       " neighbors but " + std::to_string(cell.m_spatial_dist.size()) + " distances");
+    m_slots.graph->PushNode(cell.m_spatial_ids.data(), cell.m_spatial_dist.data(),
+			    nullptr, cell.m_spatial_ids.size());
   }
   
 }
 
+void CellTable::add_cells_to_table(const Cell* cells, const int* vals, size_t n) {
+
+  // the cells to save, and which of them keep their data and graph
+  std::vector<size_t> rows, data_rows, graph_rows;
+  for (size_t i = 0; i < n; i++) {
+    const int v = vals[i];
+    if (v != CellProcessor::SAVE_CELL && v != CellProcessor::SAVE_NODATA_CELL &&
+	v != CellProcessor::SAVE_NODATA_NOGRAPH_CELL)
+      continue;
+    rows.push_back(i);
+    if (v == CellProcessor::SAVE_CELL)
+      data_rows.push_back(i);
+    if (v != CellProcessor::SAVE_NODATA_NOGRAPH_CELL)
+      graph_rows.push_back(i);
+  }
+
+  if (rows.empty())
+    return;
+
+  for (size_t i : data_rows)
+    if (cells[i].m_cols.size() < m_slots.data.size())
+      throw std::runtime_error("Cell has " + std::to_string(cells[i].m_cols.size()) +
+			       " data columns, table has " + std::to_string(m_slots.data.size()));
+  for (size_t i : graph_rows)
+    if (cells[i].m_spatial_dist.size() != cells[i].m_spatial_ids.size())
+      throw std::runtime_error("Cell has " + std::to_string(cells[i].m_spatial_ids.size()) +
+			       " neighbors but " + std::to_string(cells[i].m_spatial_dist.size()) + " distances");
+
+  // fill each column in turn
+  for (size_t i : rows)
+    m_slots.id->PushElem(cells[i].m_id);
+  for (size_t i : rows)
+    m_slots.pflag->PushElem(cells[i].m_pheno_flag);
+  for (size_t i : rows)
+    m_slots.cflag->PushElem(cells[i].m_cell_flag);
+  for (size_t i : rows)
+    m_slots.x->PushElem(cells[i].m_x);
+  for (size_t i : rows)
+    m_slots.y->PushElem(cells[i].m_y);
+
+  for (size_t j = 0; j < m_slots.data.size(); j++) {
+    FloatCol* col = m_slots.data[j];
+    for (size_t i : data_rows)
+      col->PushElem(cells[i].m_cols[j]);
+  }
+
+  for (size_t i : graph_rows)
+    m_slots.graph->PushNode(cells[i].m_spatial_ids.data(), cells[i].m_spatial_dist.data(),
+			    nullptr, cells[i].m_spatial_ids.size());
+}
+
 void CellTable::Subsample(int n, int s) {
   
   // Create a random number generator with the provided seed
@@ -442,12 +361,12 @@ void CellTable::PrintTable(bool header) const {
 void CellTable::SetupOutputWriter(const std::string& file) {
 
   // set the output to file or stdout
-  if (file == "-") {
-    m_archive = std::make_unique<cereal::PortableBinaryOutputArchive>(std::cout);
-  } else {
-    m_os = std::make_unique<std::ofstream>(file, std::ios::binary);
-    m_archive = std::make_unique<cereal::PortableBinaryOutputArchive>(*m_os);
-  }
+  m_writer = std::make_unique<CellWriter>(file);
+  m_writer->SetCodec(m_codec);
+  m_writer->SetThreads(m_threads);
+  m_writer->SetIndex(m_index);
+  m_writer->SetGraphEncoding(m_graph_encoding);
+  m_writer->SetBackground(true);
   
 }
 
@@ -513,39 +432,23 @@ void CellTable::Convolve(TiffWriter& otif, int boxwidth, float microns_per_pixel
 
 void CellTable::sortxy(bool reverse) {
 
-  // fill the coordinate vector
-  FloatColPtr x_ptr = dynamic_pointer_cast<FloatCol>(m_table.at("x"));
-  FloatColPtr y_ptr = dynamic_pointer_cast<FloatCol>(m_table.at("y"));  
-  
-  std::vector<size_t> indices(x_ptr->size()); // index vector
-  std::iota(indices.begin(), indices.end(), 0); // fill with 0, 1, ..., n-1
+  const ConstSpan<float> x = ColumnView<float>(m_table.at("x"));
+  const ConstSpan<float> y = ColumnView<float>(m_table.at("y"));
 
+  // distance of each cell from the origin, once rather than per comparison
+  std::vector<float> dist(x.size());
+  kernels::map2(x, y, dist.data(), [](float a, float b) { return std::hypot(a, b); });
+  
   if (m_verbose)
     std::cerr << "...sorting " << AddCommas(CellCount()) << " cells" << std::endl;
   
-  // sort indices based on comparing values in (x,y)
-  if (reverse) {
-    std::sort(indices.begin(), indices.end(),
-	      [&x_ptr, &y_ptr](size_t i1, size_t i2) {
-		return std::hypot(x_ptr->GetNumericElem(i1), y_ptr->GetNumericElem(i1)) > 
-		  std::hypot(x_ptr->GetNumericElem(i2), y_ptr->GetNumericElem(i2));
-	      });
-  } else {
-    std::sort(indices.begin(), indices.end(),
-	      [&x_ptr, &y_ptr](size_t i1, size_t i2) {
-		return std::hypot(x_ptr->GetNumericElem(i1), y_ptr->GetNumericElem(i1)) <
-		  std::hypot(x_ptr->GetNumericElem(i2), y_ptr->GetNumericElem(i2));
-	      });
-  }
+  const std::vector<size_t> indices =
+    kernels::radix_order(ConstSpan<float>(dist.data(), dist.size()), reverse, m_threads);
 
   if (m_verbose)
     std::cerr << "...done sorting" << std::endl;
   
-  // Now you can use this 'indices' vector to rearrange your 'another_column' vector
-  for (auto t : m_table) {
-     if (t.second->size())
-      t.second->Order(indices);
-   }
+  order_rows(indices);
   
 }
 
@@ -563,36 +466,78 @@ void CellTable::sort(const std::string& field, bool reverse) {
     return;
   }
     
-  // fill the coordinate vector
-  FloatColPtr c_ptr = dynamic_pointer_cast<FloatCol>(it->second);
-  
-  std::vector<size_t> indices(c_ptr->size()); // index vector
-  std::iota(indices.begin(), indices.end(), 0); // fill with 0, 1, ..., n-1
-
   if (m_verbose)
     std::cerr << "...sorting " << AddCommas(CellCount()) << " cells" << std::endl;
   
-  // sort indices based on comparing values in (x,y)
-  if (reverse) {
-    std::sort(indices.begin(), indices.end(),
-	      [&c_ptr](size_t i1, size_t i2) {
-		return c_ptr->GetNumericElem(i1) > c_ptr->GetNumericElem(i2);
-	      });
-  } else {
-    std::sort(indices.begin(), indices.end(),
-	      [&c_ptr](size_t i1, size_t i2) {
-		return c_ptr->GetNumericElem(i1) < c_ptr->GetNumericElem(i2);
-	      });
-  }
+  // radix sort on the values, as the type the column holds
+  std::vector<size_t> indices;
+  VisitNumeric(it->second, [&](auto c) {
+    indices = kernels::radix_order(c, reverse, m_threads);
+  });
   
   if (m_verbose)
     std::cerr << "...done sorting" << std::endl;
   
-  // Now you can use this 'indices' vector to rearrange your 'another_column' vector
-  for (auto t : m_table) {
-     if (t.second->size())
-      t.second->Order(indices);
-   }
+  order_rows(indices);
+}
+
+void CellTable::sortcurve(kernels::SpaceCurve curve, bool reverse) {
+
+  const ConstSpan<float> x = ColumnView<float>(m_table.at("x"));
+  const ConstSpan<float> y = ColumnView<float>(m_table.at("y"));
+  if (x.empty())
+    return;
+
+  const auto xr = kernels::minmax(x);
+  const auto yr = kernels::minmax(y);
+
+  std::vector<uint32_t> keys(x.size());
+  kernels::curve_keys(x, y, xr.first, xr.second, yr.first, yr.second, curve, keys.data());
+
+  if (m_verbose)
+    std::cerr << "...sorting " << AddCommas(CellCount()) << " cells along the " <<
+      (curve == kernels::SpaceCurve::HILBERT ? "Hilbert" : "Morton") << " curve" << std::endl;
+
+  const std::vector<size_t> indices =
+    kernels::radix_order(ConstSpan<uint32_t>(keys.data(), keys.size()), reverse, m_threads);
+
+  if (m_verbose)
+    std::cerr << "...done sorting" << std::endl;
+
+  order_rows(indices);
+}
+
+void CellTable::order_rows(const std::vector<size_t>& order) {
+
+  // the columns that weren't loaded only line up with the rows as loaded
+  if (m_source)
+    throw std::runtime_error("order_rows: table was loaded with only some columns");
+
+  std::vector<Column*> cols;
+  for (const auto& t : m_table) {
+    if (!t.second->size())
+      continue;
+    if (t.second->size() != order.size())
+      throw std::runtime_error("order_rows: column " + t.first + " is not the size of the table");
+    cols.push_back(t.second.get());
+  }
+
+  // numeric, flag and string columns are permuted in place, so a thread
+  // only needs one bit per row. The graph is gathered into new arrays
+  std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic) num_threads(m_threads)
+  for (size_t i = 0; i < cols.size(); i++) {
+    try {
+      cols[i]->Order(order);
+    } catch (...) {
+#pragma omp critical
+      if (!error)
+	error = std::current_exception();
+    }
+  }
+
+  if (error)
+    std::rethrow_exception(error);
 }
 
 void CellTable::Delaunay(const std::string& pdf_delaunay,
@@ -600,22 +545,18 @@ void CellTable::Delaunay(const std::string& pdf_delaunay,
 	        int limit) {
 
   // fill the coordinate vector
-  FloatColPtr x_ptr = dynamic_pointer_cast<FloatCol>(m_table.at("x"));
-  FloatColPtr y_ptr = dynamic_pointer_cast<FloatCol>(m_table.at("y"));  
+  const ConstSpan<float> x = ColumnView<float>(m_table.at("x"));
+  const ConstSpan<float> y = ColumnView<float>(m_table.at("y"));
 
   float xmax = 0;
   float ymax = 0;  
   
   size_t ncells = CellCount();
   std::vector<double> coords(ncells * 2);
-  
-  for (size_t i = 0; i < ncells; i++) {
-    coords[i*2  ] = x_ptr->GetNumericElem(i);
-    coords[i*2+1] = y_ptr->GetNumericElem(i);
-    if (coords[i*2] > xmax)
-      xmax = coords[i*2];
-    if (coords[i*2+1] > ymax)
-      ymax = coords[i*2+1];
+  kernels::interleave(x, y, coords.data());
+  if (ncells) {
+    xmax = std::max(xmax, kernels::minmax(x).second);
+    ymax = std::max(ymax, kernels::minmax(y).second);
   }
 
   // construct the graph
@@ -722,9 +663,8 @@ void CellTable::Delaunay(const std::string& pdf_delaunay,
   }
   
   // fill the data into the columns
-  for (size_t i = 0; i < x_ptr->size(); i++) {
-    //Point p = {x_ptr->GetNumericElem(i),y_ptr->GetNumericElem(i)};
-    JPoint p = {x_ptr->GetNumericElem(i),y_ptr->GetNumericElem(i)};    
+  for (size_t i = 0; i < x.size(); i++) {
+    JPoint p = {x[i], y[i]};
     
     // find the point in the component labels
     auto idd = pointToComponentId.find(p);
@@ -816,7 +756,7 @@ void CellTable::Delaunay(const std::string& pdf_delaunay,
     
     std::vector<Point> points(ncells);
     for (size_t i = 0; i < ncells; ++i) {
-      points[i] = Point(x_ptr->GetNumericElem(i), y_ptr->GetNumericElem(i));
+      points[i] = Point(x[i], y[i]);
     }
     
     DelaunayData dt;
@@ -870,12 +810,12 @@ void CellTable::Delaunay(const std::string& pdf_delaunay,
 
 void CellTable::OutputTable() {
 
-  assert(m_archive);
+  assert(m_writer);
 
   m_header.SortTags();
   
   // archive the header
-  (*m_archive)(m_header);
+  m_writer->WriteHeader(m_header);
 
   // create the cells and print
   size_t numRows = CellCount();
@@ -887,14 +827,43 @@ void CellTable::OutputTable() {
   auto y_ptr = m_table.at("y");
   auto g_ptr = m_table.find("spat");
 
+  // columns that weren't loaded come straight from the mapped input,
+  // which only lines up if the rows are as they were loaded
+  if (m_source && numRows != m_source->NumCells())
+    throw std::runtime_error("OutputTable: rows changed after loading only some columns");
+
+  // null for a column taken from the input, with its index there
   std::vector<ColPtr> col_ptr;
+  std::vector<size_t> source_col;
   for (const auto& t : m_header.GetDataTags()) {
-    col_ptr.push_back(m_table.at(t.id));
+    auto it = m_table.find(t.id);
+    if (it != m_table.end()) {
+      col_ptr.push_back(it->second);
+      source_col.push_back(0);
+    } else {
+      col_ptr.push_back(nullptr);
+      source_col.push_back(m_source_cols.at(t.id));
+    }
   }
 
+  // the input block holding the current row
+  size_t block = 0;
+  size_t block_start = 0;
+
   for (size_t i = 0; i < numRows; i++) {
 
     Cell cell;
+
+    // move on to the input block with this row
+    const BlockView* view = nullptr;
+    if (m_source) {
+      while (i >= block_start + m_source->BlockSize(block)) {
+	block_start += m_source->BlockSize(block);
+	m_source->ReleaseBlock(block);
+	block++;
+      }
+      view = &m_source->GetBlock(block, m_source_graph);
+    }
     
     cell.m_id   = static_cast<IntCol*>(id_ptr.get())->GetNumericElem(i);
     cell.m_cell_flag = static_cast<IntCol*>(cflag_ptr.get())->GetNumericElem(i);
@@ -902,21 +871,36 @@ void CellTable::OutputTable() {
     cell.m_x    = static_cast<FloatCol*>(x_ptr.get())->GetNumericElem(i);
     cell.m_y    = static_cast<FloatCol*>(y_ptr.get())->GetNumericElem(i);
 
-    for (const auto& c : col_ptr) {
-      cell.m_cols.push_back(static_cast<FloatCol*>(c.get())->GetNumericElem(i));
+    for (size_t j = 0; j < col_ptr.size(); j++) {
+      if (col_ptr[j])
+	cell.m_cols.push_back(static_cast<FloatCol*>(col_ptr[j].get())->GetNumericElem(i));
+      else
+	cell.m_cols.push_back(view->cols[source_col[j]][i - block_start]);
     }
     
     // fill the Cell graph
     if (g_ptr != m_table.end()) {
-      const CellNode& n = static_cast<GraphColumn*>(g_ptr->second.get())->GetNode(i);
-      n.FillSparseFormat(cell.m_spatial_ids, cell.m_spatial_dist);
+      const GraphNode n = static_cast<GraphColumn*>(g_ptr->second.get())->GetNode(i);
+      cell.m_spatial_ids.assign(n.ids.begin(), n.ids.end());
+      cell.m_spatial_dist.assign(n.dist.begin(), n.dist.end());
+      cell.m_spatial_flags.assign(n.flags.begin(), n.flags.end());
+    } else if (m_source_graph) {
+      const size_t r = i - block_start;
+      for (uint64_t k = view->graph_offsets[r]; k < view->graph_offsets[r + 1]; k++) {
+	cell.m_spatial_ids.push_back(view->graph_ids[k]);
+	cell.m_spatial_dist.push_back(view->graph_dist[k]);
+	cell.m_spatial_flags.push_back(view->graph_flags[k]);
+      }
     }
     
     // write it
-    (*m_archive)(cell);
+    m_writer->WriteCell(cell);
     
   }
 
+  // flush the last block
+  m_writer->Close();
+
 }
 
 void CellTable::Crop(float xlo, float xhi, float ylo, float yhi) {
@@ -1208,8 +1192,11 @@ void CellTable::TumorCall(int num_neighbors, float frac,
       if (cellflag.testAndOr(orflag, andflag))
 	tumor_cell_count++;
     }
-    if (tumor_cell_count / static_cast<float>(node.size()) >= frac)
-      static_cast<IntCol*>(cflag_ptr.get())->SetNumericElem(1, i);
+    // keep the halo bit of a tile from split
+    if (tumor_cell_count / static_cast<float>(node.size()) >= frac) {
+      const cy_uint halo = static_cast<IntCol*>(cflag_ptr.get())->getData()[i] & CELL_FLAG_HALO;
+      static_cast<IntCol*>(cflag_ptr.get())->SetNumericElem(1 | halo, i);
+    }
     
   }// end for
 }
@@ -1243,22 +1230,16 @@ void CellTable::KNN_spatial(int num_neighbors, int dist) {
    // convert to row major?
    column_to_row_major(concatenated_data, nobs, ndim);
    
-   // get the cell id colums
-   //auto id_ptr = GetIDColumn();
-   auto id_ptr = m_table.at("id");
+   // the graph points to cell ids rather than rows, and carries the pheno flag of each neighbor
+   const ConstSpan<cy_uint> ids = ColumnView<cy_uint>(m_table.at("id"));
+   const ConstSpan<cy_uint> pflags = ColumnView<cy_uint>(m_table.at("pflag"));
    
    if (m_verbose)
      std::cerr << "...setting up KNN graph (spatial) on " << AddCommas(nobs) << " points" << std::endl;
    
-  umappp::NeighborList<float> output(nobs);
-
   if (m_verbose)
     std::cerr << "...building KNN (spatial) graph" << std::endl;
 
-  // store the final graph
-  auto graph = std::make_shared<GraphColumn>();
-  graph->resize(nobs);
-
   // track number of cases where all N nearest neighbors are within the
   // distance cutoff, implying that there are likely additional cells within
   // the desired radius that are cutoff
@@ -1268,21 +1249,13 @@ void CellTable::KNN_spatial(int num_neighbors, int dist) {
   //knncolle::VpTree<knncolle::distances::Euclidean, int, float> searcher(ndim, nobs, concatenated_data.data());
   //knncolle::AnnoyEuclidean<int, float> searcher(ndim, nobs, concatenated_data.data());
   knncolle::Kmknn<knncolle::distances::Euclidean, int, float> searcher(ndim, nobs, concatenated_data.data());  
-    
-  // archive the header
-  assert(m_archive);
-  (*m_archive)(m_header);
 
-  // create the cells and print
-  size_t numRows = CellCount();
-
-  // setup for converting to Cell
-  auto cflag_ptr = m_table.at("cflag");
-  auto pflag_ptr = m_table.at("pflag");  
-  std::vector<ColPtr> col_ptr;
-  for (const auto& t : m_header.GetDataTags()) {
-    col_ptr.push_back(m_table.at(t.id));
-  }
+  // each cell's neighbors go in a fixed run of num_neighbors slots, with
+  // the number kept in offsets[i + 1]. These are packed into the CSR arrays below
+  const size_t k_max = std::max(num_neighbors, 0);
+  std::vector<int> slot_rows(nobs * k_max);
+  std::vector<float> slot_dist(nobs * k_max);
+  std::vector<uint64_t> offsets(nobs + 1, 0);
   
 #pragma omp parallel for num_threads(m_threads)
   for (size_t i = 0; i < nobs; ++i) {
@@ -1295,112 +1268,59 @@ void CellTable::KNN_spatial(int num_neighbors, int dist) {
 	omp_get_thread_num() << " K " << num_neighbors << " Dist: " << dist <<
 	std::endl;
     
-    Neighbors neigh = searcher.find_nearest_neighbors(i, num_neighbors);
-
-
-    CellNode node;
+    const Neighbors neigh = searcher.find_nearest_neighbors(i, num_neighbors);
 
     // remove less than distance
-    if (dist > 0) {
+    size_t m = 0;
+    for (const auto& nnn : neigh) {
+      if (dist > 0 && nnn.second >= dist)
+	continue;
+      slot_rows[i * k_max + m] = nnn.first;
+      slot_dist[i * k_max + m] = nnn.second;
+      m++;
+    }
+    offsets[i + 1] = m;
       
-      size_t osize = neigh.size();
-      Neighbors neigh_trim;
-      for (const auto& nnn : neigh) {
-	if (nnn.second < dist)
-	  neigh_trim.push_back(nnn);
-      }
-      
-      // print a warning if we trimmed off too many neighbors
-      if (osize == neigh_trim.size()) {  
+    // print a warning if we trimmed off too many neighbors
+    if (dist > 0 && neigh.size() == m) {  
 #pragma omp critical
-	{
-	  lost_cell++;
-	  if (lost_cell % 500 == 0)
-	    std::cerr << "osize " << osize << " Lost cell " << AddCommas(lost_cell) << " of " << AddCommas(nobs) << std::endl;
-	}
+      {
+	lost_cell++;
+	if (lost_cell % 500 == 0)
+	  std::cerr << "osize " << neigh.size() << " Lost cell " << AddCommas(lost_cell) << " of " << AddCommas(nobs) << std::endl;
       }
-      
-      neigh = neigh_trim;
-
     }
-
-    // add the pheno flags
-    std::vector<cy_uint> pflag_vec(neigh.size());
-    for (size_t j = 0; j < neigh.size(); j++) {
-      pflag_vec[j] = static_cast<IntCol*>(pflag_ptr.get())->GetNumericElem(neigh.at(j).first);
-    }
-
-    assert(pflag_vec.size() == neigh.size());
-    
-    // Now, set the node pointer to CellID rather than 0-based
-    for (auto& cc : neigh) {
-      cc.first = id_ptr->GetNumericElem(cc.first);
-    }
-    node = CellNode(neigh, pflag_vec);
-
-    // build the Cell object
-    ////////////////////////
-    Cell cell;
-    cell.m_id   = static_cast<IntCol*>(id_ptr.get())->GetNumericElem(i);
-    cell.m_pheno_flag = static_cast<IntCol*>(pflag_ptr.get())->GetNumericElem(i);
-    cell.m_cell_flag = static_cast<IntCol*>(cflag_ptr.get())->GetNumericElem(i);    
-    cell.m_x    = static_cast<FloatCol*>(x_ptr.get())->GetNumericElem(i);
-    cell.m_y    = static_cast<FloatCol*>(y_ptr.get())->GetNumericElem(i);
-
-    // fill the Cell data columns
-    for (const auto& c : col_ptr) {
-      cell.m_cols.push_back(static_cast<FloatCol*>(c.get())->GetNumericElem(i));
-    }
-
-    // fill the Cell graph data
-    node.FillSparseFormat(cell.m_spatial_ids, cell.m_spatial_dist);
-    assert(pflag_vec.size() == cell.m_spatial_ids.size());
-    cell.m_spatial_flags = pflag_vec;
-
-    // Add the cell to the thread-local buffer.
-#ifdef __clang__
-    cell_buffer.push_back(cell);
-#endif
-
-    //if (cell_buffer.size() >= CELL_BUFFER_LIMIT) {
-#pragma omp critical
-    {
-#ifdef __clang__
-      for (const auto& buffered_cell : cell_buffer) {
-      	(*m_archive)(buffered_cell);
-      }
-#else
-      (*m_archive)(cell);      
-#endif
-    }
-    
-#ifdef __clang__    
-    cell_buffer.clear();
-#endif
     
   }// end for
-  
-  // After the loop, dump any remaining cells in the buffer.
 
+  for (size_t i = 0; i < nobs; i++)
+    offsets[i + 1] += offsets[i];
 
-#ifdef __clang__
-#pragma omp critical
-  {
-    for (const auto& buffered_cell : cell_buffer) {
-      (*m_archive)(buffered_cell);
+  std::vector<uint32_t> graph_ids(offsets.back());
+  std::vector<float> graph_dist(offsets.back());
+  std::vector<cy_uint> graph_flags(offsets.back());
+  
+#pragma omp parallel for num_threads(m_threads)
+  for (size_t i = 0; i < nobs; ++i) {
+    for (uint64_t e = offsets[i]; e < offsets[i + 1]; e++) {
+      const size_t slot = i * k_max + (e - offsets[i]);
+      const int row = slot_rows[slot];
+      graph_ids[e] = ids[row];
+      graph_dist[e] = slot_dist[slot];
+      graph_flags[e] = pflags[row];
     }
   }
-  cell_buffer.clear();
-#endif
+
+  // the new graph replaces any that was read in
+  m_table["spat"] = std::make_shared<GraphColumn>(std::move(offsets), std::move(graph_ids),
+						 std::move(graph_dist), std::move(graph_flags));
+  m_slots.graph = static_cast<GraphColumn*>(m_table.at("spat").get());
+  m_source_graph = false;
   
   if (m_verbose)
     std::cerr << "...done with graph construction" << std::endl;
-  
-  return;
-  
-  Tag gtag(Tag::GA_TAG, "spat", "NN:" + std::to_string(num_neighbors));
-  //gtag.addValue("NN", std::to_string(num_neighbors));
-  AddColumn(gtag, graph);
+
+  OutputTable();
 }
 
 void CellTable::UMAP(int num_neighbors) {
@@ -1598,35 +1518,189 @@ void CellTable::initialize_cols() {
     m_table[t.id] = std::make_shared<FloatCol>();
   }
 
-  
+  bind_slots();
 }
 
+void CellTable::bind_slots() {
+
+  // the only name lookups, until the header changes
+  m_slots.id    = static_cast<IntCol*>(m_table.at("id").get());
+  m_slots.pflag = static_cast<IntCol*>(m_table.at("pflag").get());
+  m_slots.cflag = static_cast<IntCol*>(m_table.at("cflag").get());
+  m_slots.x     = static_cast<FloatCol*>(m_table.at("x").get());
+  m_slots.y     = static_cast<FloatCol*>(m_table.at("y").get());
+  m_slots.graph = static_cast<GraphColumn*>(m_table.at("spat").get());
+
+  const std::vector<Tag> tags = m_header.GetDataTags();
+  m_slots.data.resize(tags.size());
+  for (size_t j = 0; j < tags.size(); j++)
+    m_slots.data[j] = static_cast<FloatCol*>(m_table.at(tags[j].id).get());
+}
+
+
+
+int CellTable::BuildTable(const std::string& file) {
+
+  // stdin and legacy files can't be mapped, so stream them
+  auto source = std::make_unique<MappedCysFile>();
+  MappedCysFile& mfile = *source;
+  mfile.SetBlockFilter(m_skip_block);
+  try {
+    if (!mfile.Open(file)) {
+      // the table adds its own PG tag (SetCmd) and writes its own output
+      BuildProcessor buildp;
+      buildp.SetCommonParams("", "", m_verbose);
+      return StreamTable(buildp, file);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Error while reading header: " << e.what() << std::endl;
+    return 1;
+  }
+
+  m_header = mfile.GetHeader();
+  initialize_cols();
+
+  // drop the columns the module doesn't need. They stay in the
+  // header, and are passed through from the mapped file on output
+  m_source.reset();
+  m_source_cols.clear();
+  m_source_graph = false;
+  if (m_project) {
+    size_t k = 0;
+    for (const auto& t : m_header.GetDataTags()) {
+      if (!m_project_cols.count(t.id)) {
+	m_table.erase(t.id);
+	m_source_cols[t.id] = k;
+      }
+      k++;
+    }
+    if (!m_project_graph) {
+      m_table.erase("spat");
+      m_source_graph = true;
+    }
+    if (m_verbose)
+      std::cerr << "...loading " << m_header.GetDataTags().size() - m_source_cols.size() <<
+	" of " << m_header.GetDataTags().size() << " data columns" <<
+	(m_project_graph ? "" : ", without the graph") << std::endl;
+  }
 
+  const size_t n = mfile.NumCells();
+  m_count = n;
+
+  if (m_verbose)
+    std::cerr << "...mapped " << AddCommas(n) << " cells in " <<
+      mfile.NumBlocks() << " blocks" << std::endl;
+
+  // size every column once, so each block can be copied
+  // straight into place from the mapped pages
+  IntCol* id_ptr    = static_cast<IntCol*>(m_table["id"].get());
+  IntCol* pflag_ptr = static_cast<IntCol*>(m_table["pflag"].get());
+  IntCol* cflag_ptr = static_cast<IntCol*>(m_table["cflag"].get());
+  FloatCol* x_ptr   = static_cast<FloatCol*>(m_table["x"].get());
+  FloatCol* y_ptr   = static_cast<FloatCol*>(m_table["y"].get());
+  GraphColumn* graph_ptr = m_source_graph ? nullptr :
+    static_cast<GraphColumn*>(m_table["spat"].get());
+
+  // null for columns that aren't loaded
+  std::vector<FloatCol*> data_ptrs;
+  for (const auto& t : m_header.GetDataTags()) {
+    auto it = m_table.find(t.id);
+    data_ptrs.push_back(it == m_table.end() ? nullptr : static_cast<FloatCol*>(it->second.get()));
+  }
+
+  // map the blocks, inflating them in parallel, and count the
+  // neighbors of each. Errors can't leave a parallel region, so the
+  // first is kept and thrown after
+  std::vector<uint64_t> edge_starts(mfile.NumBlocks() + 1, 0);
+  std::exception_ptr error;
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic)
+  for (size_t b = 0; b < mfile.NumBlocks(); b++) {
+    try {
+      const BlockView& view = mfile.GetBlock(b, graph_ptr != nullptr);
+      if (view.cols.size() != data_ptrs.size())
+	throw std::runtime_error("Block has " + std::to_string(view.cols.size()) +
+				 " data columns, header has " + std::to_string(data_ptrs.size()));
+      if (graph_ptr)
+	edge_starts[b + 1] = view.graph_offsets[view.size()] - view.graph_offsets[0];
+    } catch (...) {
+#pragma omp critical
+      if (!error)
+	error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+
+  for (auto& c : m_table)
+    c.second->resize(n);
+
+  // where the neighbors of each block start in the graph
+  for (size_t b = 0; b < mfile.NumBlocks(); b++)
+    edge_starts[b + 1] += edge_starts[b];
+  if (graph_ptr)
+    graph_ptr->resize(n, edge_starts.back());
+
+  // blocks are independent, so fill them in parallel. Each is released
+  // once copied, so an inflated file isn't held in memory for output
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic)
+  for (size_t b = 0; b < mfile.NumBlocks(); b++) {
+
+    try {
+      const BlockView& view = mfile.GetBlock(b, graph_ptr != nullptr);
+      const size_t start = mfile.BlockStart(b);
+      const size_t bn = view.size();
+
+      id_ptr->SetRange(start, view.ids.data, bn);
+      pflag_ptr->SetRange(start, view.pheno_flags.data, bn);
+      cflag_ptr->SetRange(start, view.cell_flags.data, bn);
+      x_ptr->SetRange(start, view.x.data, bn);
+      y_ptr->SetRange(start, view.y.data, bn);
+
+      for (size_t j = 0; j < data_ptrs.size(); j++)
+	if (data_ptrs[j])
+	  data_ptrs[j]->SetRange(start, view.cols[j].data, bn);
+
+      // the graph, straight into its CSR arrays
+      if (graph_ptr)
+	graph_ptr->SetRange(start, edge_starts[b], view.graph_offsets.data,
+			    view.graph_ids.data, view.graph_dist.data, bn);
+
+      mfile.ReleaseBlock(b);
+    } catch (...) {
+#pragma omp critical
+      if (!error)
+	error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+
+  // keep the mapping if OutputTable has columns to pass through
+  if (!m_source_cols.empty() || m_source_graph)
+    m_source = std::move(source);
+  
+  return 0;
+}
+
+void CellTable::SetProjection(const std::vector<std::string>& cols, bool graph) {
+  m_project = true;
+  m_project_cols = std::unordered_set<std::string>(cols.begin(), cols.end());
+  m_project_graph = graph;
+}
 
 int CellTable::StreamTable(CellProcessor& proc, const std::string& file) {
 
   bool build_table_memory = false;
   
-  std::istream *inputStream = nullptr;
-  std::unique_ptr<std::ifstream> fileStream;
-  
   // set input from file or stdin
-  if (file == "-") {
-    inputStream = &std::cin;
-  } else {
-    fileStream = std::make_unique<std::ifstream>(file, std::ios::binary);
-    if (!fileStream->good()) {
-      std::cerr << "Error opening: " << file<< " - file may not exist" << std::endl;
-      return 1;
-    }
-    inputStream = fileStream.get();
-  }
-
-  cereal::PortableBinaryInputArchive inputArchive(*inputStream);
+  CellReader reader;
+  reader.SetThreads(m_threads);
+  if (!reader.Open(file))
+    return 1;
 
   // First read the CellHeader
   try {
-    inputArchive(m_header);
+    reader.ReadHeader(m_header);
   } catch (const std::bad_alloc& e) {
     // Handle bad_alloc exception
     std::cerr << "Memory allocation failed during deserialization: " << e.what() << std::endl;
@@ -1635,6 +1709,9 @@ int CellTable::StreamTable(CellProcessor& proc, const std::string& file) {
     // Handle exception if any error occurs while deserializing header
     std::cerr << "Error while deserializing header: " << e.what() << std::endl;
     return 1;  // or handle the error appropriately for your program
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error while reading header: " << e.what() << std::endl;
+    return 1;
   }
   
   // process the header.
@@ -1646,40 +1723,130 @@ int CellTable::StreamTable(CellProcessor& proc, const std::string& file) {
     initialize_cols();
   }
   
-  // now read the Cell objects
-  while (true) {
-    Cell cell;
-    try {
-      m_count++;            
-      if (m_verbose && (m_count % 500000 == 0 || m_count == 1))
-	std::cerr << "...reading cell " << AddCommas(m_count) << std::endl;
-      inputArchive(cell);
-    } catch (const cereal::Exception& e) {
-      // Catch exception thrown on EOF or any other errors
+  // skip blocks that the zone maps rule out
+  reader.SetBlockFilter([&proc, this](const BlockStats& stats) {
+    return proc.SkipBlockStats(stats) || (m_skip_block && m_skip_block(stats));
+  });
+  
+  // with a sidecar index, only read the blocks the processor needs
+  CellIndex index;
+  std::vector<BlockIndexEntry> wanted;
+  bool seek = false;
+  if (reader.IsBlockFormat() && index.Read(file)) {
+    for (const auto& e : index.GetEntries())
+      if (!proc.SkipBlock(e))
+	wanted.push_back(e);
+    seek = wanted.size() < index.size();
+    if (m_verbose && seek)
+      std::cerr << "...index: reading " << wanted.size() << " of " << index.size() << " blocks" << std::endl;
+  }
+
+  // read and decode the next blocks while this one is processed
+  reader.SetReadAhead(!seek);
+  
+  // with threads, cells are handed out to copies of the processor
+  std::vector<std::unique_ptr<CellProcessor>> workers;
+  for (size_t t = 0; m_threads > 1 && t < m_threads; t++) {
+    auto w = proc.CloneWorker();
+    if (!w) {
+      workers.clear();
       break;
     }
-
-    // process the cell and output if needed (returns 1)
-    int val = proc.ProcessLine(cell);
+    workers.push_back(std::move(w));
+  }
+  if (m_verbose && workers.size())
+    std::cerr << "...processing cells on " << workers.size() << " threads" << std::endl;
+  
+  // output a processed cell, or note that the block has cells to store
+  bool save = false;
+  auto emit_cell = [&](Cell& cell, int val) {
+    m_count++;            
+    if (m_verbose && (m_count % 500000 == 0 || m_count == 1))
+      std::cerr << "...reading cell " << AddCommas(m_count) << std::endl;
+    
     if (val == CellProcessor::WRITE_CELL) {
       proc.OutputLine(cell);
-    } else if (val == CellProcessor::SAVE_CELL) {
-      build_table_memory = true;
-      add_cell_to_table(cell, false, false);
-    } else if (val == CellProcessor::SAVE_NODATA_CELL) {
-      build_table_memory = true;
-      add_cell_to_table(cell, true, false);
-    } else if (val == CellProcessor::SAVE_NODATA_NOGRAPH_CELL) {
-      build_table_memory = true;
-      add_cell_to_table(cell, true, true);
+    } else if (val == CellProcessor::SAVE_CELL ||
+	       val == CellProcessor::SAVE_NODATA_CELL ||
+	       val == CellProcessor::SAVE_NODATA_NOGRAPH_CELL) {
+      save = true; // added to the table with the rest of the block
     } else if (val == CellProcessor::NO_WRITE_CELL) {
       ; // do nothing
     } else {
       assert(false);
     }
+  };
+  
+  // now read the Cell objects, a block at a time. The cells
+  // are re-used from block to block, so their buffers are recycled
+#ifdef CYSIFT_COUNT_ALLOCS
+  const size_t allocations = AllocationCount();
+  const size_t count_start = m_count;
+#endif
+  CellBlock block;
+  std::vector<Cell> cells;
+  std::vector<int> vals;
+  size_t row = 0;
+  size_t next_block = 0;
+  while (!proc.Done()) {
+
+    if (seek) {
+      if (next_block >= wanted.size() || !reader.ReadBlockAt(wanted[next_block].offset, block))
+	break;
+      row = wanted[next_block].row_start;
+      next_block++;
+    } else if (!reader.ReadBlock(block)) {
+      break;
+    } else {
+      row = reader.LastBlockRow();
+    }
+
+    const size_t bn = block.size();
+    if (cells.size() < bn)
+      cells.resize(bn);
+    vals.resize(bn);
+
+    if (workers.empty()) {
+      proc.ProcessBlock(block, row, 0, bn, cells.data(), vals.data());
+    } else {
+
+      // process the block in parallel, one worker per thread
+      const size_t chunk = 1024;
+      std::string error;
+#pragma omp parallel for num_threads(workers.size()) schedule(dynamic)
+      for (size_t s = 0; s < bn; s += chunk) {
+	CellProcessor& w = *workers[omp_get_thread_num()];
+	try {
+	  w.ProcessBlock(block, row, s, std::min(s + chunk, bn), &cells[s], &vals[s]);
+	} catch (const std::exception& e) {
+#pragma omp critical
+	  error = e.what();
+	}
+      }
+      if (!error.empty())
+	throw std::runtime_error(error);
+    }
 
+    // output in order
+    save = false;
+    for (size_t i = 0; i < bn; i++)
+      emit_cell(cells[i], vals[i]);
+
+    if (save) {
+      build_table_memory = true;
+      add_cells_to_table(cells.data(), vals.data(), bn);
+    }
   }
 
+  for (const auto& w : workers)
+    proc.MergeWorker(*w);
+
+#ifdef CYSIFT_COUNT_ALLOCS
+  if (m_verbose)
+    std::cerr << "...streamed " << AddCommas(m_count - count_start) << " cells with " <<
+      AddCommas(AllocationCount() - allocations) << " heap allocations" << std::endl;
+#endif
+  
   if (!build_table_memory)
     return 0;
 
@@ -1712,6 +1879,78 @@ int CellTable::StreamTable(CellProcessor& proc, const std::string& file) {
   
 }
   
+void CellTable::ProcessTable(CellProcessor& proc) {
+
+  // the columns that weren't loaded only line up with the rows as loaded
+  if (m_source)
+    throw std::runtime_error("ProcessTable: table was loaded with only some columns");
+
+  const size_t numRows = CellCount();
+
+  CellHeader header = m_header;
+  if (proc.ProcessHeader(header) != CellProcessor::SAVE_HEADER)
+    throw std::runtime_error("ProcessTable: processor has to save its cells");
+
+  // the rows are read from the old columns as the new ones are filled
+  unordered_map<string, ColPtr> old_table;
+  old_table.swap(m_table);
+  const CellHeader old_header = m_header;
+
+  m_header = header;
+  initialize_cols();
+
+  auto id_ptr = old_table.at("id");
+  auto cflag_ptr = old_table.at("cflag");
+  auto pflag_ptr = old_table.at("pflag");  
+  auto x_ptr = old_table.at("x");
+  auto y_ptr = old_table.at("y");
+  auto g_ptr = old_table.find("spat");
+
+  std::vector<ColPtr> col_ptr;
+  for (const auto& t : old_header.GetDataTags())
+    col_ptr.push_back(old_table.at(t.id));
+
+  Cell cell;
+  for (size_t i = 0; i < numRows && !proc.Done(); i++) {
+
+    cell.m_id   = static_cast<IntCol*>(id_ptr.get())->GetNumericElem(i);
+    cell.m_cell_flag = static_cast<IntCol*>(cflag_ptr.get())->GetNumericElem(i);
+    cell.m_pheno_flag = static_cast<IntCol*>(pflag_ptr.get())->GetNumericElem(i);
+    cell.m_x    = static_cast<FloatCol*>(x_ptr.get())->GetNumericElem(i);
+    cell.m_y    = static_cast<FloatCol*>(y_ptr.get())->GetNumericElem(i);
+
+    cell.m_cols.clear();
+    for (const auto& c : col_ptr)
+      cell.m_cols.push_back(static_cast<FloatCol*>(c.get())->GetNumericElem(i));
+
+    cell.m_spatial_ids.clear();
+    cell.m_spatial_dist.clear();
+    cell.m_spatial_flags.clear();
+    if (g_ptr != old_table.end()) {
+      const GraphNode n = static_cast<GraphColumn*>(g_ptr->second.get())->GetNode(i);
+      cell.m_spatial_ids.assign(n.ids.begin(), n.ids.end());
+      cell.m_spatial_dist.assign(n.dist.begin(), n.dist.end());
+      cell.m_spatial_flags.assign(n.flags.begin(), n.flags.end());
+    }
+
+    proc.SetCurrentRow(i);
+    const int val = proc.ProcessLine(cell);
+    if (val == CellProcessor::SAVE_CELL) {
+      add_cell_to_table(cell, false, false);
+    } else if (val == CellProcessor::SAVE_NODATA_CELL) {
+      add_cell_to_table(cell, true, false);
+    } else if (val == CellProcessor::SAVE_NODATA_NOGRAPH_CELL) {
+      add_cell_to_table(cell, true, true);
+    } else if (val != CellProcessor::NO_WRITE_CELL) {
+      throw std::runtime_error("ProcessTable: processor has to save its cells");
+    }
+  }
+
+  if (m_verbose)
+    std::cerr << "...kept " << AddCommas(CellCount()) << " of " <<
+      AddCommas(numRows) << " cells" << std::endl;
+}
+  
 void CellTable::StreamTableCSV(LineProcessor& proc, const std::string& file) {
 
   // csv reader
@@ -1784,14 +2023,13 @@ void CellTable::StreamTableCSV(LineProcessor& proc, const std::string& file) {
 void CellTable::BuildKDTree() {
 
   pointVec points;
-  const auto x_ptr = m_table.find("x");
-  const auto y_ptr = m_table.find("y");
-  assert(x_ptr != m_table.end());
-  assert(y_ptr != m_table.end());
+  const ConstSpan<float> x = ColumnView<float>(m_table.at("x"));
+  const ConstSpan<float> y = ColumnView<float>(m_table.at("y"));
 
   // build the points vector
-  for (size_t i = 0; i < CellCount(); i++) {
-    points.push_back({ x_ptr->second->GetNumericElem(i), y_ptr->second->GetNumericElem(i)});
+  points.reserve(x.size());
+  for (size_t i = 0; i < x.size(); i++) {
+    points.push_back({ x[i], y[i] });
   }
   
   m_kdtree = KDTree(points);
@@ -1860,6 +2098,11 @@ int CellTable::RadialDensity(std::vector<cy_uint> inner, std::vector<cy_uint> ou
     ptr->resize(gc->size());
   }
 
+  // the density columns, filled in place
+  std::vector<float*> dc_data(dc.size());
+  for (size_t j = 0; j < dc.size(); j++)
+    dc_data[j] = dc[j]->Data();
+
   //shared_ptr<FloatCol> dc = std::make_shared<FloatCol>();  
   //dc->resize(gc->size());
   //dc->SetPrecision(2);
@@ -1873,8 +2116,9 @@ int CellTable::RadialDensity(std::vector<cy_uint> inner, std::vector<cy_uint> ou
   if (m_verbose)
     std::cerr << "...done loading, doing the flip" << std::endl;
   uint32_t max_cell_id = 0;
-  for (size_t i = 0; i < id_ptr->size(); ++i) {
-    uint32_t value = id_ptr->GetNumericElem(i);
+  const ConstSpan<cy_uint> ids = ColumnView<cy_uint>(id_ptr);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    uint32_t value = ids[i];
     inverse_lookup[value] = i;
     if (value > max_cell_id)
       max_cell_id = value;
@@ -1886,6 +2130,8 @@ int CellTable::RadialDensity(std::vector<cy_uint> inner, std::vector<cy_uint> ou
   //for (const auto& i : inverse_lookup)
   //  inverse_lookup_v[i.first] = i.second;
   
+  const ConstSpan<cy_uint> pflags = fc->View();
+
   if (m_verbose)
     std::cerr << "...radial density: starting loop" << std::endl;
   
@@ -1896,26 +2142,24 @@ int CellTable::RadialDensity(std::vector<cy_uint> inner, std::vector<cy_uint> ou
     // initialize the counts for each radial condition
     std::vector<float> cell_count(inner.size());
 
-    const CellNode& node = gc->GetNode(i);
-
-    const Neighbors& neigh = node.get_neighbors();
+    const GraphNode node = gc->GetNode(i);
 
     // loop the nodes connected to each cell
-    for (const auto& n : neigh) {
+    for (size_t k = 0; k < node.size(); k++) {
       
-      uint32_t cellindex = inverse_lookup[n.first];
+      uint32_t cellindex = inverse_lookup[node.ids[k]];
       
       // test if the connected cell meets the flag criteria
-      // n.first is cell_id of connected cell to this cell
+      // node.ids[k] is cell_id of connected cell to this cell
+      const float d = node.dist[k];
       for (size_t j = 0; j < inner.size(); j++) {
 	
 	// both are 0, so take all cells OR it meets flag criteria
-	CellFlag mflag(fc->GetNumericElem(cellindex))
-	  ;
+	CellFlag mflag(pflags[cellindex]);
 	if ( (!logor[j] && !logand[j]) || mflag.testAndOr(logor[j], logand[j])) {
 	  
 	  // then increment cell count if cell in bounds
-	  cell_count[j] += n.second >= inner[j] && n.second <= outer[j];
+	  cell_count[j] += d >= inner[j] && d <= outer[j];
 	  
 	}
       }
@@ -1932,11 +2176,11 @@ int CellTable::RadialDensity(std::vector<cy_uint> inner, std::vector<cy_uint> ou
     // do the density calculation for each condition
     // remember, i is iterator over cells, j is over conditions
     for (size_t j = 0; j < area.size(); ++j) {
-      if (!neigh.empty()) {
+      if (!node.empty()) {
 	float value = cell_count[j] * 1000000 / area[j]; // density per 1000 square pixels
-	dc[j]->SetNumericElem(value, i);
+	dc_data[j][i] = value;
       } else {
-	dc[j]->SetNumericElem(0, i); 
+	dc_data[j][i] = 0;
       }
     }
     
@@ -2015,8 +2259,9 @@ int CellTable::RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint>
   if (m_verbose)
     std::cerr << "...done loading, doing the flip" << std::endl;
   uint32_t max_cell_id = 0;
-  for (size_t i = 0; i < id_ptr->size(); ++i) {
-    uint32_t value = id_ptr->GetNumericElem(i);
+  const ConstSpan<cy_uint> ids = ColumnView<cy_uint>(id_ptr);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    uint32_t value = ids[i];
     inverse_lookup[value] = i;
     if (value > max_cell_id)
       max_cell_id = value;
@@ -2031,10 +2276,14 @@ int CellTable::RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint>
   BuildKDTree();
 
   //
-  const auto x_ptr = m_table.find("x");
-  const auto y_ptr = m_table.find("y");
-  assert(x_ptr != m_table.end());
-  assert(y_ptr != m_table.end());
+  const ConstSpan<float> x = ColumnView<float>(m_table.at("x"));
+  const ConstSpan<float> y = ColumnView<float>(m_table.at("y"));
+  const ConstSpan<cy_uint> pflags = fc->View();
+
+  // the density columns, filled in place
+  std::vector<float*> dc_data(dc.size());
+  for (size_t j = 0; j < dc.size(); j++)
+    dc_data[j] = dc[j]->Data();
 
   // get max radius to compute on
   cy_uint max_radius = 0;
@@ -2045,7 +2294,7 @@ int CellTable::RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint>
   // pre-compute the bools
   std::vector<std::vector<int>> flag_result(inner.size(), std::vector<int>(fc->size(), 0));
   for (size_t i = 0; i < fc->size(); i++) {
-    CellFlag mflag(fc->GetNumericElem(i));
+    CellFlag mflag(pflags[i]);
     for (size_t j = 0; j < inner.size(); j++) {
       if ( (!logor[j] && !logand[j]) || mflag.testAndOr(logor[j], logand[j])) {
 	flag_result[j][i] = 1; 
@@ -2060,8 +2309,8 @@ int CellTable::RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint>
     // initialize the counts for each radial condition
     std::vector<float> cell_count(inner.size());
 
-    float x1 = x_ptr->second->GetNumericElem(i);
-    float y1 = y_ptr->second->GetNumericElem(i);
+    float x1 = x[i];
+    float y1 = y[i];
     point_t pt = { x1, y1 }; 
 
     // this will be inclusive of this point
@@ -2070,8 +2319,8 @@ int CellTable::RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint>
     // loop the nodes connected to each cell
     for (const auto& n : inds) {
 
-      float x2 = x_ptr->second->GetNumericElem(n);
-      float y2 = y_ptr->second->GetNumericElem(n);
+      float x2 = x[n];
+      float y2 = y[n];
       float dx = x2 - x1;
       float dy = y2 - y1;
       float dist = std::sqrt(dx*dx + dy*dy);
@@ -2100,9 +2349,9 @@ int CellTable::RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint>
     for (size_t j = 0; j < area.size(); ++j) {
       if (!inds.empty()) {
 	float value = cell_count[j] * 1000000 / area[j]; // density per 1000 square pixels
-	dc[j]->SetNumericElem(value, i);
+	dc_data[j][i] = value;
       } else {
-	dc[j]->SetNumericElem(0, i); 
+	dc_data[j][i] = 0;
       }
     }
 
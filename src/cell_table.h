@@ -1,11 +1,16 @@
 #pragma once
 #include <functional>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "csv.h"
 #include "cell_column.h"
 #include "polygon.h"
 #include "cell_header.h"
+#include "cell_mmap.h"
 #include "cell_processor.h"
+#include "cell_reader.h"
+#include "cell_writer.h"
 #include "cysift.h"
 
 #include "tiff_writer.h"
@@ -15,6 +20,25 @@
 
 #include "KDTree.hpp"
 
+/**
+ * @struct TableSlots
+ * @brief The columns of a CellTable, resolved by position for its header
+ *
+ * Typed pointers to the fixed columns and to each data column, in header
+ * data tag order, looked up by name once when the columns are set up.
+ * Cells are then added without a name lookup or a copy of the tags.
+ * The columns are owned by the table.
+ */
+struct TableSlots {
+  IntCol* id = nullptr;
+  IntCol* pflag = nullptr;
+  IntCol* cflag = nullptr;
+  FloatCol* x = nullptr;
+  FloatCol* y = nullptr;
+  GraphColumn* graph = nullptr;
+  std::vector<FloatCol*> data;
+};
+
 class CellTable {
   
 public:
@@ -23,7 +47,9 @@ public:
 
   //  CellTable(CellRowFunc func);
 
-  void BuildTable(const std::string& file);
+  // read the whole file into memory. Block-formatted files are
+  // memory-mapped and read a column at a time, others are streamed
+  int BuildTable(const std::string& file);
 
   void StreamTableCSV(LineProcessor& proc, const std::string& file);
 
@@ -32,6 +58,10 @@ public:
   void sortxy(bool reverse);
 
   void sort(const std::string& field, bool reverse);
+
+  // sort cells along a space-filling curve over their bounding box,
+  // so that cells near each other in (x,y) are near each other in the table
+  void sortcurve(kernels::SpaceCurve curve, bool reverse);
   
   // add columns
   void AddColumn(const Tag& tag, ColPtr value);
@@ -45,6 +75,25 @@ public:
   
   void SetThreads(size_t threads) { m_threads = threads; }
 
+  // block compression for .cys output
+  void SetCodec(const CysCodec& codec) { m_codec = codec; }
+
+  // write a sidecar index for .cys output
+  void SetIndex(bool index) { m_index = index; }
+
+  // how .cys output stores the spatial graph (CYS_GRAPH_VARINT by default)
+  void SetGraphEncoding(uint32_t encoding) { m_graph_encoding = encoding; }
+
+  // load only these data columns, and the spatial graph if graph is true.
+  // Only applies when the input can be memory mapped. Columns left out
+  // are copied from the input by OutputTable, so the table must keep
+  // its rows as loaded
+  void SetProjection(const std::vector<std::string>& cols, bool graph);
+
+  // when reading a block-formatted .cys, leave out whole blocks whose
+  // zone map this returns true for
+  void SetBlockFilter(std::function<bool(const BlockStats&)> skip) { m_skip_block = std::move(skip); }
+
   void SetPrintHeader() { m_print_header = true; }
 
   void SetHeaderOnly() { m_header_only = true; }
@@ -86,6 +135,7 @@ public:
   // graph ops
   void UMAP(int num_neighbors);
 
+  // build the spatial KNN graph as the spat column, and output the table
   void KNN_spatial(int num_neighbors, int dist);  
 
   void Delaunay(const std::string& pdf_delaunay,
@@ -114,6 +164,11 @@ public:
 
   int StreamTable(CellProcessor& proc, const std::string& file);
 
+  // run the rows of the table through a processor that saves its cells
+  // (e.g. a ChainProcessor with SetSave), and rebuild the table from the
+  // cells it saves, under the header it outputs
+  void ProcessTable(CellProcessor& proc);
+
   void OutputTable();
 
   int RadialDensityKD(std::vector<cy_uint> inner, std::vector<cy_uint> outer,
@@ -132,8 +187,10 @@ public:
   
   unordered_map<string, ColPtr> m_table;
 
-  std::unique_ptr<std::ofstream> m_os;
-  std::unique_ptr<cereal::PortableBinaryOutputArchive> m_archive;
+  // m_table by position, for adding cells
+  TableSlots m_slots;
+
+  std::unique_ptr<CellWriter> m_writer;
 
   CellHeader m_header;
 
@@ -147,14 +204,39 @@ public:
   bool m_header_only = false;
   bool m_print_header = false;
   size_t m_threads = 1;
+  CysCodec m_codec;
+  bool m_index = false;
+  uint32_t m_graph_encoding = CYS_GRAPH_VARINT;
+  std::function<bool(const BlockStats&)> m_skip_block;
+
+  // column projection
+  bool m_project = false;
+  bool m_project_graph = true;
+  std::unordered_set<std::string> m_project_cols;
+
+  // mapped input, for the columns that were not loaded
+  std::unique_ptr<MappedCysFile> m_source;
+  std::unordered_map<std::string, size_t> m_source_cols; // tag id -> column in the input
+  bool m_source_graph = false;
   
   // internal member functions
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
   void initialize_cols();
+
+  // point m_slots at the columns of m_table for m_header
+  void bind_slots();
   
   void add_cell_to_table(const Cell& cell, bool nodata, bool nograph);
 
+  // re-order every column so that row i is old row order[i],
+  // with the columns spread over m_threads
+  void order_rows(const std::vector<size_t>& order);
+
+  // add the cells whose vals (from ProcessBlock) say to save them,
+  // one column at a time
+  void add_cells_to_table(const Cell* cells, const int* vals, size_t n);
+
   void print_correlation_matrix(const std::vector<std::pair<std::string, const ColPtr>>& data,
 				const std::vector<std::vector<float>>& correlation_matrix, bool sort) const;
 
@@ -163,6 +245,9 @@ public:
 
 struct RadialSelector {
 
+  RadialSelector(cy_uint inner, cy_uint outer, cy_uint logor, cy_uint logand,
+		 const std::string& l) : int_data({inner, outer, logor, logand}), label(l) {}
+
   explicit RadialSelector(const std::string& line) {
 
     std::vector<std::string> tokens = split(line, ',');
@@ -5,6 +5,38 @@
 #include <limits>
 #include <cmath>
 #include <fstream>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// count heap allocations, for AllocationCount. Only in debug builds
+// with CYSIFT_COUNT_ALLOCS, since it replaces the global operator new
+#ifdef CYSIFT_COUNT_ALLOCS
+static std::atomic<size_t> g_allocations(0);
+
+void* operator new(std::size_t n) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+size_t AllocationCount() {
+  return g_allocations.load(std::memory_order_relaxed);
+}
+#else
+size_t AllocationCount() {
+  return 0;
+}
+#endif
 
 void column_to_row_major(std::vector<float>& data, int nobs, int ndim) {
 
@@ -34,6 +34,12 @@ template <typename T> inline std::string AddCommas(T data) {
   return s;
 }
 
+/** Number of heap allocations made through operator new so far,
+ * to keep an eye on allocations in the streaming path. Always 0
+ * unless built with CYSIFT_COUNT_ALLOCS
+ */
+size_t AllocationCount();
+
 void column_to_row_major(std::vector<float>& data, int nobs, int ndim);
 
 PhenoMap phenoread(const std::string& filename);
@@ -0,0 +1,327 @@
+#include "cell_writer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <cereal/archives/portable_binary.hpp>
+
+CellWriter::CellWriter(const std::string& file) : m_file(file) {
+
+  // set the output to file or stdout
+  if (IsArrowFile(file)) {
+    m_arrow = std::make_unique<ArrowWriter>(file);
+  } else if (file == "-") {
+    m_out = &std::cout;
+  } else {
+    m_os = std::make_unique<std::ofstream>(file, std::ios::binary);
+    if (!m_os->good())
+      throw std::runtime_error("Unable to open output file: " + file);
+    m_out = m_os.get();
+  }
+
+}
+
+CellWriter::~CellWriter() {
+
+  // finish the stream if the caller didn't. Don't throw from a destructor
+  try {
+    Close();
+  } catch (const std::exception& e) {
+    std::cerr << "Error closing .cys output: " << e.what() << std::endl;
+  }
+}
+
+void CellWriter::WriteHeader(const CellHeader& header) {
+
+  if (m_header_written)
+    throw std::runtime_error("CellWriter: header already written");
+
+  if (m_arrow) {
+    m_arrow->SetCodec(m_codec);
+    m_arrow->WriteHeader(header);
+    m_num_cols = header.GetDataTags().size();
+    m_block.Init(m_num_cols);
+    if (m_reserve)
+      m_block.reserve(CYS_BLOCK_SIZE);
+    m_header_written = true;
+    return;
+  }
+
+  // serialize the header on its own, so we know its size
+  std::ostringstream oss(std::ios::binary);
+  {
+    cereal::PortableBinaryOutputArchive oarchive(oss);
+    oarchive(header);
+  }
+  const std::string hdr = oss.str();
+  const uint64_t hdr_size = hdr.size();
+
+  write_bytes(CYS_MAGIC, sizeof(CYS_MAGIC));
+  write_bytes(reinterpret_cast<const char*>(&hdr_size), sizeof(hdr_size));
+  write_bytes(hdr.data(), hdr.size());
+  write_padding();
+
+  // cells will come with one value for each data tag
+  m_num_cols = header.GetDataTags().size();
+  m_block.Init(m_num_cols);
+  if (m_reserve)
+    m_block.reserve(CYS_BLOCK_SIZE);
+  m_file_stats.Init(header.GetDataTags().size());
+
+  m_header_written = true;
+}
+
+void CellWriter::WriteCell(const Cell& cell) {
+
+  assert(m_header_written);
+
+  m_block.AddCell(cell);
+
+  if (m_block.size() >= CYS_BLOCK_SIZE)
+    flush_block();
+}
+
+void CellWriter::WriteBlock(CellBlock& block) {
+
+  assert(m_header_written);
+
+  if (block.NumCols() != m_num_cols)
+    throw std::runtime_error("CellWriter: block has " + std::to_string(block.NumCols()) +
+			     " data columns, header has " + std::to_string(m_num_cols));
+
+  // cells written one at a time so far go in their own row group
+  flush_block();
+
+  std::swap(block, m_block);
+  flush_block();
+  std::swap(block, m_block);
+}
+
+void CellWriter::Close() {
+
+  if (m_closed || !m_header_written)
+    return;
+  m_closed = true;
+
+  flush_block();
+
+  if (m_arrow) {
+    m_arrow->Close();
+    return;
+  }
+
+  stop_worker();
+  if (m_error)
+    std::rethrow_exception(m_error);
+  
+  write_pending();
+
+  // the footer, found from the end frame
+  std::string footer;
+  m_file_stats.Encode(footer);
+  const uint64_t footer_offset = m_offset;
+  BlockFrame footer_frame;
+  footer_frame.type = CYS_FRAME_FOOTER;
+  footer_frame.raw_size = footer_frame.stored_size = footer.size();
+  write_frame(footer_frame, footer);
+  
+  // the end frame
+  BlockFrame frame;
+  frame.type = CYS_FRAME_END;
+  frame.raw_size = footer_offset;
+  write_frame(frame, std::string());
+
+  m_out->flush();
+
+  // the index is optional, so only warn if it can't be written
+  if (m_os && m_write_index) {
+    try {
+      m_index.Write(m_file);
+    } catch (const std::exception& e) {
+      std::cerr << "Warning: " << e.what() << std::endl;
+    }
+  }
+}
+
+void CellWriter::flush_block() {
+
+  if (!m_block.size())
+    return;
+
+  // Arrow takes the columns of the block as they are
+  if (m_arrow) {
+    m_arrow->WriteBlock(m_block);
+    m_block.clear();
+    return;
+  }
+
+  if (!m_background) {
+    encode_block(m_block);
+    return;
+  }
+
+  if (!m_worker.joinable()) {
+    m_queue.SetCapacity(2);
+    m_free.SetCapacity(2);
+    m_worker = std::thread(&CellWriter::write_worker, this);
+  }
+
+  // swap in a written block to fill next
+  CellBlock next;
+  if (!m_free.TryPop(next)) {
+    next.Init(m_num_cols);
+    next.reserve(CYS_BLOCK_SIZE);
+  }
+  std::swap(next, m_block);
+
+  if (!m_queue.Push(std::move(next))) {
+    stop_worker();
+    if (m_error)
+      std::rethrow_exception(m_error);
+    throw std::runtime_error("CellWriter: writer thread stopped taking blocks");
+  }
+}
+
+void CellWriter::write_worker() {
+
+  CellBlock block;
+  try {
+    while (m_queue.Pop(block)) {
+      encode_block(block);
+      m_free.TryPush(std::move(block));
+    }
+  } catch (...) {
+    // stop taking blocks, and let the next flush_block or Close throw
+    m_error = std::current_exception();
+    m_queue.Close();
+  }
+}
+
+void CellWriter::stop_worker() {
+
+  if (!m_worker.joinable())
+    return;
+
+  m_queue.Close();
+  m_worker.join();
+  m_queue.Reset();
+  m_free.Reset();
+}
+
+void CellWriter::encode_block(CellBlock& block) {
+
+  if (m_pending.size() <= m_num_pending) {
+    m_pending.resize(m_num_pending + 1);
+    m_pending_entries.resize(m_num_pending + 1);
+    m_pending_stats.resize(m_num_pending + 1);
+  }
+
+  block.SetGraphEncoding(m_graph_encoding);
+  block.Encode(m_pending[m_num_pending]);
+
+  m_stats.Compute(block);
+  m_stats.Encode(m_pending_stats[m_num_pending]);
+  m_file_stats.Add(block, m_stats);
+
+  BlockIndexEntry& entry = m_pending_entries[m_num_pending];
+  entry.num_cells = block.size();
+  auto mm = std::minmax_element(block.m_ids.begin(), block.m_ids.end());
+  entry.min_id = *mm.first;
+  entry.max_id = *mm.second;
+  
+  m_num_pending++;
+
+  block.clear();
+
+  if (m_codec.id == CYS_CODEC_NONE || m_num_pending >= m_threads)
+    write_pending();
+}
+
+void CellWriter::write_pending() {
+
+  if (!m_num_pending)
+    return;
+
+  const bool compress = m_codec.id != CYS_CODEC_NONE;
+
+  // blocks are independent, so compress them in parallel
+  if (compress) {
+    
+    if (m_compressed.size() < m_num_pending)
+      m_compressed.resize(m_num_pending);
+
+    std::string error;
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic)
+    for (size_t i = 0; i < m_num_pending; i++) {
+      try {
+	CodecCompress(m_codec, m_pending[i], m_compressed[i]);
+      } catch (const std::exception& e) {
+#pragma omp critical
+	error = e.what();
+      }
+    }
+    if (!error.empty())
+      throw std::runtime_error(error);
+  }
+
+  // write them out in order
+  for (size_t i = 0; i < m_num_pending; i++) {
+
+    BlockIndexEntry& entry = m_pending_entries[i];
+    entry.offset = m_offset;
+    entry.row_start = m_rows;
+    m_rows += entry.num_cells;
+    m_index.AddBlock(entry);
+
+    // the zone map goes first, so readers can skip the block
+    BlockFrame stats;
+    stats.type = CYS_FRAME_STATS;
+    stats.num_cells = entry.num_cells;
+    stats.raw_size = stats.stored_size = m_pending_stats[i].size();
+    write_frame(stats, m_pending_stats[i]);
+
+    BlockFrame frame;
+    frame.type = CYS_FRAME_BLOCK;
+    frame.num_cells = entry.num_cells;
+    frame.raw_size = m_pending[i].size();
+
+    // keep the raw block if it didn't compress
+    if (compress && m_compressed[i].size() < m_pending[i].size()) {
+      frame.codec = m_codec.id;
+      frame.stored_size = m_compressed[i].size();
+      write_frame(frame, m_compressed[i]);
+    } else {
+      frame.stored_size = m_pending[i].size();
+      write_frame(frame, m_pending[i]);
+    }
+  }
+
+  m_num_pending = 0;
+}
+
+void CellWriter::write_frame(const BlockFrame& frame, const std::string& payload) {
+
+  assert(m_offset % CYS_ALIGN == 0);
+
+  write_bytes(reinterpret_cast<const char*>(&frame), sizeof(BlockFrame));
+  write_bytes(payload.data(), payload.size());
+  write_padding();
+}
+
+void CellWriter::write_bytes(const char* data, size_t n) {
+
+  m_out->write(data, n);
+  if (!m_out->good())
+    throw std::runtime_error("CellWriter: error writing output");
+  m_offset += n;
+}
+
+void CellWriter::write_padding() {
+
+  static const char zeros[CYS_ALIGN] = {0};
+  size_t pad = cys_pad(m_offset) - m_offset;
+  if (pad)
+    write_bytes(zeros, pad);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "cell_arrow.h"
+#include "cell_block.h"
+#include "cell_codec.h"
+#include "cell_header.h"
+#include "cell_index.h"
+#include "cell_queue.h"
+#include "cell_row.h"
+
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+/**
+ * @class CellWriter
+ * @brief Writes a block-formatted .cys file
+ *
+ * Cells are buffered into CellBlock row groups of CYS_BLOCK_SIZE cells,
+ * and each full block is written out as a single frame. The stream is
+ * finished with an end frame on Close() (or when the writer is destroyed).
+ *
+ * With a codec set, encoded blocks are held until there is one per thread,
+ * then compressed in parallel and written in order.
+ *
+ * Each block frame is preceded by a stats frame holding its BlockStats
+ * zone map, and index entries point at the stats frame. A FileStats
+ * footer for the whole file is written just before the end frame.
+ *
+ * In the background mode, full blocks are handed to a writer thread that
+ * encodes, compresses and writes them while the next block is filled.
+ *
+ * With SetIndex, a sidecar CellIndex (<file>.idx) is written on Close() when
+ * writing to a file.
+ *
+ * Files named .arrow, .arrows or .feather are written as Arrow IPC instead
+ * (see ArrowWriter), one record batch per block, so any module can output
+ * Arrow just by the name of its output file.
+ */
+class CellWriter {
+
+ public:
+
+  // file is a path, or "-" for stdout
+  explicit CellWriter(const std::string& file);
+
+  ~CellWriter();
+
+  CellWriter(const CellWriter&) = delete;
+  CellWriter& operator=(const CellWriter&) = delete;
+
+  // compress the blocks with this codec. Set before writing any cells
+  void SetCodec(const CysCodec& codec) { m_codec = codec; }
+
+  // how the spatial graph is stored (CYS_GRAPH_VARINT by default)
+  void SetGraphEncoding(uint32_t encoding) { m_graph_encoding = encoding; }
+
+  // number of blocks to compress at once
+  void SetThreads(size_t threads) { m_threads = threads ? threads : 1; }
+
+  // write the sidecar index (<file>.idx) on Close. Off by default
+  void SetIndex(bool index) { m_write_index = index; }
+
+  // encode and write blocks on a separate thread. Set before writing any cells
+  void SetBackground(bool background) { m_background = background; }
+
+  // reserve room for a whole block at WriteHeader (the default). Off for
+  // writers that may only get a few cells, so the block grows as needed
+  void SetReserve(bool reserve) { m_reserve = reserve; }
+
+  void WriteHeader(const CellHeader& header);
+
+  void WriteCell(const Cell& cell);
+
+  // write a whole block of cells as its own row group. The block is
+  // swapped out for an empty one, to be filled again by the caller
+  void WriteBlock(CellBlock& block);
+
+  // flush the last block and write the end frame
+  void Close();
+
+ private:
+
+  std::string m_file;
+  std::unique_ptr<std::ofstream> m_os;
+
+  // Arrow output, in place of the .cys frames
+  std::unique_ptr<ArrowWriter> m_arrow;
+  std::ostream* m_out = nullptr;
+
+  // index of the blocks written so far
+  CellIndex m_index;
+  bool m_write_index = false;
+  uint64_t m_rows = 0;
+
+  // the current row group
+  CellBlock m_block;
+  size_t m_num_cols = 0;
+  uint32_t m_graph_encoding = CYS_GRAPH_VARINT;
+  bool m_reserve = true;
+  BlockStats m_stats;
+  FileStats m_file_stats;
+
+  CysCodec m_codec;
+  size_t m_threads = 1;
+
+  // encoded blocks waiting to be compressed and written.
+  // Buffers are re-used, so only the first m_num_pending are live
+  std::vector<std::string> m_pending;
+  std::vector<BlockIndexEntry> m_pending_entries;
+  std::vector<std::string> m_pending_stats;
+  std::vector<std::string> m_compressed;
+  size_t m_num_pending = 0;
+
+  // bytes written so far, to keep frames aligned
+  uint64_t m_offset = 0;
+
+  bool m_header_written = false;
+  bool m_closed = false;
+
+  // background writer thread, fed full blocks through m_queue.
+  // Written blocks come back through m_free to be re-used
+  bool m_background = false;
+  std::thread m_worker;
+  BoundedQueue<CellBlock> m_queue;
+  BoundedQueue<CellBlock> m_free;
+  std::exception_ptr m_error;
+
+  // hand off the current block, to be encoded and written
+  void flush_block();
+
+  // encode a block and queue it for compression and writing
+  void encode_block(CellBlock& block);
+
+  // run by the writer thread
+  void write_worker();
+
+  // wait for the writer thread to finish everything queued
+  void stop_worker();
+
+  void write_pending();
+
+  void write_frame(const BlockFrame& frame, const std::string& payload);
+
+  void write_bytes(const char* data, size_t n);
+
+  void write_padding();
+
+};
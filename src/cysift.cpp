@@ -1,4 +1,5 @@
 #include "cell_column.h"
+#include "cell_csv.h"
 #include "cell_table.h"
 #include "cell_processor.h"
 #include "cell_lda.h"
@@ -7,6 +8,8 @@
 #include <getopt.h>
 #include <ctime>
 #include <regex>
+#include <optional>
+#include <thread>
 
 #include "cell_row.h"
 #include "tiff_reader.h"
@@ -36,6 +39,15 @@ namespace opt {
   static int n = 0;
 
   static bool sort = false;
+
+  // block compression for .cys output
+  static CysCodec codec;
+
+  // write a sidecar index for .cys output
+  static bool index = false;
+
+  // storage of the spatial graph in .cys output
+  static uint32_t graph_encoding = CYS_GRAPH_VARINT;
 }
 
 #define DEBUG(x) std::cerr << #x << " = " << (x) << std::endl
@@ -51,10 +63,22 @@ static bool in_out_process(int argc, char** argv);
 // process in cmd arguments
 static bool in_only_process(int argc, char** argv);
 
+// parse the --ids argument of select
+static std::vector<uint32_t> read_id_list(const std::string& arg);
+
 static CellTable table;
 
 static void build_table();
 
+// read the header and FileStats footer of the input, if it has one
+static bool read_footer(CellHeader& header, FileStats& stats);
+
+// read the rings of radialdens from a file of r,R,o,a,l lines. Empty if no file
+static std::vector<RadialSelector> read_radial_file(const std::string& file);
+
+// run RadialDensityKD on the table, with one ring per selector
+static void radial_density(const std::vector<RadialSelector>& rsv);
+
 static const char* shortopts = "jhHNyvmMPr:e:g:G:t:a:i:A:O:d:b:c:s:k:n:r:w:l:L:x:X:o:R:f:D:V:";
 static const struct option longopts[] = {
   { "verbose",                    no_argument, NULL, 'v' },
@@ -69,6 +93,17 @@ static const struct option longopts[] = {
   { "strict-cut",                 required_argument, NULL, 'X' },    
   //{ "sort",                       no_argument, NULL, 'y' },  
   { "csv",                        no_argument, NULL, 'j'},
+  { "codec",                      required_argument, NULL, 'Z' },
+  { "ids",                        required_argument, NULL, 'I' },
+  { "rows",                       required_argument, NULL, 'W' },
+  { "tsv",                        no_argument, NULL, 'T' },
+  { "fixed",                      no_argument, NULL, 'F' },
+  { "gzip",                       required_argument, NULL, 'z' },
+  { "graph",                      no_argument, NULL, 'K' },
+  { "halo",                       required_argument, NULL, 'Q' },
+  { "curve",                      required_argument, NULL, 'U' },
+  { "index",                      no_argument, NULL, 'B' },
+  { "raw-graph",                  no_argument, NULL, 'E' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -81,7 +116,7 @@ static const char *RUN_USAGE_MESSAGE =
 "  clean      - Removes data to decrease disk size\n"
 "  delaunay   - Calculate the Delaunay triangulation\n"
 "  average    - Average all of the data columns\n"  
-  //"  cat        - Concatenate multiple samples\n"
+"  cat        - Concatenate multiple samples\n"
 "  sort       - Sort the cells\n"
 "  subsample  - Subsample cells randomly\n"
   //"  plot       - Generate an ASCII style plot\n"
@@ -97,7 +132,12 @@ static const char *RUN_USAGE_MESSAGE =
 "  pheno      - Phenotype cells to set the flag\n"
 "  convolve   - Density convolution to produce TIFF\n"
 "  radialdens - Calculate density of cells within a radius\n"
-"  cereal     - Create a .cys format file from a CSV\n"
+"  cereal     - Create a .cys format file from a CSV or .h5ad\n"
+"  index      - Build the sidecar index of a .cys file, for fast seeking\n"
+"  run        - Run a pipeline of modules in one process\n"
+"  h5ad       - Export the cells to an AnnData .h5ad file\n"
+"  split      - Split into spatial tiles (with halo cells) to process separately\n"
+"  merge      - Stitch the tiles of split back together\n"
 "\n";
 
 static int sortfunc(int argc, char** argv);
@@ -129,6 +169,11 @@ static int radiusfunc(int argc, char** argv);
 static int selectfunc(int argc, char** argv);
 static int spatialfunc(int argc, char** argv); 
 static int phenofunc(int argc, char** argv);
+static int indexfunc(int argc, char** argv);
+static int runfunc(int argc, char** argv);
+static int h5adfunc(int argc, char** argv);
+static int splitfunc(int argc, char** argv);
+static int mergefunc(int argc, char** argv);
 
 static void parseRunOptions(int argc, char** argv);
 
@@ -213,6 +258,16 @@ int main(int argc, char **argv) {
     val = delaunayfunc(argc, argv);
   } else if (opt::module == "pheno") {
     val = phenofunc(argc, argv);
+  } else if (opt::module == "index") {
+    return(indexfunc(argc, argv));
+  } else if (opt::module == "run") {
+    return(runfunc(argc, argv));
+  } else if (opt::module == "h5ad") {
+    return(h5adfunc(argc, argv));
+  } else if (opt::module == "split") {
+    return(splitfunc(argc, argv));
+  } else if (opt::module == "merge") {
+    return(mergefunc(argc, argv));
   } else if (opt::module == "count") {
     countfunc(argc, argv);
   } else {
@@ -222,6 +277,26 @@ int main(int argc, char **argv) {
   return 0;
 }
 
+// parse a --codec argument, as a usage error rather than a throw from the option loop
+static void parse_codec(const std::string& spec) {
+  try {
+    opt::codec = ParseCodec(spec);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    die = true;
+  }
+}
+
+// parse a --curve argument, as a usage error like parse_codec
+static void parse_curve(const std::string& name, std::optional<kernels::SpaceCurve>& curve) {
+  try {
+    curve = kernels::ParseCurve(name);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    die = true;
+  }
+}
+
 // build the table into memory
 static void build_table() {
 
@@ -232,14 +307,50 @@ static void build_table() {
   if (opt::threads > 1)
     table.SetThreads(opt::threads);
 
-  // stream into memory
-  BuildProcessor buildp;
-  buildp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
-  table.StreamTable(buildp, opt::infile);
+  table.SetCodec(opt::codec);
+  table.SetIndex(opt::index);
+  table.SetGraphEncoding(opt::graph_encoding);
+
+  // read into memory
+  int val = 1;
+  try {
+    val = table.BuildTable(opt::infile);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+  }
+  if (val) {
+    std::cerr << "Error: unable to read " << opt::infile << std::endl;
+    exit(EXIT_FAILURE);
+  }
   
   table.SetCmd(cmd_input);
 }
 
+static bool read_footer(CellHeader& header, FileStats& stats) {
+
+  // stdin can only be read once, so leave it to the streaming path
+  if (opt::infile == "-")
+    return false;
+
+  // an unreadable file is reported by the streaming path instead
+  CellReader reader;
+  try {
+    if (!reader.Open(opt::infile))
+      return false;
+    reader.ReadHeader(header);
+    if (!reader.ReadFooter(stats))
+      return false;
+  } catch (const std::exception& e) {
+    if (opt::verbose)
+      std::cerr << "...unable to use the file footer: " << e.what() << std::endl;
+    return false;
+  }
+
+  if (opt::verbose)
+    std::cerr << "...using the file footer of " << opt::infile << std::endl;
+  return true;
+}
+
 static int convolvefunc(int argc, char** argv) {
  
   int width = 200;
@@ -276,6 +387,7 @@ static int convolvefunc(int argc, char** argv) {
   // build the table
   // but don't have to convert columns
   // since we don't use pre-existing Graph or Flags for this
+  table.SetProjection({}, false);
   build_table();
 
   // check we were able to read the table
@@ -317,6 +429,9 @@ static int umapfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 't' : arg >> opt::threads; break;
     case 'k' : arg >> n; break;
     default: die = true;
@@ -331,6 +446,9 @@ static int umapfunc(int argc, char** argv) {
       "    csvfile: filepath or a '-' to stream to stdin\n"
       "    -k [15]                   Number of neighbors\n"
       "    -t [1]                    Number of threads\n"      
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -399,6 +517,10 @@ static int cleanfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'm' : clean_markers = true; break;
     case 'M' : clean_meta = true; break;
     case 'P' : clean_graph = true; clean_markers = true; clean_meta = true; break;      
@@ -412,10 +534,14 @@ static int cleanfunc(int argc, char** argv) {
       "Usage: cysift clean [csvfile]\n"
       "  Clean up the data to reduce disk space\n"
       "    <file>: filepath or a '-' to stream to stdin\n"
-      "    -m,          Remove all marker data\n"
-      "    -M,          Remove all meta data\n"
-      "    -P,          Remove all graph data\n"      
-      "    -A,          Remove all data\n"      
+      "    -m                        Remove all marker data\n"
+      "    -M                        Remove all meta data\n"
+      "    -P                        Remove all graph data\n"      
+      "    -A                        Remove all data\n"      
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -423,6 +549,10 @@ static int cleanfunc(int argc, char** argv) {
   
   CleanProcessor cleanp;
   cleanp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  cleanp.SetCompression(opt::codec, opt::threads);
+  cleanp.SetIndex(opt::index);
+  cleanp.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
   cleanp.SetParams(clean_graph, clean_meta, clean_markers);  
 
   // process 
@@ -434,14 +564,104 @@ static int cleanfunc(int argc, char** argv) {
   
 }
 
+// read the inputs of cat each on its own thread, with up to threads inputs
+// read ahead at once, and hand their blocks to catp in input order
+static void cat_inputs(CatProcessor& catp, const std::vector<int>& sample_nums) {
+
+  const size_t n = opt::infile_vec.size();
+  const size_t window = std::max<size_t>(1, std::min<size_t>(opt::threads, n));
+
+  // read every header first, so a mismatch is found before writing anything
+  std::vector<std::unique_ptr<CellReader>> readers(n);
+  for (size_t i = 0; i < n; i++) {
+    readers[i] = std::make_unique<CellReader>();
+    readers[i]->SetThreads(std::max<size_t>(1, opt::threads / window));
+    if (!readers[i]->Open(opt::infile_vec.at(i)))
+      throw std::runtime_error("Unable to open " + opt::infile_vec.at(i));
+    
+    CellHeader header;
+    readers[i]->ReadHeader(header);
+    catp.ProcessHeader(header);
+  }
+
+  // each input fills its own queue of decoded blocks
+  struct CatInput {
+    BoundedQueue<CellBlock> queue;
+    std::thread worker;
+    std::exception_ptr error;
+  };
+  std::vector<CatInput> inputs(n);
+
+  auto start = [&](size_t i) {
+    if (opt::verbose)
+      std::cerr << "...reading " << opt::infile_vec.at(i) << std::endl;
+    inputs[i].worker = std::thread([&, i] {
+      try {
+	CellBlock block;
+	while (readers[i]->ReadBlock(block)) {
+	  if (!inputs[i].queue.Push(std::move(block)))
+	    break;
+	  block = CellBlock();
+	}
+      } catch (...) {
+	inputs[i].error = std::current_exception();
+      }
+      inputs[i].queue.Close();
+    });
+  };
+
+  auto stop_all = [&] {
+    for (auto& in : inputs) {
+      in.queue.Close();
+      if (in.worker.joinable())
+	in.worker.join();
+    }
+  };
+  
+  try {
+
+    for (size_t i = 0; i < window; i++)
+      start(i);
+    
+    for (size_t i = 0; i < n; i++) {
+
+      catp.SetInput(i, sample_nums.size() ? sample_nums.at(i) : static_cast<int>(i));
+
+      CellBlock block;
+      while (inputs[i].queue.Pop(block))
+	catp.WriteBlock(block);
+
+      inputs[i].worker.join();
+      readers[i].reset();
+      if (inputs[i].error)
+	std::rethrow_exception(inputs[i].error);
+
+      if (i + window < n)
+	start(i + window);
+    }
+    
+  } catch (...) {
+    stop_all();
+    throw;
+  }
+
+  catp.Close();
+}
+
 static int catfunc(int argc, char** argv) {
 
   std::string samples;
+  opt::outfile = "-";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 's' : arg >> samples; break;
+    case 'o' : arg >> opt::outfile; break;
     default: die = true;
     }
   }
@@ -463,9 +683,16 @@ static int catfunc(int argc, char** argv) {
   if (opt::infile_vec.empty() || die) {
     
     const char *USAGE_MESSAGE =
-      "Usage: cysift cat [csvfile]\n"
-      "  Concatenate together multiple cell tables\n"
-      "    csvfile: filepaths of cell tables\n"
+      "Usage: cysift cat [cysfiles]\n"
+      "  Concatenate together multiple cell tables. Cell ids (and graph ids)\n"
+      "  are offset to stay unique, and a \"sample\" column is added\n"
+      "  (an existing one is kept, unless -s is given)\n"
+      "    cysfiles: filepaths of cell tables, with the same columns\n"
+      "    -o [-]                    Output file, or '-' for stdout\n"
+      "    -t [1]                    Number of threads. Up to this many files are read at once\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr\n"
       "    -s                        Sample numbers, to be in same number as inputs and comma-sep\n"      
       "\n";
@@ -475,7 +702,6 @@ static int catfunc(int argc, char** argv) {
 
   // parse the sample numbers
   std::vector<int> sample_nums;
-  std::unordered_set<std::string> tokens;
   std::stringstream ss(samples);
   std::string token;
   while (std::getline(ss, token, ',')) {
@@ -486,36 +712,74 @@ static int catfunc(int argc, char** argv) {
     throw std::runtime_error("Sample number csv line should have same number of tokens as number of input files");
   }
   
-  size_t offset = 0;
-
   CatProcessor catp;
   catp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
-  catp.SetParams(offset, 0);
-  
-  for (size_t sample_num = 0; sample_num < opt::infile_vec.size(); sample_num++) {
+  catp.SetCompression(opt::codec, opt::threads);
+  catp.SetIndex(opt::index);
+  catp.SetGraphEncoding(opt::graph_encoding);
+  catp.SetReplaceSample(!sample_nums.empty());
+
+  try {
+    cat_inputs(catp, sample_nums);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
 
-    // can make a new table for each iteration, since we are dumping right to stdout
-    CellTable this_table;
-    
-    // set table params
-    if (opt::verbose)
-      this_table.SetVerbose();
+  return 0;
+}
 
-    if (opt::verbose)
-      std::cerr << "...reading and concatenating " << opt::infile_vec.at(sample_num) << std::endl;
-    
-    // update the offset and sample num
-    catp.SetOffset(offset);
+static int mergefunc(int argc, char** argv) {
+
+  opt::outfile = "-";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
+    case 'o' : arg >> opt::outfile; break;
+    default: die = true;
+    }
+  }
 
-    if (sample_nums.size())
-      catp.SetSample(sample_nums.at(sample_num));
-    else
-      catp.SetSample(sample_num);
+  optind++;
+  while (optind < argc) {
+    opt::infile_vec.push_back(argv[optind]);
+    optind++;
+  }
 
-    // stream in the lines
-    this_table.StreamTable(catp, opt::infile_vec.at(sample_num));
+  if (opt::infile_vec.empty() || die) {
     
-    offset = catp.GetMaxCellID() + 1; // + 1 to avoid dupes if new cellid starts at 0
+    const char *USAGE_MESSAGE =
+      "Usage: cysift merge [cysfiles]\n"
+      "  Stitch the tiles of split back into one table, dropping the halo cells\n"
+      "    cysfiles: the tile files of split, e.g. prefix.*.cys\n"
+      "    -o [-]                    Output file, or '-' for stdout\n"
+      "    -t [1]                    Number of threads. Up to this many tiles are read at once\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
+      "    -v, --verbose             Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  CatProcessor catp;
+  catp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  catp.SetCompression(opt::codec, opt::threads);
+  catp.SetIndex(opt::index);
+  catp.SetGraphEncoding(opt::graph_encoding);
+  catp.SetTiles(true);
+
+  try {
+    cat_inputs(catp, {});
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
   }
 
   return 0;
@@ -544,11 +808,52 @@ static int infofunc(int argc, char** argv) {
     return 1;
   }
   
-  // build it into memory and then provide information
-  build_table();
-  
-  // provide information to stdout
-  std::cout << table;
+  // summarize from the footer if there is one, or else from every block
+  CellHeader header;
+  FileStats stats;
+  if (!read_footer(header, stats)) {
+    try {
+      CellReader reader;
+      reader.SetThreads(opt::threads);
+      if (!reader.Open(opt::infile)) {
+	std::cerr << "Unable to open " << opt::infile << std::endl;
+	return 1;
+      }
+      reader.ReadHeader(header);
+      stats.Init(header.GetDataTags().size());
+
+      // the same summary as CellWriter puts in the footer
+      CellBlock block;
+      BlockStats bstats;
+      while (reader.ReadBlock(block)) {
+	bstats.Compute(block);
+	stats.Add(block, bstats);
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  std::cout << "Cells -- " << stats.num_cells << std::endl;
+  std::cout << "X -- [" << stats.x_min << ", " << stats.x_max << "]" << std::endl;
+  std::cout << "Y -- [" << stats.y_min << ", " << stats.y_max << "]" << std::endl;
+  size_t i = 0;
+  for (const auto& t : header.GetDataTags()) {
+    const ColumnStats& cs = stats.cols.at(i++);
+    std::string ctype;
+    switch (t.type) {
+    case Tag::MA_TAG: ctype = "Marker"; break;
+    case Tag::GA_TAG: ctype = "Graph"; break;
+    case Tag::CA_TAG: ctype = "Meta"; break;
+    default: ctype = "UNKNOWN"; break;
+    }
+    double mean = cs.count ? cs.sum / cs.count : 0;
+    double var = cs.count ? cs.sumsq / cs.count - mean * mean : 0;
+    std::cout << t.id << " -- " << ctype << " -- N: " << cs.count <<
+      " Mean: " << mean << " SD: " << std::sqrt(std::max(var, 0.0)) <<
+      " Min: " << cs.min << " Max: " << cs.max << std::endl;
+  }
   
   return 0;
 }
@@ -562,6 +867,10 @@ static int cutfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'x' : arg >> cut; break;
     case 'X' : strict_cut = true; arg >> cut; break;
     case 'n' : arg >> opt::n; break;
@@ -579,6 +888,10 @@ static int cutfunc(int argc, char** argv) {
       "    <file>: filepath or a '-' to stream to stdin\n"
       "    -x, --cut                 Comma-separated list of markers to cut to\n"
       "    -X, --strict-cut          Comma-separated list of markers to cut to\n"      
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -599,6 +912,10 @@ static int cutfunc(int argc, char** argv) {
   // setup the cut processor
   CutProcessor cutp;
   cutp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  cutp.SetCompression(opt::codec, opt::threads);
+  cutp.SetIndex(opt::index);
+  cutp.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
   cutp.SetParams(tokens); 
 
   // process 
@@ -615,6 +932,10 @@ static int averagefunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     default: die = true;
     }
   }
@@ -625,6 +946,10 @@ static int averagefunc(int argc, char** argv) {
       "Usage: cysift average [csvfile] <options>\n"
       "  Calculate the average of each data column\n"
       "  csvfile: filepath or a '-' to stream to stdin\n"
+      "  -t [1]                    Number of threads\n"
+      "  --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "  --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "  --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "  -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -637,9 +962,20 @@ static int averagefunc(int argc, char** argv) {
 
   AverageProcessor avgp;
   avgp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);  
-
-  if (table.StreamTable(avgp, opt::infile))
+  avgp.SetCompression(opt::codec, opt::threads);
+  avgp.SetIndex(opt::index);
+  avgp.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
+
+  // take the sums from the footer if there is one
+  CellHeader header;
+  FileStats stats;
+  if (read_footer(header, stats)) {
+    avgp.ProcessHeader(header);
+    avgp.SetStats(stats);
+  } else if (table.StreamTable(avgp, opt::infile)) {
     return 1; // non-zero status on StreamTable
+  }
 
   // write the one line with the averages
   avgp.EmitCell();
@@ -658,6 +994,9 @@ static int tumorfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 't' : arg >> opt::threads; break;
     case 'k' : arg >> n; break;
     case 'f' : arg >> frac; break;
@@ -677,12 +1016,18 @@ static int tumorfunc(int argc, char** argv) {
       "    -f [0.75]             Fraction of neighbors\n"
       "    -o                    Flag OR for tumor\n"
       "    -a                    Flag AND for tumor\n"      
+      "    -t [1]                Number of threads\n"
+      "    --codec <name[:lvl]>  Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index               Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph           Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose         Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
+  // only x, y and the flags are used
+  table.SetProjection({}, false);
   build_table();
 
   // no table to work with
@@ -705,6 +1050,10 @@ static int log10func(int argc, char** argv)  {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'n' : arg >> opt::n; break;
     default: die = true;
     }
@@ -716,6 +1065,10 @@ static int log10func(int argc, char** argv)  {
       "Usage: cysift log10 [csvfile] <options>\n"
       "  Calculate the log10 of marker intensities\n"
       "  csvfile: filepath or a '-' to stream to stdin\n"
+      "  -t [1]                    Number of threads\n"
+      "  --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "  --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "  --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "  -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -728,6 +1081,10 @@ static int log10func(int argc, char** argv)  {
 
   LogProcessor logp;
   logp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);  
+  logp.SetCompression(opt::codec, opt::threads);
+  logp.SetIndex(opt::index);
+  logp.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
 
   if (table.StreamTable(logp, opt::infile))
     return 1; // non-zero status on StreamTable
@@ -761,7 +1118,10 @@ static void parseRunOptions(int argc, char** argv) {
 	 opt::module == "delaunay" || opt::module == "head" || 
 	 opt::module == "average" || opt::module == "lda" || 
 	 opt::module == "spatial" || opt::module == "radialdens" || 
-	 opt::module == "select" || opt::module == "pheno")) {
+	 opt::module == "select" || opt::module == "pheno" ||
+	 opt::module == "index" || opt::module == "run" ||
+	 opt::module == "h5ad" || opt::module == "split" ||
+	 opt::module == "merge")) {
     std::cerr << "Module " << opt::module << " not implemented" << std::endl;
     die = true;
   }
@@ -782,6 +1142,10 @@ static int roifunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'n' : arg >> opt::n; break;
     case 'r' : arg >> roifile;
     default: die = true;
@@ -796,6 +1160,10 @@ static int roifunc(int argc, char** argv) {
       "  csvfile: filepath or a '-' to stream to stdin\n"
       "  -r                        ROI file\n"
       "  -l                        Output all cells and add \"roi\" column with ROI label\n"      
+      "  -t [1]                    Number of threads\n"
+      "  --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "  --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "  --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "  -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -811,6 +1179,10 @@ static int roifunc(int argc, char** argv) {
 
   ROIProcessor roip;
   roip.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  roip.SetCompression(opt::codec, opt::threads);
+  roip.SetIndex(opt::index);
+  roip.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
   roip.SetParams(false, rois);// false is placeholder for label function, that i need to implement
 
   if (table.StreamTable(roip, opt::infile))
@@ -823,6 +1195,9 @@ static int roifunc(int argc, char** argv) {
 static int viewfunc(int argc, char** argv) {
 
   int precision = -1;
+  std::string rows;
+  char delim = ',';
+  bool fixed = false;
 
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
@@ -832,9 +1207,27 @@ static int viewfunc(int argc, char** argv) {
     case 't' : arg >> opt::threads; break;      
     case 'h' : opt::header = true; break;
     case 'H' : opt::header_only = true; break;
+    case 'W' : arg >> rows; break;
+    case 'T' : delim = '\t'; break;
+    case 'F' : fixed = true; break;
     default: die = true;
     }
   }
+
+  size_t row_start = 0;
+  size_t row_end = static_cast<size_t>(-1);
+  if (!rows.empty()) {
+    size_t dash = rows.find('-');
+    try {
+      row_start = std::stoull(rows.substr(0, dash));
+      if (dash != std::string::npos)
+	row_end = std::stoull(rows.substr(dash + 1));
+    } catch (const std::exception& e) {
+      die = true;
+    }
+    if (row_end <= row_start)
+      die = true;
+  }
   
   if (die || in_only_process(argc, argv)) {
     
@@ -842,9 +1235,13 @@ static int viewfunc(int argc, char** argv) {
       "Usage: cysift view [csvfile] <options>\n"
       "  View the contents of a cell table\n" 
       "  csvfile: filepath or a '-' to stream to stdin\n"
-      "  -n  [-1]                  Number of decimals to keep (-1 is no change)\n"
+      "  -n  [-1]                  Number of significant digits to keep (-1 is the default of 6)\n"
+      "  --fixed                   Keep -n decimal places instead (default 6)\n"
+      "  --tsv                     Separate fields with tabs instead of commas\n"
       "  -H                        View only the header\n"      
       "  -h                        Output with the header\n"
+      "  --rows <start>-<end>      Only view rows [start, end), 0-based. Uses the index if present\n"
+      "  -t [1]                    Number of threads to format rows with\n"
       "  -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -857,6 +1254,11 @@ static int viewfunc(int argc, char** argv) {
   
   ViewProcessor viewp;
   viewp.SetParams(opt::header, opt::header_only, precision);
+  viewp.SetRows(row_start, row_end);
+  viewp.SetFormat(delim, fixed);
+  viewp.SetThreads(opt::threads);
+
+  table.SetThreads(opt::threads);
 
   table.StreamTable(viewp, opt::infile);
   
@@ -928,6 +1330,8 @@ static int plotfunc(int argc, char** argv) {
     return 1;
   }
 
+  // only x, y and the flags are used
+  table.SetProjection({}, false);
   build_table();
   
   // make an ASCII plot of this
@@ -942,6 +1346,10 @@ static int headfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'n' : arg >> opt::n; break;
     default: die = true;
     }
@@ -955,6 +1363,10 @@ static int headfunc(int argc, char** argv) {
       "  Keep only the first n cells\n"
       "    csvfile: filepath or a '-' to stream to stdin\n"
       "    -n, --numrows             Number of rows to keep\n"
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -967,6 +1379,10 @@ static int headfunc(int argc, char** argv) {
 
   HeadProcessor headp;
   headp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);  
+  headp.SetCompression(opt::codec, opt::threads);
+  headp.SetIndex(opt::index);
+  headp.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
   headp.SetParams(opt::n);
     
   if (table.StreamTable(headp, opt::infile))
@@ -994,6 +1410,10 @@ static int subsamplefunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'n' : arg >> opt::n; break;
     case 's' : arg >> opt::seed; break;      
     default: die = true;
@@ -1009,6 +1429,10 @@ static int subsamplefunc(int argc, char** argv) {
       "    csvfile: filepath or a '-' to stream to stdin\n"
       "    -n, --numrows             Number of rows to subsample\n"
       "    -s, --seed         [1337] Seed for random subsampling\n"
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1072,6 +1496,10 @@ static int cropfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'c' : arg >> cropstring; break;
      default: die = true;
     }
@@ -1084,6 +1512,10 @@ static int cropfunc(int argc, char** argv) {
       "  Crop the table to a given rectangle (in pixels)\n"
       "    csvfile: filepath or a '-' to stream to stdin\n"
       "    --crop                    String of form xlo,xhi,ylo,yhi\n"
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1117,6 +1549,11 @@ static int cropfunc(int argc, char** argv) {
     throw std::runtime_error("Error: Fewer than 4 numbers provided");
   }
 
+  // blocks entirely outside the rectangle are never read
+  table.SetBlockFilter([=](const BlockStats& s) {
+    return s.x_max < xlo || s.x_min > xhi || s.y_max < ylo || s.y_min > yhi;
+  });
+  
   build_table();
   
   //
@@ -1135,6 +1572,9 @@ static int spatialfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 't' : arg >> opt::threads; break;
     case 'k' : arg >> n; break;
     case 'd' : arg >> d; break;            
@@ -1150,6 +1590,10 @@ static int spatialfunc(int argc, char** argv) {
       "    csvfile: filepath or a '-' to stream to stdin\n"
       "    -k [10]               Number of neighbors\n"
       "    -d [-1]               Max distance to include as neighbor (-1 = none)\n"
+      "    -t [1]                Number of threads\n"
+      "    --codec <name[:lvl]>  Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index               Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph           Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose         Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1188,11 +1632,18 @@ static int selectfunc(int argc, char** argv) {
   float equal_to = dummy_float;
   float greater_than_or_equal = dummy_float;
   float less_than_or_equal = dummy_float;
+
+  // id select
+  std::string ids;
   
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 'o' : arg >> plogor; break;
     case 'a' : arg >> plogand; break;
     case 'N' : plognot = true; break;
@@ -1205,6 +1656,7 @@ static int selectfunc(int argc, char** argv) {
     case 'G' : arg >> greater_than_or_equal; break;
     case 'L' : arg >> less_than_or_equal; break;
     case 'e' : arg >> equal_to; break;
+    case 'I' : arg >> ids; break;
     default: die = true;
     }
   }
@@ -1241,7 +1693,13 @@ static int selectfunc(int argc, char** argv) {
       "    -l                    < - Less than\n"
       "    -L                    <= - Less than or equal to\n"      
       "    -e                    Equal to (can use with -g or -m for >= or <=)\n"
+      "  Cell id selection\n"
+      "    --ids                 Comma-separated cell ids, or a file of ids (one per line)\n"
       "  Options\n"
+      "    -t [1]                Number of threads\n"
+      "    --codec <name[:lvl]>  Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index               Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph           Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose         Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1251,8 +1709,14 @@ static int selectfunc(int argc, char** argv) {
   // setup the selector processor
   SelectProcessor select;
   select.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  select.SetCompression(opt::codec, opt::threads);
+  select.SetIndex(opt::index);
+  select.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
   select.SetFlagParams(plogor, plogand, plognot, clogor, clogand, clognot);
   select.SetFieldParams(field, greater_than, less_than, greater_than_or_equal, less_than_or_equal, equal_to);
+  if (!ids.empty())
+    select.SetIDs(read_id_list(ids));
 			
   // process
   table.StreamTable(select, opt::infile);
@@ -1263,11 +1727,21 @@ static int selectfunc(int argc, char** argv) {
 static int phenofunc(int argc, char** argv) {
 
   std::string file;
-  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+  int longindex = -1;
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, &longindex)) != -1; longindex = -1) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
-    case 't' : arg >> file; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
+    // -t is the gates file here, so threads are only set with --threads
+    case 't' :
+      if (longindex >= 0)
+	arg >> opt::threads;
+      else
+	arg >> file;
+      break;
     default: die = true;
     }
   }
@@ -1278,8 +1752,12 @@ static int phenofunc(int argc, char** argv) {
       "Usage: cysift pheno [csvfile]\n"
       "  Phenotype cells (set the flags) with threshold file\n"
       "    csvfile: filepath or a '-' to stream to stdin\n"
-      "    -t               File that holds gates: marker(string), low(float), high(float)\n"
-      "    -v, --verbose    Increase output to stderr\n"
+      "    -t                    File that holds gates: marker(string), low(float), high(float)\n"
+      "    --threads [1]         Number of threads\n"
+      "    --codec <name[:lvl]>  Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index               Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph           Store the graph unsorted and uncoded, keeping neighbor order\n"
+      "    -v, --verbose         Increase output to stderr\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -1299,6 +1777,10 @@ static int phenofunc(int argc, char** argv) {
 
   PhenoProcessor phenop;
   phenop.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  phenop.SetCompression(opt::codec, opt::threads);
+  phenop.SetIndex(opt::index);
+  phenop.SetGraphEncoding(opt::graph_encoding);
+  table.SetThreads(opt::threads);
   phenop.SetParams(pheno);
 
   if (table.StreamTable(phenop, opt::infile))
@@ -1321,6 +1803,9 @@ static int radialdensfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     case 't' : arg >> opt::threads; break;
     case 'R' : arg >> inner; break;
     case 'r' : arg >> outer; break;
@@ -1344,6 +1829,10 @@ static int radialdensfunc(int argc, char** argv) {
       "    -a                    Logical AND flags\n"
       "    -l                    Label the column\n"
       "    -f                    File for multiple labels [r,R,o,a,l]\n"
+      "    -t [1]                Number of threads\n"
+      "    --codec <name[:lvl]>  Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index               Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph           Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose         Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1355,73 +1844,73 @@ static int radialdensfunc(int argc, char** argv) {
     return 1;
   }
 
-  // read in the multiple selection file
+  // read in the multiple selection file, or else use the one ring given
+  std::vector<RadialSelector> rsv = read_radial_file(file);
+  if (rsv.empty())
+    rsv.push_back(RadialSelector(inner, outer, logor, logand, label));
+
+  // building way
+  build_table();
+
+  table.SetupOutputWriter(opt::outfile);
+  
+  radial_density(rsv);
+
+  table.OutputTable();
+  
+  return 0;
+}
+
+static std::vector<RadialSelector> read_radial_file(const std::string& file) {
+
   std::vector<RadialSelector> rsv;
-  if (!file.empty()) {
-    std::ifstream input_file(file);
+  if (file.empty())
+    return rsv;
+
+  std::ifstream input_file(file);
    
-    if (!input_file.is_open()) {
-      throw std::runtime_error("Failed to open file: " + file);
-    }
+  if (!input_file.is_open()) {
+    throw std::runtime_error("Failed to open file: " + file);
+  }
     
-    std::string line;
-    std::regex pattern("^[-+]?[0-9]*\\.?[0-9]+,");
-    while (std::getline(input_file, line)) {
+  std::string line;
+  std::regex pattern("^[-+]?[0-9]*\\.?[0-9]+,");
+  while (std::getline(input_file, line)) {
 
-      // remove white space
-      line.erase(std::remove_if(line.begin(), line.end(), ::isspace),line.end());
+    // remove white space
+    line.erase(std::remove_if(line.begin(), line.end(), ::isspace),line.end());
 	  
-      // make sure starts with number
-      if (!std::regex_search(line, pattern))
-	continue;
+    // make sure starts with number
+    if (!std::regex_search(line, pattern))
+      continue;
      
-      rsv.push_back(RadialSelector(line));
-    }
+    rsv.push_back(RadialSelector(line));
+  }
     
-    if (opt::verbose) {
-      for (const auto& rr : rsv)
-	std::cerr << rr << std::endl;
-    }
+  if (opt::verbose) {
+    for (const auto& rr : rsv)
+      std::cerr << rr << std::endl;
   }
 
-  
-  // streaming way
-  RadialProcessor radp;
-  radp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  return rsv;
+}
+
+static void radial_density(const std::vector<RadialSelector>& rsv) {
 
   std::vector<cy_uint> innerV(rsv.size());
   std::vector<cy_uint> outerV(rsv.size());  
   std::vector<cy_uint> logorV(rsv.size());
   std::vector<cy_uint> logandV(rsv.size());  
   std::vector<std::string> labelV(rsv.size());
-  if (rsv.empty()) {
-    radp.SetParams({inner},{outer},{logor},{logand},{label});
-  } else {
-    for (size_t i = 0; i < innerV.size(); i++) {
-      innerV[i] = rsv.at(i).int_data.at(0);
-      outerV[i] = rsv.at(i).int_data.at(1);
-      logorV[i] = rsv.at(i).int_data.at(2);
-      logandV[i] = rsv.at(i).int_data.at(3);     
-      labelV[i] = rsv.at(i).label;
-    }
-    radp.SetParams(innerV, outerV, logorV, logandV, labelV);
+  for (size_t i = 0; i < rsv.size(); i++) {
+    innerV[i] = rsv.at(i).int_data.at(0);
+    outerV[i] = rsv.at(i).int_data.at(1);
+    logorV[i] = rsv.at(i).int_data.at(2);
+    logandV[i] = rsv.at(i).int_data.at(3);     
+    labelV[i] = rsv.at(i).label;
   }
 
-  // building way
-  build_table();
-
-  table.SetupOutputWriter(opt::outfile);
-  
   table.RadialDensityKD(innerV, outerV, logorV, logandV, labelV);
-
-  table.OutputTable();
-  
-  return 0;
-  
-  if (table.StreamTable(radp, opt::infile))
-    return 1; // non-zero exit from StreamTable
-
-  return 0;
 }
 
 int debugfunc(int argc, char** argv) {
@@ -1429,12 +1918,118 @@ int debugfunc(int argc, char** argv) {
 
 }
 
+// write all of the blocks, re-ordered along a space-filling curve
+// over the bounding box of every cell
+static void write_curve_order(std::vector<CellBlock>& blocks, kernels::SpaceCurve curve,
+			      CellWriter& writer) {
+
+  // x and y of every cell, and where each block starts
+  std::vector<float> x, y;
+  std::vector<size_t> starts;
+  for (const auto& b : blocks) {
+    starts.push_back(x.size());
+    x.insert(x.end(), b.m_x.begin(), b.m_x.end());
+    y.insert(y.end(), b.m_y.begin(), b.m_y.end());
+  }
+  if (x.empty())
+    return;
+
+  const ConstSpan<float> xs(x.data(), x.size());
+  const ConstSpan<float> ys(y.data(), y.size());
+  const auto xr = kernels::minmax(xs);
+  const auto yr = kernels::minmax(ys);
+
+  std::vector<uint32_t> keys(x.size());
+  kernels::curve_keys(xs, ys, xr.first, xr.second, yr.first, yr.second, curve, keys.data());
+  const std::vector<size_t> order =
+    kernels::radix_order(ConstSpan<uint32_t>(keys.data(), keys.size()), false, opt::threads);
+
+  if (opt::verbose)
+    std::cerr << "...writing " << AddCommas(order.size()) << " cells along the " <<
+      (curve == kernels::SpaceCurve::HILBERT ? "Hilbert" : "Morton") << " curve" << std::endl;
+
+  const size_t num_cols = blocks.front().NumCols();
+  CellBlock out(num_cols);
+  Cell cell;
+  for (const size_t i : order) {
+    const size_t b = std::upper_bound(starts.begin(), starts.end(), i) - starts.begin() - 1;
+    blocks[b].GetCell(i - starts[b], cell);
+    out.AddCell(cell);
+    if (out.size() == CYS_BLOCK_SIZE) {
+      writer.WriteBlock(out);
+      out.Init(num_cols);
+    }
+  }
+  if (out.size())
+    writer.WriteBlock(out);
+}
+
+// write the cells of an .h5ad input to a .cys file
+static int h5ad_to_cys(bool graph, std::optional<kernels::SpaceCurve> curve) {
+
+  H5adReader reader;
+  if (graph)
+    reader.SetGraph("");
+
+  // errors from reading any block, not just the header, end the run here
+  try {
+
+    CellHeader header;
+    reader.Open(opt::infile);
+    reader.ReadHeader(header);
+    header.addTag(Tag(Tag::PG_TAG, "", cmd_input));
+    header.SortTags();
+
+    CellWriter writer(opt::outfile);
+    writer.SetCodec(opt::codec);
+    writer.SetIndex(opt::index);
+    writer.SetGraphEncoding(opt::graph_encoding);
+    writer.SetThreads(opt::threads);
+    writer.SetBackground(true);
+    writer.WriteHeader(header);
+
+    CellBlock block;
+    std::vector<CellBlock> blocks;
+    size_t count = 0;
+    while (reader.ReadBlock(block)) {
+      count += block.size();
+      if (curve) {
+	blocks.push_back(std::move(block));
+	block = CellBlock();
+      } else {
+	writer.WriteBlock(block);
+      }
+      if (opt::verbose)
+	std::cerr << "...read cell " << AddCommas(count) << " of " << AddCommas(reader.NumCells()) << std::endl;
+    }
+
+    if (curve)
+      write_curve_order(blocks, *curve, writer);
+
+    writer.Close();
+
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
 static int cerealfunc(int argc, char** argv) {
-  
+
+  bool graph = false;
+  std::optional<kernels::SpaceCurve> curve;
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
+    case 'K' : graph = true; break;
+    case 'U' : parse_curve(arg.str(), curve); break;
     default: die = true;
     }
   }
@@ -1443,18 +2038,72 @@ static int cerealfunc(int argc, char** argv) {
     
     const char *USAGE_MESSAGE =
       "Usage: cysift cys [csvfile]\n"
-      "  Create a .cys formatted file from a csv file\n" 
+      "  Create a .cys formatted file from a csv or .h5ad file\n" 
       "    csvfile: filepath or a '-' to stream to stdin\n"
-      "    -v, --verbose         Increase output to stderr\n"      
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
+      "    --graph                   Read the spatial graph from obsp of an .h5ad file\n"
+      "    --curve <hilbert|morton>  Write the cells in space-filling curve order (reads all cells into memory)\n"
+      "    -v, --verbose             Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
-  CerealProcessor cerp;
-  cerp.SetParams(opt::outfile, cmd_input);
+  // AnnData input is read a block at a time too
+  const std::string ext = ".h5ad";
+  if (opt::infile.size() > ext.size() &&
+      opt::infile.compare(opt::infile.size() - ext.size(), ext.size(), ext) == 0)
+    return h5ad_to_cys(graph, curve);
+  
+  // parse the csv a block at a time, in parallel
+  CsvReader reader;
+  reader.SetThreads(opt::threads);
+  if (!reader.Open(opt::infile)) {
+    std::cerr << "Unable to open " << opt::infile << std::endl;
+    return 1;
+  }
+
+  // a malformed line ends the run, with the line it was found on
+  try {
+
+    CellHeader header;
+    reader.ReadHeader(header);
+    header.addTag(Tag(Tag::PG_TAG, "", cmd_input));
+    header.SortTags();
+
+    CellWriter writer(opt::outfile);
+    writer.SetCodec(opt::codec);
+    writer.SetIndex(opt::index);
+    writer.SetGraphEncoding(opt::graph_encoding);
+    writer.SetThreads(opt::threads);
+    writer.SetBackground(true);
+    writer.WriteHeader(header);
+
+    CellBlock block;
+    std::vector<CellBlock> blocks;
+    while (reader.ReadBlock(block)) {
+      if (curve) {
+	blocks.push_back(std::move(block));
+	block = CellBlock();
+      } else {
+	writer.WriteBlock(block);
+      }
+      if (opt::verbose)
+	std::cerr << "...read line " << AddCommas(reader.NumLines()) << std::endl;
+    }
+
+    if (curve)
+      write_curve_order(blocks, *curve, writer);
+
+    writer.Close();
 
-  table.StreamTableCSV(cerp, opt::infile);
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
 
   return 0;
 }
@@ -1472,6 +2121,9 @@ static int delaunayfunc(int argc, char** argv) {
     case 'V' : arg >> voronoi; break;
     case 'l' : arg >> limit; break;
     case 'v' : opt::verbose = true; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     default: die = true;
     }
   }
@@ -1486,6 +2138,9 @@ static int delaunayfunc(int argc, char** argv) {
       "    -D                        Filename of PDF to output of Delaunay triangulation\n"
       "    -V                        Filename of PDF to output of Voronoi diagram\n"
       "    -l                        Size limit of an edge in the Delaunay triangulation\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose             Increase output to stderr\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1495,6 +2150,7 @@ static int delaunayfunc(int argc, char** argv) {
   // build the table
   // but don't have to convert columns
   // since we don't use pre-existing Graph or Flags for this
+  table.SetProjection({}, false);
   build_table();
 
   // check we were able to read the table
@@ -1517,21 +2173,27 @@ static int sortfunc(int argc, char** argv) {
 
   bool xy = false;
   std::string field;
+  std::optional<kernels::SpaceCurve> curve;
   bool reverse = false;
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'y' : xy = true; break;
+    case 'U' : parse_curve(arg.str(), curve); break;
     case 'x' : arg >> field; break;
     case 'j' : reverse = true; break;
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
     default: die = true;
     }
   }
 
-  if ( !xy && field.empty() ) {
+  if ( (xy ? 1 : 0) + (field.empty() ? 0 : 1) + (curve ? 1 : 0) != 1 ) {
     die = true;
-    std::cerr << "Must select only one of -y flag or -x <arg>\n" << std::endl;
+    std::cerr << "Must select only one of -y flag, -x <arg> or --curve <arg>\n" << std::endl;
   }
   
   if (die || in_out_process(argc, argv)) {
@@ -1542,7 +2204,12 @@ static int sortfunc(int argc, char** argv) {
       "    cysfile: filepath or a '-' to stream to stdin\n"
       "    -y                    Flag to have cells sort by (x,y), in increasing distance from 0\n"
       "    -x                    Field to sort on\n"
+      "    --curve <name>        Sort along a space-filling curve (hilbert or morton), keeping nearby cells together\n"
       "    -j                    Reverse sort order\n"
+      "    -t [1]                Number of threads\n"
+      "    --codec <name[:lvl]>  Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index               Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph           Store the graph unsorted and uncoded, keeping neighbor order\n"
       "    -v, --verbose         Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
@@ -1562,9 +2229,10 @@ static int sortfunc(int argc, char** argv) {
 
   if (xy)
     table.sortxy(reverse);
-
-  if (!field.empty())
+  else if (!field.empty())
     table.sort(field, reverse);
+  else
+    table.sortcurve(*curve, reverse);
   
   // print it
   table.OutputTable();
@@ -1579,6 +2247,7 @@ static int countfunc(int argc, char** argv) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
     default: die = true;
     }
   }
@@ -1589,13 +2258,23 @@ static int countfunc(int argc, char** argv) {
       "Usage: cysift count [cysfile]\n"
       "  Output the number of cells in a file\n"
       "    cysfile: filepath or a '-' to stream to stdin\n"
+      "    -t [1]                Number of threads\n"
       "    -v, --verbose         Increase output to stderr\n"      
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
+  // the footer has the count
+  CellHeader header;
+  FileStats stats;
+  if (read_footer(header, stats)) {
+    std::cout << stats.num_cells << std::endl;
+    return 0;
+  }
+  
   CountProcessor countp;
+  table.SetThreads(opt::threads);
 
   if (table.StreamTable(countp, opt::infile)) 
     return 1; // non-zero status on StreamTable
@@ -1605,6 +2284,521 @@ static int countfunc(int argc, char** argv) {
   return 0;
 }
 
+static int h5adfunc(int argc, char** argv) {
+
+  int level = 4;
+  bool graph = false;
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'z' : arg >> level; break;
+    case 'K' : graph = true; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_out_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cysift h5ad [cysfile] [h5adfile] <options>\n"
+      "  Export the cells to an AnnData file, streaming a block at a time.\n"
+      "  Markers go to X, x / y / flags / metas to obs, x and y to obsm['spatial']\n"
+      "  cysfile: filepath or a '-' to stream to stdin\n"
+      "  --gzip [4]                Compression level of the datasets (0 is none)\n"
+      "  --graph                   Write the spatial graph as obsp['spatial_distances']\n"
+      "  -t [1]                    Number of threads to read with\n"
+      "  -v, --verbose             Increase output to stderr"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  if (opt::verbose)
+    table.SetVerbose();
+  table.SetThreads(opt::threads);
+
+  H5adProcessor h5p;
+  h5p.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  h5p.SetParams(level, graph);
+
+  try {
+    if (table.StreamTable(h5p, opt::infile))
+      return 1;
+    h5p.Close();
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int splitfunc(int argc, char** argv) {
+
+  float width = 2000;
+  float height = -1;
+  float halo = 100;
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
+    case 'w' : arg >> width; break;
+    case 'l' : arg >> height; break;
+    case 'Q' : arg >> halo; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_out_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cysift split [cysfile] [prefix] <options>\n"
+      "  Split the cells into a grid of spatial tiles, written to prefix.<i>_<j>.cys.\n"
+      "  Each tile also holds the cells of its neighbors within the halo, flagged\n"
+      "  as halo cells, so spatial modules can be run on each tile on its own.\n"
+      "  Use merge to put the tiles back together\n"
+      "  cysfile: filepath or a '-' to stream to stdin\n"
+      "  -w [2000]                 Tile width\n"
+      "  -l [width]                Tile height\n"
+      "  --halo [100]              Width of the halo around each tile\n"
+      "  --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "  --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
+      "  -t [1]                    Number of threads to read with\n"
+      "  -v, --verbose             Increase output to stderr"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  if (height <= 0)
+    height = width;
+  
+  if (opt::verbose)
+    table.SetVerbose();
+  table.SetThreads(opt::threads);
+
+  SplitProcessor splitp;
+  splitp.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  splitp.SetCompression(opt::codec, 1);
+  splitp.SetGraphEncoding(opt::graph_encoding);
+  splitp.SetParams(width, height, halo);
+
+  try {
+    if (table.StreamTable(splitp, opt::infile))
+      return 1;
+    splitp.Close();
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  if (opt::verbose)
+    std::cerr << "...wrote " << splitp.NumTiles() << " tiles" << std::endl;
+
+  return 0;
+}
+
+static int indexfunc(int argc, char** argv) {
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_only_process(argc, argv) || opt::infile == "-") {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cysift index [cysfile] <options>\n"
+      "  Build the sidecar index (<cysfile>.idx) that lets head, view and\n"
+      "  select seek straight to the blocks they need\n"
+      "  cysfile: filepath of a .cys file (not stdin)\n"
+      "  -t [1]                    Number of threads\n"
+      "  -v, --verbose             Increase output to stderr"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  CellIndex index;
+  try {
+    index.Build(opt::infile, opt::threads);
+    index.Write(opt::infile);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  if (opt::verbose)
+    std::cerr << "...indexed " << AddCommas(index.NumCells()) << " cells in " <<
+      index.size() << " blocks" << std::endl;
+  
+  return 0;
+}
+
+// read a comma-separated list of ids, or a file with one id per line
+static std::vector<uint32_t> read_id_list(const std::string& arg) {
+
+  std::vector<uint32_t> ids;
+  std::ifstream file(arg);
+  std::string token;
+  
+  if (file.good()) {
+    while (std::getline(file, token))
+      if (!token.empty())
+	ids.push_back(std::stoul(token));
+  } else {
+    std::istringstream iss(arg);
+    while (std::getline(iss, token, ','))
+      if (!token.empty())
+	ids.push_back(std::stoul(token));
+  }
+  
+  return ids;
+}
+
+// one module of a run pipeline. Streaming modules hand their cells
+// straight on, the rest work on the table in memory
+struct RunStage {
+  std::string cmd; // for the PG tag
+  std::unique_ptr<CellProcessor> proc;
+  std::function<void()> table_op;
+};
+
+static bool make_run_stage(const std::string& desc, RunStage& stage) {
+
+  std::vector<std::string> args;
+  std::istringstream ds(desc);
+  for (std::string tok; ds >> tok;)
+    args.push_back(tok);
+  if (args.empty())
+    return false;
+
+  const std::string module = args.front();
+  stage.cmd = "cysift";
+  for (const auto& a : args)
+    stage.cmd += " " + a;
+
+  // argv as the module would see it
+  std::string prog = "cysift";
+  std::vector<char*> sargv = { &prog[0] };
+  for (auto& a : args)
+    sargv.push_back(&a[0]);
+  sargv.push_back(nullptr);
+  const int sargc = sargv.size() - 1;
+
+  // parse the stage options, with -v for every module
+  bool bad = false;
+  auto parse = [&](const std::function<bool(char, std::istringstream&)>& handle) {
+    optind = 0; // start over
+    for (char c; (c = getopt_long(sargc, sargv.data(), shortopts, longopts, NULL)) != -1;) {
+      std::istringstream arg(optarg != NULL ? optarg : "");
+      if (c == 'v')
+	opt::verbose = true;
+      else if (!handle(c, arg))
+	bad = true;
+    }
+    // the module name is the only non-option
+    if (optind + 1 < sargc)
+      bad = true;
+  };
+  
+  if (module == "pheno") {
+    std::string file;
+    parse([&](char c, std::istringstream& arg) {
+      if (c != 't')
+	return false;
+      arg >> file;
+      return true;
+    });
+    PhenoMap pheno = phenoread(file);
+    if (!pheno.size())
+      throw std::runtime_error("Unable to read phenotype file or its empty: " + file);
+    auto p = std::make_unique<PhenoProcessor>();
+    p->SetParams(pheno);
+    stage.proc = std::move(p);
+    
+  } else if (module == "select") {
+    cy_uint plogor = 0, plogand = 0, clogor = 0, clogand = 0;
+    bool plognot = false, clognot = false;
+    std::string field, ids;
+    float greater_than = dummy_float, less_than = dummy_float, equal_to = dummy_float;
+    float greater_than_or_equal = dummy_float, less_than_or_equal = dummy_float;
+    parse([&](char c, std::istringstream& arg) {
+      switch (c) {
+      case 'o' : arg >> plogor; break;
+      case 'a' : arg >> plogand; break;
+      case 'N' : plognot = true; break;
+      case 'O' : arg >> clogor; break;
+      case 'A' : arg >> clogand; break;
+      case 'M' : clognot = true; break;
+      case 'f' : arg >> field; break;
+      case 'g' : arg >> greater_than; break;
+      case 'l' : arg >> less_than; break;
+      case 'G' : arg >> greater_than_or_equal; break;
+      case 'L' : arg >> less_than_or_equal; break;
+      case 'e' : arg >> equal_to; break;
+      case 'I' : arg >> ids; break;
+      default: return false;
+      }
+      return true;
+    });
+    auto p = std::make_unique<SelectProcessor>();
+    p->SetFlagParams(plogor, plogand, plognot, clogor, clogand, clognot);
+    p->SetFieldParams(field, greater_than, less_than, greater_than_or_equal, less_than_or_equal, equal_to);
+    if (!ids.empty())
+      p->SetIDs(read_id_list(ids));
+    stage.proc = std::move(p);
+
+  } else if (module == "cut") {
+    std::string cut;
+    parse([&](char c, std::istringstream& arg) {
+      if (c != 'x' && c != 'X')
+	return false;
+      arg >> cut;
+      return true;
+    });
+    std::unordered_set<std::string> tokens;
+    std::stringstream ss(cut);
+    for (std::string token; std::getline(ss, token, ',');)
+      tokens.insert(token);
+    auto p = std::make_unique<CutProcessor>();
+    p->SetParams(tokens);
+    stage.proc = std::move(p);
+
+  } else if (module == "clean") {
+    bool clean_graph = false, clean_markers = false, clean_meta = false;
+    parse([&](char c, std::istringstream& arg) {
+      switch (c) {
+      case 'm' : clean_markers = true; break;
+      case 'M' : clean_meta = true; break;
+      case 'P' : clean_graph = true; clean_markers = true; clean_meta = true; break;
+      default: return false;
+      }
+      return true;
+    });
+    auto p = std::make_unique<CleanProcessor>();
+    p->SetParams(clean_graph, clean_meta, clean_markers);
+    stage.proc = std::move(p);
+
+  } else if (module == "log10") {
+    parse([&](char c, std::istringstream& arg) { return false; });
+    stage.proc = std::make_unique<LogProcessor>();
+
+  } else if (module == "head") {
+    size_t n = 0;
+    parse([&](char c, std::istringstream& arg) {
+      if (c != 'n')
+	return false;
+      arg >> n;
+      return true;
+    });
+    auto p = std::make_unique<HeadProcessor>();
+    p->SetParams(n);
+    stage.proc = std::move(p);
+
+  } else if (module == "tumor") {
+    int n = 20;
+    float frac = 0.75;
+    cy_uint orflag = 0, andflag = 0;
+    parse([&](char c, std::istringstream& arg) {
+      switch (c) {
+      case 'k' : arg >> n; break;
+      case 'f' : arg >> frac; break;
+      case 'o' : arg >> orflag; break;
+      case 'a' : arg >> andflag; break;
+      default: return false;
+      }
+      return true;
+    });
+    stage.table_op = [=]() { table.TumorCall(n, frac, orflag, andflag, 600); };
+
+  } else if (module == "radialdens") {
+    cy_uint inner = 0, outer = 20, logor = 0, logand = 0;
+    std::string label, file;
+    parse([&](char c, std::istringstream& arg) {
+      switch (c) {
+      case 'R' : arg >> inner; break;
+      case 'r' : arg >> outer; break;
+      case 'o' : arg >> logor; break;
+      case 'a' : arg >> logand; break;
+      case 'l' : arg >> label; break;
+      case 'f' : arg >> file; break;
+      default: return false;
+      }
+      return true;
+    });
+    if (inner >= outer)
+      throw std::runtime_error("radialdens: inner radius should be smaller than outer");
+    std::vector<RadialSelector> rsv = read_radial_file(file);
+    if (rsv.empty())
+      rsv.push_back(RadialSelector(inner, outer, logor, logand, label));
+    stage.table_op = [=]() { radial_density(rsv); };
+
+  } else if (module == "delaunay") {
+    std::string delaunay, voronoi;
+    int limit = -1;
+    parse([&](char c, std::istringstream& arg) {
+      switch (c) {
+      case 'D' : arg >> delaunay; break;
+      case 'V' : arg >> voronoi; break;
+      case 'l' : arg >> limit; break;
+      default: return false;
+      }
+      return true;
+    });
+    stage.table_op = [=]() { table.Delaunay(delaunay, voronoi, limit); };
+
+  } else {
+    std::cerr << "Module " << module << " can't be run in a pipeline" << std::endl;
+    return false;
+  }
+
+  if (bad)
+    std::cerr << "Unable to parse options of pipeline module: " << desc << std::endl;
+  return !bad;
+}
+
+// build the stages of a run pipeline and run them
+static int run_pipeline(const std::string& pipeline) {
+
+  std::vector<RunStage> stages;
+  std::stringstream ps(pipeline);
+  for (std::string desc; std::getline(ps, desc, '|');) {
+    stages.emplace_back();
+    if (!make_run_stage(desc, stages.back()))
+      return 1;
+  }
+
+  if (opt::verbose)
+    table.SetVerbose();
+  table.SetThreads(opt::threads);
+  table.SetCodec(opt::codec);
+  table.SetIndex(opt::index);
+  table.SetGraphEncoding(opt::graph_encoding);
+
+  // the streaming modules up to the first table module are run
+  // as the input is read
+  ChainProcessor chain;
+  chain.SetCommonParams(opt::outfile, cmd_input, opt::verbose);
+  chain.SetCompression(opt::codec, opt::threads);
+  chain.SetIndex(opt::index);
+  chain.SetGraphEncoding(opt::graph_encoding);
+  size_t i = 0;
+  for (; i < stages.size() && stages[i].proc; i++) {
+    stages[i].proc->SetCommonParams("", stages[i].cmd, opt::verbose);
+    chain.AddStage(std::move(stages[i].proc));
+  }
+
+  // nothing needs the table, so stream straight to the output
+  if (i == stages.size())
+    return table.StreamTable(chain, opt::infile);
+
+  // otherwise, build the table from what comes out of them
+  if (chain.size()) {
+    chain.SetSave(true);
+    if (table.StreamTable(chain, opt::infile))
+      return 1;
+  } else if (table.BuildTable(opt::infile)) {
+    return 1;
+  }
+
+  while (i < stages.size()) {
+
+    if (!table.CellCount()) {
+      std::cerr << "Ending with no cells? Error in upstream operation?" << std::endl;
+      return 1;
+    }
+    
+    if (stages[i].table_op) {
+      stages[i].table_op();
+      table.SetCmd(stages[i].cmd);
+      i++;
+      continue;
+    }
+
+    // streaming modules between table modules run on the table in memory
+    ChainProcessor tchain;
+    tchain.SetSave(true);
+    for (; i < stages.size() && stages[i].proc; i++) {
+      stages[i].proc->SetCommonParams("", stages[i].cmd, opt::verbose);
+      tchain.AddStage(std::move(stages[i].proc));
+    }
+    table.ProcessTable(tchain);
+  }
+
+  table.SetupOutputWriter(opt::outfile);
+
+  table.OutputTable();
+  
+  return 0;
+}
+
+static int runfunc(int argc, char** argv) {
+
+  std::string pipeline;
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'Z' : parse_codec(arg.str()); break;
+    case 'B' : opt::index = true; break;
+    case 'E' : opt::graph_encoding = CYS_GRAPH_RAW; break;
+    default: die = true;
+    }
+  }
+
+  // the pipeline comes before the input and output
+  optind++;
+  while (optind < argc) {
+    if (pipeline.empty())
+      pipeline = argv[optind];
+    else if (opt::infile.empty())
+      opt::infile = argv[optind];
+    else if (opt::outfile.empty())
+      opt::outfile = argv[optind];
+    optind++;
+  }
+
+  if (die || pipeline.empty() || opt::infile.empty() || opt::outfile.empty()) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cysift run \"<module> <options> | <module> <options> | ...\" [csvfile] [outfile]\n"
+      "  Run a pipeline of modules in one process, without writing the cells\n"
+      "  out and reading them back in between modules\n"
+      "    csvfile: filepath or a '-' to stream to stdin\n"
+      "    Streaming modules: pheno, select, cut, clean, log10, head\n"
+      "    Table modules:     tumor, radialdens, delaunay\n"
+      "    Module options are as for the module on its own, and can't hold spaces\n"
+      "    -t [1]                    Number of threads\n"
+      "    --codec <name[:level]>    Compress output blocks: none, lz4, zstd (e.g. zstd:19)\n"
+      "    --index                   Write a sidecar index (<outfile>.idx) for seeking\n"
+      "    --raw-graph               Store the graph unsorted and uncoded, keeping neighbor order\n"
+      "    -v, --verbose             Increase output to stderr\n"
+      "  e.g. cysift run \"pheno -t gates.csv | tumor -k 25 -f 0.5 -o 131072 | radialdens -f radial.csv\" in.cys out.cys\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  // a bad argument to any stage is reported, as for the module on its own
+  try {
+    return run_pipeline(pipeline);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+}
+
 // return TRUE if you want the process to die and print message
 static bool in_out_process(int argc, char** argv) {
   